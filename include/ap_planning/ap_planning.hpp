@@ -35,4 +35,5 @@
 
 #include <ap_planning/ap_planning_common.hpp>
 #include <ap_planning/dss_planner.hpp>
+#include <ap_planning/planning_server.hpp>
 #include <ap_planning/sequential_step_planner.hpp>
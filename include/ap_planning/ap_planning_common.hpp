@@ -73,7 +73,13 @@ inline std::string toStr(const Result result) {
 }
 
 // Enumeration for the underlying planner
-enum PlannerType { PRM, PRMstar, RRT, RRTconnect };
+// PORTFOLIO runs RRTconnect, PRM, and LazyPRM at once, and keeps the first
+// solution found
+enum PlannerType { PRM, PRMstar, RRT, RRTconnect, PORTFOLIO };
+
+// The nearest neighbor structure of the DSS planner. DEFAULT_NN keeps the
+// one OMPL picks for the planner
+enum NearestNeighborsType { DEFAULT_NN, GNAT, SQRT_APPROX, LINEAR };
 
 /**
  * A struct for describing a single segment of a screw path
@@ -104,6 +110,59 @@ struct APPlanningRequest {
   PlannerType planner{PRM};
   double planning_time;
 
+  // How many start and goal configurations to solve IK for before planning.
+  // SPS only uses the start count
+  size_t num_start_configs{20};
+  size_t num_goal_configs{30};
+
+  // If true, DSS solves the goal configurations in the background while the
+  // planner runs instead of before it starts
+  bool lazy_goal_sampling{true};
+
+  // If true, DSS keeps the PRM / PRMstar roadmap and reuses it the next time
+  // the same task is planned
+  bool reuse_roadmap{false};
+
+  // If true, DSS plans in one flat RealVectorStateSpace holding the screw
+  // values followed by the joints, instead of a compound of the two
+  bool flat_state_space{false};
+
+  // The nearest neighbor structure DSS uses, and how much a unit of screw
+  // progress counts against a unit of joint motion in the state distance
+  NearestNeighborsType nearest_neighbors{DEFAULT_NN};
+  double screw_distance_weight{1.0};
+
+  // If true, the PORTFOLIO planner waits for every planner's solution and
+  // combines them into a shorter path
+  bool hybridize_portfolio{false};
+
+  // If true, DSS plans PRM and PRMstar with LazyPRM and LazyPRMstar, and its
+  // samplers only solve IK for the screw without checking collisions. The
+  // full checks, including collision, then only run on candidate paths
+  bool lazy_collision_checking{false};
+
+  // If true and the planning context has a reachability map for the group and
+  // EE frame, paths it can not reach are rejected before any IK is solved,
+  // and IK is seeded from the map
+  bool check_reachability{true};
+
+  // If true, IK solutions are shared through the planning context's IK
+  // cache, so repeated poses skip most IK calls
+  bool use_ik_cache{true};
+
+  // If true, the trajectory is timed to be as fast as the joint velocity and
+  // acceleration limits allow, and the screw limits below. Otherwise SPS
+  // moves along the screw at a fixed rate, and DSS leaves the times unset
+  bool time_parameterize{true};
+
+  // The screw velocity and acceleration limits of the timing. 0 means none
+  double max_screw_velocity{0};
+  double max_screw_acceleration{0};
+
+  // If true, the planner counts IK calls and state checks in the response
+  // statistics. Phase times are always filled in
+  bool collect_statistics{false};
+
   // Only set one of these
   std::vector<double> start_joint_state;
   geometry_msgs::PoseStamped start_pose;
@@ -113,13 +172,76 @@ struct APPlanningRequest {
   std::shared_ptr<affordance_primitives::ScrewConstraint> toConstraint() const;
 };
 
+/**
+ * A struct for describing where the planning time went. Times are wall times
+ * in seconds, and phases a planner does not have are left at 0
+ */
+struct APPlanningStatistics {
+  double total_time{0};
+  double scene_time{0};        // Getting the robot state and planning scene
+  double seeding_time{0};      // Solving IK for start / goal configurations
+  double solve_time{0};        // The OMPL solve, or the SPS rollouts
+  double simplify_time{0};     // Simplifying the solution path
+  double interpolate_time{0};  // Densifying the path, or making SPS waypoints
+  double validate_time{0};     // Re-checking the path in populateResponse
+
+  // These are only counted if the request asks for statistics
+  size_t ik_calls{0};
+  size_t ik_successes{0};
+  size_t ik_collision_checks{0};
+  size_t is_valid_calls{0};
+  size_t rejected_bounds{0};
+  size_t rejected_screw_error{0};
+  size_t rejected_phi_mismatch{0};
+  size_t rejected_collision{0};
+  size_t ik_cache_hits{0};
+  size_t ik_cache_misses{0};
+  size_t piece_joins{0};         // SPS split_path pieces joined to the last
+  size_t failed_piece_joins{0};  // Of those, the ones planned again
+  size_t roadmap_vertices{0};
+  size_t roadmap_edges{0};
+};
+
 /**
  * A struct for holding all the information returned from planning
  */
 struct APPlanningResponse {
   trajectory_msgs::JointTrajectory joint_trajectory;
-  double percentage_complete;
-  bool trajectory_is_valid;
-  double path_length;
+  double percentage_complete{0};
+  bool trajectory_is_valid{false};
+
+  // The path's length in the DSS state space, or in joint space for SPS. It
+  // is -1 if nothing was planned
+  double path_length{0};
+  APPlanningStatistics statistics;
+};
+
+/**
+ * A struct for setting how a batch of requests is planned
+ */
+struct APPlanningBatchOptions {
+  // How many requests to plan at once. If 0, the number of hardware threads
+  size_t num_threads{0};
+
+  // Stop once this many requests succeed. If 0, all requests are planned
+  size_t num_successes{0};
+
+  // If positive, also stop once a success has a path at most this long
+  double good_path_length{0};
+};
+
+/**
+ * A struct for holding the results of planning a batch of requests. Each
+ * vector has one entry per request, in the same order
+ */
+struct APPlanningBatchResponse {
+  std::vector<Result> results;
+  std::vector<APPlanningResponse> responses;
+
+  // False for requests that were skipped because the batch stopped early
+  std::vector<bool> planned;
+
+  // The successful request with the shortest path, if any succeeded
+  std::optional<size_t> best;
 };
 }  // namespace ap_planning
@@ -33,15 +33,23 @@
 #pragma once
 
 #include <ompl/geometric/SimpleSetup.h>
+#include <ompl/geometric/planners/prm/LazyPRM.h>
+#include <ompl/geometric/planners/prm/LazyPRMstar.h>
 #include <ompl/geometric/planners/prm/PRM.h>
 #include <ompl/geometric/planners/prm/PRMstar.h>
 #include <ompl/geometric/planners/rrt/RRT.h>
 #include <ompl/geometric/planners/rrt/RRTConnect.h>
 #include <affordance_primitives/screw_planning/screw_constraint.hpp>
 #include <ap_planning/ap_planning_common.hpp>
+#include <ap_planning/planning_context.hpp>
+#include <ap_planning/portfolio_planner.hpp>
+#include <ap_planning/reachability_map.hpp>
 #include <ap_planning/state_sampling.hpp>
 #include <ap_planning/state_utils.hpp>
+#include <ap_planning/time_parameterization.hpp>
 
+#include <list>
+#include <map>
 #include <optional>
 
 namespace ob = ompl::base;
@@ -55,6 +63,18 @@ class DSSPlanner {
  public:
   DSSPlanner(const std::string& move_group_name,
              const std::string& robot_description_name = "robot_description");
+
+  /** Constructor that shares the robot model and planning scene monitor with
+   * other planners
+   *
+   * @param planning_context The shared context
+   * @param move_group_name The group to plan for
+   * @param num_ik_threads How many threads seed IK. If 0, the number of
+   * hardware threads
+   */
+  DSSPlanner(const PlanningContextPtr& planning_context,
+             const std::string& move_group_name,
+             const size_t num_ik_threads = 0);
   ~DSSPlanner();
 
   /** Attempts to plan a screw-based trajectory
@@ -68,35 +88,192 @@ class DSSPlanner {
   ap_planning::Result plan(const APPlanningRequest& req,
                            APPlanningResponse& res);
 
+  /** Attempts to plan a screw-based trajectory in a scene snapshot, instead of
+   * the current scene
+   *
+   * @param req The planning request
+   * @param snapshot The scene and robot state to plan in
+   * @param res The planning response
+   * @return The result, like plan() above
+   */
+  ap_planning::Result plan(const APPlanningRequest& req,
+                           const SceneSnapshotPtr& snapshot,
+                           APPlanningResponse& res);
+
+  /** Attempts to plan a screw-based trajectory, starting from the solution of
+   * an earlier plan for the same task
+   *
+   * If the hint's path is still valid, it is used without planning. Otherwise
+   * its start and end are added to the start and goal states
+   *
+   * @param req The planning request
+   * @param hint The response of the earlier plan. It may be the same object as
+   * res
+   * @param res The planning response
+   * @return The result, like plan() above
+   */
+  ap_planning::Result plan(const APPlanningRequest& req,
+                           const APPlanningResponse& hint,
+                           APPlanningResponse& res);
+
+  /** Plans in a scene snapshot, stopping early if cancel is set
+   *
+   * @param req The planning request
+   * @param snapshot The scene and robot state to plan in
+   * @param cancel If not null, planning stops once this is true
+   * @param hint If not null, a trajectory from an earlier plan of this task
+   * @param res The planning response
+   * @return The result
+   */
+  ap_planning::Result plan(const APPlanningRequest& req,
+                           const SceneSnapshotPtr& snapshot,
+                           const std::atomic<bool>* cancel,
+                           const trajectory_msgs::JointTrajectory* hint,
+                           APPlanningResponse& res);
+
+  /** Plans several requests in parallel, all in one snapshot of the current
+   * scene
+   *
+   * @param reqs The planning requests
+   * @param options How many to plan at once and when to stop early
+   * @param batch_res The result and response of each request
+   */
+  void planBatch(const std::vector<APPlanningRequest>& reqs,
+                 const APPlanningBatchOptions& options,
+                 APPlanningBatchResponse& batch_res);
+
+  /** Saves the cached roadmap for a task to a file
+   *
+   * @param req A request for the task. It must have been planned with
+   * reuse_roadmap set
+   * @param filename The file to save to
+   * @return True if a roadmap was found and saved, false otherwise
+   */
+  bool saveRoadmap(const APPlanningRequest& req, const std::string& filename);
+
+  /** Loads a roadmap saved with saveRoadmap(). It is used the next time the
+   * same task is planned with reuse_roadmap set, and its edges are re-validated
+   * as they are used
+   *
+   * @param req A request for the task
+   * @param filename The file to load from
+   */
+  void loadRoadmap(const APPlanningRequest& req, const std::string& filename);
+
+  /** Forgets all cached roadmaps
+   */
+  void clearRoadmapCache();
+
  protected:
+  // A roadmap kept between plans for the same task
+  struct RoadmapCacheEntry {
+    ompl::geometric::SimpleSetupPtr ss;
+    DSSContextPtr context;
+    std::size_t scene_fingerprint;
+    std::list<std::string>::iterator usage;
+  };
   ompl::base::StateSpacePtr state_space_;
   ompl::geometric::SimpleSetupPtr ss_;
   Eigen::Isometry3d start_pose_, goal_pose_;
+  std::shared_ptr<const ScrewPoseTable> pose_table_;
   std::shared_ptr<affordance_primitives::ScrewConstraint> constraints_;
+  PlanningContextPtr planning_context_;
   moveit::core::RobotModelPtr kinematic_model_;
   moveit::core::RobotStatePtr kinematic_state_;
   std::shared_ptr<moveit::core::JointModelGroup> joint_model_group_;
   kinematics::KinematicsBasePtr ik_solver_;
+  std::vector<kinematics::KinematicsBasePtr> ik_solvers_;
   planning_scene_monitor::PlanningSceneMonitorPtr psm_;
-  std::shared_ptr<planning_scene_monitor::LockedPlanningSceneRO>
-      planning_scene_;
+  planning_scene::PlanningSceneConstPtr planning_scene_;
+  std::size_t scene_fingerprint_;
+  DSSContextPtr context_;
+  std::shared_ptr<PlanningCounters> counters_;
+  ReachabilityMapConstPtr reachability_map_;
+  std::shared_ptr<ScrewGoal> screw_goal_;
+  std::shared_ptr<ScrewGoalSampler> goal_sampler_;
   bool passed_start_config_;
   std::string robot_description_name_;
 
+  // Cached roadmaps, and roadmap files to use for them, keyed by roadmapKey().
+  // When there are too many roadmaps, the one used least recently is dropped
+  std::map<std::string, RoadmapCacheEntry> roadmap_cache_;
+  std::list<std::string> roadmap_usage_order_;
+  std::map<std::string, std::string> roadmap_files_;
+
+  // Planners for the other threads of planBatch()
+  std::vector<std::unique_ptr<DSSPlanner>> batch_workers_;
+
+  // Threads for re-validating solutions, one per IK solver
+  std::unique_ptr<WorkerPool> validate_pool_;
+
   void cleanUp();
 
+  /** Fills in the counters, roadmap size, and total time of the statistics
+   *
+   * @param req The planning request
+   * @param plan_start When plan() was called
+   * @param res The planning response
+   */
+  void finishStatistics(const APPlanningRequest& req,
+                        const ros::WallTime& plan_start,
+                        APPlanningResponse& res);
+
+  /** Stops solving goal states in the background, if it was running
+   */
+  void stopGoalSampling();
+
+  /** Sets up the context, state space, and SimpleSetup for a new plan
+   *
+   * @param req The planning request
+   * @return True if successful, false otherwise
+   */
+  bool setUpPlanner(const APPlanningRequest& req);
+
   bool setupStateSpace(const APPlanningRequest& req);
   void getStartTF(const APPlanningRequest& req);
+
+  /** Gives the context the poses along the screw path, and calculates the
+   * goal pose. plan() makes the poses once the reference frame is set
+   */
+  void setUpPoseTable();
   bool setSpaceParameters(const APPlanningRequest& req,
                           ompl::base::StateSpacePtr& space);
   bool setSimpleSetup(const ompl::base::StateSpacePtr& space,
                       const APPlanningRequest& req);
 
+  /** Makes a key that identifies a task: the screw path, its reference
+   * frame, the move group, the EE frame, and the planner. The reference frame
+   * is keyed on the rounded start EE pose, so nearby starts share a roadmap
+   *
+   * @param req The planning request
+   * @return The key
+   */
+  std::string roadmapKey(const APPlanningRequest& req) const;
+
+  /** Sets up the planner from a cached roadmap for this task, if there is one
+   *
+   * If the planning scene changed since the roadmap was made, the roadmap is
+   * given to a LazyPRM so its edges are re-validated as they are used
+   *
+   * @param req The planning request
+   * @param key The key for this task
+   * @return True if a cached roadmap is being used, false otherwise
+   */
+  bool useCachedRoadmap(const APPlanningRequest& req, const std::string& key);
+
+  /** Adds the current planner to the roadmap cache. If a roadmap file was
+   * loaded for this task, the planner is first replaced with one built from it
+   *
+   * @param req The planning request
+   * @param key The key for this task
+   */
+  void cacheRoadmap(const APPlanningRequest& req, const std::string& key);
+
   /** Solves IK for the start and goal configurations
    *
    * @param req The planning request
    * @param num_start Number of starting configurations to generate
-   * @param num_goal Number of goal configurations to generate
+   * @param num_goal Number of goal configurations to generate. May be 0
    * @param start_configs Generated starting configs
    * @param goal_configs Generated goal configs
    * @return True if successful, false otherwise
@@ -109,7 +286,7 @@ class DSSPlanner {
   /** Sets the start state to the requested and solves IK for goal states
    *
    * @param req The planning request
-   * @param num_goal Number of goal configurations to generate
+   * @param num_goal Number of goal configurations to generate. May be 0
    * @param start_configs Generated starting configs
    * @param goal_configs Generated goal configs
    * @return True if successful, false otherwise
@@ -118,10 +295,25 @@ class DSSPlanner {
                       std::vector<std::vector<double>>& start_configs,
                       std::vector<std::vector<double>>& goal_configs);
 
+  /** Warm starts the plan from an earlier trajectory for this task. The start
+   * and goal states must already be set
+   *
+   * The trajectory's points become states on the screw path. Its first state
+   * is added to the start states (or replaced by the requested start), and its
+   * last to the goal states. If every state and motion is still valid, the
+   * path is added as a solution
+   *
+   * @param req The planning request
+   * @param hint The earlier trajectory
+   * @return True if the hint was added as a solution, false otherwise
+   */
+  bool useWarmStart(const APPlanningRequest& req,
+                    const trajectory_msgs::JointTrajectory& hint);
+
   /** Given a solution path, this will fill in the planning response
    *
    * Note: it will interpolate the path, with may invalidate an otherwise valid
-   * path
+   * path. The trajectory is timed if the request asks for it
    *
    * @param solution The un-interpolated found path
    * @param req The original planning request
@@ -0,0 +1,165 @@
+///////////////////////////////////////////////////////////////////////////////
+//      Title     : ik_cache.hpp
+//      Project   : ap_planning
+//      Created   : 10/14/2026
+//      Author    : Adam Pettinger
+//      Copyright : Copyright© The University of Texas at Austin, 2014-2022. All
+//      rights reserved.
+//
+//          All files within this directory are subject to the following, unless
+//          an alternative license is explicitly included within the text of
+//          each file.
+//
+//          This software and documentation constitute an unpublished work
+//          and contain valuable trade secrets and proprietary information
+//          belonging to the University. None of the foregoing material may be
+//          copied or duplicated or disclosed without the express, written
+//          permission of the University. THE UNIVERSITY EXPRESSLY DISCLAIMS ANY
+//          AND ALL WARRANTIES CONCERNING THIS SOFTWARE AND DOCUMENTATION,
+//          INCLUDING ANY WARRANTIES OF MERCHANTABILITY AND/OR FITNESS FOR A
+//          PARTICULAR PURPOSE, AND WARRANTIES OF PERFORMANCE, AND ANY WARRANTY
+//          THAT MIGHT OTHERWISE ARISE FROM COURSE OF DEALING OR USAGE OF TRADE.
+//          NO WARRANTY IS EITHER EXPRESS OR IMPLIED WITH RESPECT TO THE USE OF
+//          THE SOFTWARE OR DOCUMENTATION. Under no circumstances shall the
+//          University be liable for incidental, special, indirect, direct or
+//          consequential damages or loss of profits, interruption of business,
+//          or related expenses which may arise from use of software or
+//          documentation, including but not limited to those resulting from
+//          defects in software and/or documentation, or loss or inaccuracy of
+//          data of any kind.
+//
+
+#pragma once
+
+#include <geometry_msgs/Pose.h>
+
+#include <array>
+#include <cstdint>
+#include <list>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+namespace ap_planning {
+
+/**
+ * A bounded, thread safe cache of IK solutions. Solutions are keyed by the
+ * move group, the EE pose rounded to a resolution, and the bucket of the seed
+ * state they were solved from, so different seeds keep different solutions.
+ * Each solution is tagged with the scene fingerprint it was found collision
+ * free in (see sceneFingerprint()), so callers know when to check it again
+ *
+ * A hit may be for a pose up to the resolution away from the asked pose. When
+ * the cache is full, the pose used least recently is dropped
+ */
+class IKCache {
+ public:
+  /** Constructor
+   *
+   * @param max_poses The most poses to keep
+   * @param max_solutions_per_pose The most seed buckets to keep per pose
+   * @param position_resolution How finely positions are rounded (meters)
+   * @param orientation_resolution How finely quaternions are rounded
+   * @param seed_resolution The width of a seed bucket, per joint (radians or
+   * meters)
+   */
+  IKCache(const size_t max_poses = 100000,
+          const size_t max_solutions_per_pose = 32,
+          const double position_resolution = 1e-4,
+          const double orientation_resolution = 1e-4,
+          const double seed_resolution = 0.5);
+
+  /** Finds a solution solved from the same seed bucket
+   *
+   * @param group_name The move group
+   * @param pose The IK pose
+   * @param seed The seed state
+   * @param scene_fingerprint The fingerprint of the scene being planned in
+   * @param solution Set to the solution, if one was found
+   * @param collision_free Set to true if the solution was checked in this
+   * scene, or false if it must be checked again
+   * @return True if a solution was found, false otherwise
+   */
+  bool find(const std::string &group_name, const geometry_msgs::Pose &pose,
+            const std::vector<double> &seed,
+            const std::size_t scene_fingerprint, std::vector<double> &solution,
+            bool &collision_free) const;
+
+  /** Gets every solution for a pose, from any seed
+   *
+   * @param group_name The move group
+   * @param pose The IK pose
+   * @param scene_fingerprint The fingerprint of the scene being planned in
+   * @param solutions Set to the solutions
+   * @param collision_free Set to whether each solution was checked in this
+   * scene
+   */
+  void findAll(const std::string &group_name, const geometry_msgs::Pose &pose,
+               const std::size_t scene_fingerprint,
+               std::vector<std::vector<double>> &solutions,
+               std::vector<bool> &collision_free) const;
+
+  /** Adds a collision free solution, replacing any for the same seed bucket
+   *
+   * @param group_name The move group
+   * @param pose The IK pose
+   * @param seed The seed state the solution was solved from
+   * @param solution The solution
+   * @param scene_fingerprint The fingerprint of the scene it was checked in
+   */
+  void insert(const std::string &group_name, const geometry_msgs::Pose &pose,
+              const std::vector<double> &seed,
+              const std::vector<double> &solution,
+              const std::size_t scene_fingerprint);
+
+  void clear();
+
+  size_t size() const;
+
+ protected:
+  struct PoseKey {
+    std::string group_name;
+    std::array<int64_t, 7> pose;
+
+    bool operator==(const PoseKey &other) const {
+      return pose == other.pose && group_name == other.group_name;
+    }
+  };
+  struct PoseKeyHash {
+    std::size_t operator()(const PoseKey &key) const;
+  };
+  struct Solution {
+    std::vector<int64_t> seed_bucket;
+    std::vector<double> joints;
+    std::size_t scene_fingerprint;
+  };
+
+  PoseKey poseKey(const std::string &group_name,
+                  const geometry_msgs::Pose &pose) const;
+  std::vector<int64_t> seedBucket(const std::vector<double> &seed) const;
+
+  size_t max_poses_, max_solutions_per_pose_;
+  double position_resolution_, orientation_resolution_, seed_resolution_;
+
+  // Poses from least to most recently used. Lookups reorder it, so it is
+  // mutable
+  mutable std::list<PoseKey> usage_order_;
+  struct Entry {
+    std::vector<Solution> solutions;
+    std::list<PoseKey>::iterator usage;
+  };
+
+  /** Finds a pose's entry and marks it as just used. The mutex must be held
+   *
+   * @param key The pose key
+   * @return The entry, or nullptr if the pose is not cached
+   */
+  const Entry *use(const PoseKey &key) const;
+
+  mutable std::mutex mutex_;
+  std::unordered_map<PoseKey, Entry, PoseKeyHash> entries_;
+};
+using IKCachePtr = std::shared_ptr<IKCache>;
+}  // namespace ap_planning
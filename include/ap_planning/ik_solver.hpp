@@ -36,6 +36,9 @@
 #include <ros/ros.h>
 #include <ap_planning/ik_solver_base.hpp>
 #include <ap_planning/state_sampling.hpp>
+#include <ap_planning/time_parameterization.hpp>
+
+#include <atomic>
 
 namespace ap_planning {
 
@@ -58,7 +61,8 @@ class IKSolver : public IKSolverBase {
    * Required: move_group_name
    *
    * Optional: robot_description_name, joint_tolerance, waypoint_dist,
-   * waypoint_ang, condition_num_limit
+   * waypoint_ang, condition_num_limit, condition_num_method, num_threads,
+   * differential_ik, split_path, max_piece_waypoints, coarse_waypoint_stride
    *
    * @param nh Parameters are considered to be namespaced to this node
    * @return False if the parameters couldn't be found, true otherwise
@@ -66,6 +70,18 @@ class IKSolver : public IKSolverBase {
   bool initialize(const ros::NodeHandle& nh, const std::string& move_group_name,
                   const std::string& robot_description_name) override;
 
+  /** Initializes the solver like above, but shares the robot model, planning
+   * scene monitor, and IK solvers from a context
+   *
+   * @param nh Parameters are considered to be namespaced to this node
+   * @param planning_context The shared context
+   * @param move_group_name The group to plan for
+   * @return False if the parameters couldn't be found, true otherwise
+   */
+  bool initialize(const ros::NodeHandle& nh,
+                  const PlanningContextPtr& planning_context,
+                  const std::string& move_group_name) override;
+
   /** Solves 1 IK request
    *
    * @param jmg Valid JointModelGroup
@@ -107,7 +123,49 @@ class IKSolver : public IKSolverBase {
   ap_planning::Result plan(const APPlanningRequest& req,
                            APPlanningResponse& res) override;
 
+  /** Plans a joint trajectory based on a screw primitive, in a scene snapshot
+   *
+   * @param req The planning request
+   * @param snapshot The scene and robot state to plan in
+   * @param res The planning response
+   * @return The result
+   */
+  ap_planning::Result plan(const APPlanningRequest& req,
+                           const SceneSnapshotPtr& snapshot,
+                           APPlanningResponse& res) override;
+
+  /** Plans a joint trajectory based on a screw primitive, in a scene snapshot,
+   * starting from an earlier plan for the same task
+   *
+   * Each waypoint first tries the hint's joint state for it. If that state
+   * still reaches the waypoint without collision, no IK is solved for it.
+   * Otherwise it seeds IK. Every transition is verified either way
+   *
+   * @param req The planning request
+   * @param snapshot The scene and robot state to plan in
+   * @param hint The response of the earlier plan
+   * @param res The planning response
+   * @return The result
+   */
+  ap_planning::Result plan(const APPlanningRequest& req,
+                           const SceneSnapshotPtr& snapshot,
+                           const APPlanningResponse& hint,
+                           APPlanningResponse& res) override;
+
  protected:
+  /** Plans like above, with an optional hint
+   *
+   * @param req The planning request
+   * @param snapshot The scene and robot state to plan in
+   * @param hint If not null, a trajectory from an earlier plan of this task
+   * @param res The planning response
+   * @return The result
+   */
+  ap_planning::Result plan(const APPlanningRequest& req,
+                           const SceneSnapshotPtr& snapshot,
+                           const trajectory_msgs::JointTrajectory* hint,
+                           APPlanningResponse& res);
+
   /** Plans a joint trajectory based on an affordance trajectory
    *
    *
@@ -122,17 +180,203 @@ class IKSolver : public IKSolverBase {
       const std::vector<double>& start_state, const std::string& ee_name,
       APPlanningResponse& res) override;
 
+  /**
+   * The Cartesian waypoints a rollout follows, in the planning frame
+   */
+  struct SPSWaypoints {
+    std::vector<Eigen::Isometry3d, Eigen::aligned_allocator<Eigen::Isometry3d>>
+        poses;
+
+    // Seconds from the start of the trajectory
+    std::vector<double> times;
+
+    // Joint states to try first, from an earlier plan. Column i is for
+    // waypoint i, and is only used as is when it is close to the rollout's
+    // last point. Empty if there is no hint
+    Eigen::MatrixXd hint;
+
+    // The first waypoint of each screw segment after the first
+    std::vector<size_t> segment_starts;
+
+    /** Gets some of the waypoints, with their hints
+     *
+     * @param begin The first waypoint
+     * @param end One past the last waypoint
+     * @return The waypoints in [begin, end)
+     */
+    SPSWaypoints slice(const size_t begin, const size_t end) const;
+  };
+
+  /**
+   * The joint states a rollout found. Column i is the joint state for
+   * waypoint i, and only the first num_points columns are filled in
+   */
+  struct SPSRollout {
+    Eigen::MatrixXd positions;
+
+    // The multi-resolution seeds for each waypoint, if they are used
+    Eigen::MatrixXd seeds;
+    size_t num_points = 0;
+    double percentage_complete = 0.0;
+  };
+
+  /** Runs one Sequential Path Stepping rollout from a starting joint state
+   *
+   * @param waypoints The Cartesian waypoints to plan for
+   * @param start_state The starting state of the robot
+   * @param ee_name The name of the EE link
+   * @param ik_solver The IK solver to use. Only this rollout may use it
+   * @param cancel Stops the rollout early when set by another thread
+   * @param robot_state A robot state this rollout can change
+   * @param rollout The joint states found. Its storage is reused
+   * @return The result
+   */
+  ap_planning::Result planRollout(
+      const SPSWaypoints& waypoints, const std::vector<double>& start_state,
+      const std::string& ee_name,
+      const kinematics::KinematicsBasePtr& ik_solver,
+      const std::atomic<bool>& cancel, moveit::core::RobotState& robot_state,
+      SPSRollout& rollout);
+
+  /** Solves IK at some of the waypoints in order, each seeded from the one
+   * before, and interpolates between the solutions. The result seeds a full
+   * resolution rollout, and a gap it could not cross fails early
+   *
+   * @param waypoints The Cartesian waypoints to plan for
+   * @param indices The waypoints to solve, in increasing order
+   * @param start_state The joint state at the first waypoint
+   * @param ik_solver The IK solver to use
+   * @param cancel Stops early when set by another thread
+   * @param robot_state A robot state this can change
+   * @param seeds Set to one joint state per waypoint. Its storage is reused
+   * @return The result
+   */
+  ap_planning::Result solveCoarse(
+      const SPSWaypoints& waypoints, const std::vector<size_t>& indices,
+      const std::vector<double>& start_state,
+      const kinematics::KinematicsBasePtr& ik_solver,
+      const std::atomic<bool>& cancel, moveit::core::RobotState& robot_state,
+      Eigen::MatrixXd& seeds);
+
+  /** Runs one rollout like planRollout(), but splits the waypoints into
+   * pieces and plans them in parallel
+   *
+   * Pieces start at each screw segment, and are split further to at most
+   * max_piece_waypoints_ waypoints. Each piece after the first starts from an
+   * IK solution for its first waypoint, seeded from the hint or else chained
+   * from the piece before with solveCoarse(). The pieces are then joined in
+   * order, and a piece that failed or does not join the one before it is
+   * planned again from where that one ended
+   *
+   * @param waypoints The Cartesian waypoints to plan for
+   * @param start_state The starting state of the robot
+   * @param ee_name The name of the EE link
+   * @param cancel Stops the rollout early when set by another thread
+   * @param robot_state A robot state this rollout can change
+   * @param rollout The joint states found. Its storage is reused
+   * @return The result
+   */
+  ap_planning::Result planPieces(const SPSWaypoints& waypoints,
+                                 const std::vector<double>& start_state,
+                                 const std::string& ee_name,
+                                 const std::atomic<bool>& cancel,
+                                 moveit::core::RobotState& robot_state,
+                                 SPSRollout& rollout);
+
+  /** Converts a rollout to the joint trajectory of a response
+   *
+   * @param waypoints The waypoints the rollout followed
+   * @param rollout The rollout
+   * @param success Whether the rollout reached the end
+   * @param res The planning response to fill out
+   */
+  void toResponse(const SPSWaypoints& waypoints, const SPSRollout& rollout,
+                  const bool success, APPlanningResponse& res);
+
+  /** Solves 1 IK request using a specific solver instance
+   *
+   * @param ik_solver The IK solver to use
+   * @param jmg Valid JointModelGroup
+   * @param target_pose The pose to solve for
+   * @param robot_state The robot state. It is updated so the positions match
+   * the solution
+   * @param ik_solution Set to the solution. Its storage is reused
+   * @return True if a solution was found, false otherwise
+   */
+  bool solveIK(const kinematics::KinematicsBasePtr& ik_solver,
+               const std::shared_ptr<moveit::core::JointModelGroup>& jmg,
+               const geometry_msgs::Pose& target_pose,
+               moveit::core::RobotState& robot_state,
+               std::vector<double>& ik_solution);
+
+  /** Moves to the next waypoint with damped least squares Jacobian steps
+   * from the current state, instead of a full IK search
+   *
+   * @param jmg Valid JointModelGroup
+   * @param target The pose to move to, in the model frame
+   * @param ee_frame The frame to move to target
+   * @param robot_state The robot state. It is updated to the result, even
+   * if the step fails
+   * @param jacobian The group Jacobian at robot_state, or empty. On success,
+   * it is the Jacobian at the result, and it is cleared otherwise
+   * @return True if the step converged without collision, false otherwise
+   */
+  bool stepIK(const std::shared_ptr<moveit::core::JointModelGroup>& jmg,
+              const Eigen::Isometry3d& target, const std::string& ee_frame,
+              moveit::core::RobotState& robot_state,
+              Eigen::MatrixXd& jacobian);
+
+  /** Checks a robot state against the planning scene
+   *
+   * @param robot_state The robot state. Its transforms must be up to date
+   * @return True if the state is not in collision, false otherwise
+   */
+  bool isCollisionFree(const moveit::core::RobotState& robot_state);
+
+  /** Verifies a single joint state transition like above, with the group
+   * Jacobian at the end state already calculated
+   *
+   * @param positions_a The start joint state
+   * @param positions_b The end joint state
+   * @param wp_duration The time between the joint states (seconds)
+   * @param jmg Joint model group for checking velocity limits
+   * @param jacobian_b The group Jacobian at the end state
+   * @return The result
+   */
+  ap_planning::Result verifyTransition(
+      const Eigen::Ref<const Eigen::VectorXd>& positions_a,
+      const Eigen::Ref<const Eigen::VectorXd>& positions_b,
+      const double wp_duration,
+      const std::shared_ptr<moveit::core::JointModelGroup>& jmg,
+      const Eigen::MatrixXd& jacobian_b);
+
   // This holds the kinematics solver
   kinematics::KinematicsBasePtr ik_solver_;
 
+  // One solver per thread for multi-start planning, from the context's pool
+  std::vector<kinematics::KinematicsBasePtr> ik_solvers_;
+
   planning_scene_monitor::PlanningSceneMonitorPtr psm_;
-  std::shared_ptr<planning_scene_monitor::LockedPlanningSceneRO>
-      planning_scene_;
+  planning_scene::PlanningSceneConstPtr planning_scene_;
+
+  // The counters for the current plan, or null if statistics are not collected
+  std::shared_ptr<PlanningCounters> counters_;
+
+  // The IK cache for the current plan, or null if it is not used, and the
+  // fingerprint of the plan's scene
+  IKCachePtr ik_cache_;
+  std::size_t scene_fingerprint_;
 
   // Planning parameters
   double joint_tolerance_;
   double waypoint_dist_, waypoint_ang_;
   double condition_num_limit_;
+  bool condition_num_svd_;
+  bool differential_ik_;
+  bool split_path_;
+  int max_piece_waypoints_;
+  int coarse_waypoint_stride_;
+  int num_threads_;
 
   void setUp(APPlanningResponse& res);
 
@@ -147,6 +391,16 @@ class IKSolver : public IKSolverBase {
   bool checkPointsAreClose(
       const trajectory_msgs::JointTrajectoryPoint& point_a,
       const trajectory_msgs::JointTrajectoryPoint& point_b);
+
+  /** Same as above, for joint states stored as vectors
+   *
+   * @param positions_a The start joint state
+   * @param positions_b The end joint state
+   * @return True if every joint is within joint_tolerance_, false otherwise
+   */
+  bool checkPointsAreClose(
+      const Eigen::Ref<const Eigen::VectorXd>& positions_a,
+      const Eigen::Ref<const Eigen::VectorXd>& positions_b);
 };
 
 }  // namespace ap_planning
@@ -42,6 +42,7 @@
 #include <moveit/robot_model_loader/robot_model_loader.h>
 #include <moveit/robot_state/robot_state.h>
 #include <ap_planning/ap_planning_common.hpp>
+#include <ap_planning/planning_context.hpp>
 
 namespace ap_planning {
 /**
@@ -53,6 +54,22 @@ class IKSolverBase {
                           const std::string& move_group_name,
                           const std::string& robot_description_name) = 0;
 
+  /** Initializes the solver with a robot model and planning scene monitor
+   * shared with other planners. Solvers that do not override this load their
+   * own from the context's robot description
+   *
+   * @param nh ROS node handle
+   * @param planning_context The shared context
+   * @param move_group_name The group to plan for
+   * @return True if successful, false otherwise
+   */
+  virtual bool initialize(const ros::NodeHandle& nh,
+                          const PlanningContextPtr& planning_context,
+                          const std::string& move_group_name) {
+    return initialize(nh, move_group_name,
+                      planning_context->getRobotDescriptionName());
+  }
+
   /** Solves 1 IK request and updates the passed robot state and trajectory
    * point
    *
@@ -92,6 +109,39 @@ class IKSolverBase {
   virtual ap_planning::Result plan(const APPlanningRequest& req,
                                    APPlanningResponse& res) = 0;
 
+  /** Plans a joint trajectory based on a screw primitive, in a scene snapshot
+   * instead of the current scene. Solvers that do not override this ignore
+   * the snapshot
+   *
+   * @param req The planning request
+   * @param snapshot The scene and robot state to plan in
+   * @param res The planning response
+   * @return The result
+   */
+  virtual ap_planning::Result plan(const APPlanningRequest& req,
+                                   const SceneSnapshotPtr& snapshot,
+                                   APPlanningResponse& res) {
+    return plan(req, res);
+  }
+
+  /** Plans a joint trajectory based on a screw primitive, in a scene snapshot,
+   * starting from the solution of an earlier plan for the same task. Solvers
+   * that do not override this ignore the hint
+   *
+   * @param req The planning request
+   * @param snapshot The scene and robot state to plan in
+   * @param hint The response of the earlier plan. It may be the same object as
+   * res
+   * @param res The planning response
+   * @return The result
+   */
+  virtual ap_planning::Result plan(const APPlanningRequest& req,
+                                   const SceneSnapshotPtr& snapshot,
+                                   const APPlanningResponse& hint,
+                                   APPlanningResponse& res) {
+    return plan(req, snapshot, res);
+  }
+
   /** Plans a joint trajectory based on an affordance trajectory
    *
    *
@@ -113,5 +163,6 @@ class IKSolverBase {
   ros::NodeHandle nh_;
   std::shared_ptr<moveit::core::JointModelGroup> joint_model_group_;
   moveit::core::RobotModelPtr kinematic_model_;
+  PlanningContextPtr planning_context_;
 };
 }  // namespace ap_planning
@@ -0,0 +1,196 @@
+///////////////////////////////////////////////////////////////////////////////
+//      Title     : planning_context.hpp
+//      Project   : ap_planning
+//      Created   : 10/14/2026
+//      Author    : Adam Pettinger
+//      Copyright : Copyright© The University of Texas at Austin, 2014-2022. All
+//      rights reserved.
+//
+//          All files within this directory are subject to the following, unless
+//          an alternative license is explicitly included within the text of
+//          each file.
+//
+//          This software and documentation constitute an unpublished work
+//          and contain valuable trade secrets and proprietary information
+//          belonging to the University. None of the foregoing material may be
+//          copied or duplicated or disclosed without the express, written
+//          permission of the University. THE UNIVERSITY EXPRESSLY DISCLAIMS ANY
+//          AND ALL WARRANTIES CONCERNING THIS SOFTWARE AND DOCUMENTATION,
+//          INCLUDING ANY WARRANTIES OF MERCHANTABILITY AND/OR FITNESS FOR A
+//          PARTICULAR PURPOSE, AND WARRANTIES OF PERFORMANCE, AND ANY WARRANTY
+//          THAT MIGHT OTHERWISE ARISE FROM COURSE OF DEALING OR USAGE OF TRADE.
+//          NO WARRANTY IS EITHER EXPRESS OR IMPLIED WITH RESPECT TO THE USE OF
+//          THE SOFTWARE OR DOCUMENTATION. Under no circumstances shall the
+//          University be liable for incidental, special, indirect, direct or
+//          consequential damages or loss of profits, interruption of business,
+//          or related expenses which may arise from use of software or
+//          documentation, including but not limited to those resulting from
+//          defects in software and/or documentation, or loss or inaccuracy of
+//          data of any kind.
+//
+///////////////////////////////////////////////////////////////////////////////
+
+#pragma once
+
+#include <moveit/planning_scene_monitor/planning_scene_monitor.h>
+#include <moveit/robot_model/robot_model.h>
+#include <moveit/robot_model_loader/robot_model_loader.h>
+
+#include <atomic>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <utility>
+#include <vector>
+
+namespace ap_planning {
+class PlanningContext;
+using PlanningContextPtr = std::shared_ptr<PlanningContext>;
+class ReachabilityMap;
+using ReachabilityMapConstPtr = std::shared_ptr<const ReachabilityMap>;
+class IKCache;
+using IKCachePtr = std::shared_ptr<IKCache>;
+
+/**
+ * A planning scene and robot state taken at one time, so several plans can
+ * use the same scene. The scene is a copy, so the monitor can keep updating
+ * while this exists. The octomap is copied too, since the monitor updates its
+ * own in place
+ */
+struct SceneSnapshot {
+  planning_scene::PlanningSceneConstPtr planning_scene;
+  moveit::core::RobotStatePtr robot_state;
+
+  // The context's scene version when the scene was copied
+  std::size_t scene_version{0};
+};
+using SceneSnapshotPtr = std::shared_ptr<const SceneSnapshot>;
+
+/**
+ * Holds the robot model, planning scene monitor, and IK solvers that planners
+ * can share. Loading the model and starting the monitors is slow, so every
+ * planner in a node for the same robot description should use one context
+ */
+class PlanningContext : public std::enable_shared_from_this<PlanningContext> {
+ public:
+  /** Loads the robot model and starts the scene and state monitors. Use get()
+   * to share contexts instead
+   *
+   * @param robot_description_name The robot description parameter name
+   */
+  PlanningContext(const std::string& robot_description_name);
+
+  /** Gets the context for a robot description, creating it if no planner is
+   * using one already
+   *
+   * @param robot_description_name The robot description parameter name
+   * @return The context
+   */
+  static PlanningContextPtr get(
+      const std::string& robot_description_name = "robot_description");
+
+  /** Checks if the robot model and monitors were set up
+   *
+   * @return True if the context can be used, false otherwise
+   */
+  bool isValid() const { return kinematic_model_ && psm_; }
+
+  const std::string& getRobotDescriptionName() const {
+    return robot_description_name_;
+  }
+  const moveit::core::RobotModelPtr& getRobotModel() const {
+    return kinematic_model_;
+  }
+  const planning_scene_monitor::PlanningSceneMonitorPtr&
+  getPlanningSceneMonitor() const {
+    return psm_;
+  }
+
+  /** Gets a counter that goes up every time the monitor changes the world or
+   * its transforms, including each octomap update. Octomaps are changed in
+   * place, so the scene itself can not show that they changed. Use this to
+   * tell if collision checks from an earlier scene still hold
+   *
+   * @return The scene version
+   */
+  std::size_t getSceneVersion() const { return *scene_version_; }
+
+  /** Updates the planning scene from the monitor and takes a snapshot of it
+   * and the current robot state. The scene is only locked while it is copied,
+   * and the octomap while it is copied
+   *
+   * @return The snapshot
+   */
+  SceneSnapshotPtr takeSnapshot() const;
+
+  /** Gets a joint model group. It is shared with the robot model, not copied
+   *
+   * @param group_name The name of the group
+   * @return The group, or nullptr if the model does not have it
+   */
+  moveit::core::JointModelGroupPtr getJointModelGroup(
+      const std::string& group_name) const;
+
+  /** Gets IK solvers for a group from the pool. Each solver is only handed to
+   * one caller at a time, so each can be used on its own thread, and it goes
+   * back to the pool once the caller releases it
+   *
+   * @param group_name The name of the group
+   * @param num_solvers How many solvers to get
+   * @return The solvers. There may be fewer than requested if the group can
+   * not allocate new solvers, but there is at least one if the group has a
+   * solver
+   */
+  std::vector<kinematics::KinematicsBasePtr> acquireIKSolvers(
+      const std::string& group_name, const size_t num_solvers);
+
+  /** Loads a reachability map, replacing any map for the same group and EE
+   * frame
+   *
+   * @param filename The map file
+   * @return True if the map was loaded and matches the robot, false otherwise
+   */
+  bool loadReachabilityMap(const std::string& filename);
+
+  /** Gets the reachability map for a group and EE frame
+   *
+   * @param group_name The name of the group
+   * @param ee_frame_name The EE frame
+   * @return The map, or nullptr if none was loaded
+   */
+  ReachabilityMapConstPtr getReachabilityMap(
+      const std::string& group_name, const std::string& ee_frame_name) const;
+
+  /** Gets the IK cache every planner of this context shares
+   *
+   * @return The cache
+   */
+  const IKCachePtr& getIKCache() const { return ik_cache_; }
+
+ protected:
+  void releaseIKSolver(const std::string& group_name,
+                       const kinematics::KinematicsBasePtr& solver);
+
+  std::string robot_description_name_;
+  robot_model_loader::RobotModelLoaderPtr robot_model_loader_;
+  moveit::core::RobotModelPtr kinematic_model_;
+  planning_scene_monitor::PlanningSceneMonitorPtr psm_;
+
+  // Bumped by the monitor's update callback. It is shared with the callback,
+  // since the monitor can outlive this context
+  std::shared_ptr<std::atomic<std::size_t>> scene_version_;
+
+  // Solvers not handed out right now, by group
+  std::mutex ik_mutex_;
+  std::map<std::string, std::vector<kinematics::KinematicsBasePtr>>
+      free_ik_solvers_;
+
+  IKCachePtr ik_cache_;
+
+  // Reachability maps, by group and EE frame
+  mutable std::mutex reachability_mutex_;
+  std::map<std::pair<std::string, std::string>, ReachabilityMapConstPtr>
+      reachability_maps_;
+};
+}  // namespace ap_planning
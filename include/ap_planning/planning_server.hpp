@@ -0,0 +1,206 @@
+///////////////////////////////////////////////////////////////////////////////
+//      Title     : planning_server.hpp
+//      Project   : ap_planning
+//      Created   : 10/14/2026
+//      Author    : Adam Pettinger
+//      Copyright : Copyright© The University of Texas at Austin, 2014-2022. All
+//      rights reserved.
+//
+//          All files within this directory are subject to the following, unless
+//          an alternative license is explicitly included within the text of
+//          each file.
+//
+//          This software and documentation constitute an unpublished work
+//          and contain valuable trade secrets and proprietary information
+//          belonging to the University. None of the foregoing material may be
+//          copied or duplicated or disclosed without the express, written
+//          permission of the University. THE UNIVERSITY EXPRESSLY DISCLAIMS ANY
+//          AND ALL WARRANTIES CONCERNING THIS SOFTWARE AND DOCUMENTATION,
+//          INCLUDING ANY WARRANTIES OF MERCHANTABILITY AND/OR FITNESS FOR A
+//          PARTICULAR PURPOSE, AND WARRANTIES OF PERFORMANCE, AND ANY WARRANTY
+//          THAT MIGHT OTHERWISE ARISE FROM COURSE OF DEALING OR USAGE OF TRADE.
+//          NO WARRANTY IS EITHER EXPRESS OR IMPLIED WITH RESPECT TO THE USE OF
+//          THE SOFTWARE OR DOCUMENTATION. Under no circumstances shall the
+//          University be liable for incidental, special, indirect, direct or
+//          consequential damages or loss of profits, interruption of business,
+//          or related expenses which may arise from use of software or
+//          documentation, including but not limited to those resulting from
+//          defects in software and/or documentation, or loss or inaccuracy of
+//          data of any kind.
+//
+
+
+#pragma once
+
+#include <ros/ros.h>
+#include <ap_planning/ap_planning_common.hpp>
+#include <ap_planning/dss_planner.hpp>
+#include <ap_planning/planning_context.hpp>
+#include <ap_planning/sequential_step_planner.hpp>
+
+#include <atomic>
+#include <condition_variable>
+#include <cstdint>
+#include <functional>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+namespace ap_planning {
+
+/**
+ * A request queued on a PlanningServer, and how to schedule it
+ */
+struct APPlanningJob {
+  APPlanningRequest request;
+
+  // If true, the job is planned with SPS. Otherwise it uses DSS, with the
+  // request's planner
+  bool use_sps{false};
+
+  // Jobs with higher priorities are planned first. Within a priority, the
+  // earliest deadline goes first
+  int priority{0};
+
+  // The job is dropped if it has not started by the deadline, and DSS
+  // planning time is cut short to meet it. Zero means no deadline
+  ros::WallTime deadline;
+
+  // If true and there is a deadline, failed plans are tried again until the
+  // deadline, and each better response is sent to the progress callback
+  bool retry_until_deadline{false};
+};
+
+/**
+ * How a job on a PlanningServer ended
+ */
+struct APPlanningJobResult {
+  Result result{PLANNING_FAIL};
+
+  // The best response found
+  APPlanningResponse response;
+
+  // True if the job was cancelled, or reached its deadline before it started
+  bool cancelled{false};
+  bool expired{false};
+};
+
+/**
+ * Plans queued requests on a fixed pool of workers, each with its own SPS
+ * and DSS planner. The planners are made up front and share one planning
+ * context, so requests do not pay for loading the robot or starting a scene
+ * monitor
+ *
+ * This is thread safe. The callbacks run on the worker threads
+ */
+class PlanningServer {
+ public:
+  using DoneCallback = std::function<void(const APPlanningJobResult&)>;
+  using ProgressCallback = std::function<void(const APPlanningResponse&)>;
+  using JobId = std::uint64_t;
+
+  /** Constructor. Makes and initializes every worker's planners
+   *
+   * @param planning_context The shared context
+   * @param move_group_name The group to plan for
+   * @param num_workers How many jobs are planned at once. If 0, the number of
+   * hardware threads
+   */
+  PlanningServer(const PlanningContextPtr& planning_context,
+                 const std::string& move_group_name,
+                 const size_t num_workers = 0);
+
+  /** Destructor. Cancels every queued and running job, and waits for the
+   * running ones to end
+   */
+  ~PlanningServer();
+
+  PlanningServer(const PlanningServer&) = delete;
+  PlanningServer& operator=(const PlanningServer&) = delete;
+
+  /** Checks that every worker's planners initialized
+   *
+   * @return True if the server can plan, false otherwise
+   */
+  bool isValid() const { return valid_; }
+
+  /** Queues a job
+   *
+   * @param job The job
+   * @param done Called once when the job ends, however it ends
+   * @param progress If not null, called with each better response while the
+   * job is retried
+   * @return The job's ID, for cancel()
+   */
+  JobId submit(const APPlanningJob& job, const DoneCallback& done,
+               const ProgressCallback& progress = nullptr);
+
+  /** Cancels a job. A queued job ends right away. A running DSS plan stops
+   * early, and a running SPS plan ends once its current attempt does
+   *
+   * @param id The job's ID
+   * @return True if the job was queued or running, false otherwise
+   */
+  bool cancel(const JobId id);
+
+  /** Gets how many jobs are waiting for a worker
+   *
+   * @return The number of queued jobs
+   */
+  size_t numQueued() const;
+
+  size_t numWorkers() const { return workers_.size(); }
+
+ protected:
+  // A job and its callbacks, while it is queued or running
+  struct QueuedJob {
+    JobId id;
+    APPlanningJob job;
+    DoneCallback done;
+    ProgressCallback progress;
+    std::atomic<bool> cancel{false};
+  };
+  using QueuedJobPtr = std::shared_ptr<QueuedJob>;
+
+  // The planners of one worker thread
+  struct Worker {
+    std::unique_ptr<SequentialStepPlanner> sps;
+    std::unique_ptr<DSSPlanner> dss;
+    std::thread thread;
+  };
+
+  /** Orders the queue heap so the job to plan next is on top
+   */
+  static bool runsAfter(const QueuedJobPtr& a, const QueuedJobPtr& b);
+
+  /** The loop of a worker thread: takes the next job and plans it, until the
+   * server stops
+   *
+   * @param worker The worker
+   */
+  void work(Worker& worker);
+
+  /** Plans a job, retrying if it asks to, and then calls its done callback
+   *
+   * @param worker The worker planning the job
+   * @param queued_job The job
+   */
+  void runJob(Worker& worker, QueuedJob& queued_job);
+
+  PlanningContextPtr planning_context_;
+  std::vector<std::unique_ptr<Worker>> workers_;
+  bool valid_{true};
+
+  // The queue is a heap ordered by runsAfter(). Every queued or running job
+  // is in jobs_
+  mutable std::mutex mutex_;
+  std::condition_variable queue_cv_;
+  std::vector<QueuedJobPtr> queue_;
+  std::map<JobId, QueuedJobPtr> jobs_;
+  JobId next_id_{0};
+  bool stopping_{false};
+};
+
+}  // namespace ap_planning
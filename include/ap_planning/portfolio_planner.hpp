@@ -0,0 +1,81 @@
+///////////////////////////////////////////////////////////////////////////////
+//      Title     : portfolio_planner.hpp
+//      Project   : ap_planning
+//      Created   : 10/14/2026
+//      Author    : Adam Pettinger
+//      Copyright : Copyright© The University of Texas at Austin, 2014-2022. All
+//      rights reserved.
+//
+//          All files within this directory are subject to the following, unless
+//          an alternative license is explicitly included within the text of
+//          each file.
+//
+//          This software and documentation constitute an unpublished work
+//          and contain valuable trade secrets and proprietary information
+//          belonging to the University. None of the foregoing material may be
+//          copied or duplicated or disclosed without the express, written
+//          permission of the University. THE UNIVERSITY EXPRESSLY DISCLAIMS ANY
+//          AND ALL WARRANTIES CONCERNING THIS SOFTWARE AND DOCUMENTATION,
+//          INCLUDING ANY WARRANTIES OF MERCHANTABILITY AND/OR FITNESS FOR A
+//          PARTICULAR PURPOSE, AND WARRANTIES OF PERFORMANCE, AND ANY WARRANTY
+//          THAT MIGHT OTHERWISE ARISE FROM COURSE OF DEALING OR USAGE OF TRADE.
+//          NO WARRANTY IS EITHER EXPRESS OR IMPLIED WITH RESPECT TO THE USE OF
+//          THE SOFTWARE OR DOCUMENTATION. Under no circumstances shall the
+//          University be liable for incidental, special, indirect, direct or
+//          consequential damages or loss of profits, interruption of business,
+//          or related expenses which may arise from use of software or
+//          documentation, including but not limited to those resulting from
+//          defects in software and/or documentation, or loss or inaccuracy of
+//          data of any kind.
+//
+
+#pragma once
+
+#include <ompl/base/Planner.h>
+
+#include <vector>
+
+namespace ob = ompl::base;
+
+namespace ap_planning {
+
+/**
+ * Runs several planners on one problem at the same time, each on its own
+ * thread, and stops once one of them finds an exact solution. The planners
+ * share the problem definition, so they share the start and goal states. The
+ * validity checker, motion validator, and goal must be thread safe
+ */
+class PortfolioPlanner : public ob::Planner {
+ public:
+  /** Constructor
+   *
+   * @param si The space information of the problem
+   * @param hybridize If true, waits for every planner to solve and combines
+   * their paths into a shorter one
+   */
+  PortfolioPlanner(const ob::SpaceInformationPtr &si,
+                   const bool hybridize = false);
+
+  /** Adds a planner to the portfolio
+   *
+   * @param planner The planner. It must use the same space information
+   */
+  void addPlanner(const ob::PlannerPtr &planner);
+
+  const std::vector<ob::PlannerPtr> &getPlanners() const { return planners_; }
+
+  void setProblemDefinition(const ob::ProblemDefinitionPtr &pdef) override;
+
+  ob::PlannerStatus solve(const ob::PlannerTerminationCondition &ptc) override;
+
+  void clear() override;
+
+  void setup() override;
+
+  void getPlannerData(ob::PlannerData &data) const override;
+
+ protected:
+  std::vector<ob::PlannerPtr> planners_;
+  bool hybridize_;
+};
+}  // namespace ap_planning
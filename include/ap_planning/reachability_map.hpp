@@ -0,0 +1,199 @@
+///////////////////////////////////////////////////////////////////////////////
+//      Title     : reachability_map.hpp
+//      Project   : ap_planning
+//      Created   : 10/14/2026
+//      Author    : Adam Pettinger
+//      Copyright : Copyright© The University of Texas at Austin, 2014-2022. All
+//      rights reserved.
+//
+//          All files within this directory are subject to the following, unless
+//          an alternative license is explicitly included within the text of
+//          each file.
+//
+//          This software and documentation constitute an unpublished work
+//          and contain valuable trade secrets and proprietary information
+//          belonging to the University. None of the foregoing material may be
+//          copied or duplicated or disclosed without the express, written
+//          permission of the University. THE UNIVERSITY EXPRESSLY DISCLAIMS ANY
+//          AND ALL WARRANTIES CONCERNING THIS SOFTWARE AND DOCUMENTATION,
+//          INCLUDING ANY WARRANTIES OF MERCHANTABILITY AND/OR FITNESS FOR A
+//          PARTICULAR PURPOSE, AND WARRANTIES OF PERFORMANCE, AND ANY WARRANTY
+//          THAT MIGHT OTHERWISE ARISE FROM COURSE OF DEALING OR USAGE OF TRADE.
+//          NO WARRANTY IS EITHER EXPRESS OR IMPLIED WITH RESPECT TO THE USE OF
+//          THE SOFTWARE OR DOCUMENTATION. Under no circumstances shall the
+//          University be liable for incidental, special, indirect, direct or
+//          consequential damages or loss of profits, interruption of business,
+//          or related expenses which may arise from use of software or
+//          documentation, including but not limited to those resulting from
+//          defects in software and/or documentation, or loss or inaccuracy of
+//          data of any kind.
+//
+
+#pragma once
+
+#include <moveit/planning_scene/planning_scene.h>
+#include <moveit/robot_model/joint_model_group.h>
+#include <moveit/robot_state/robot_state.h>
+#include <ap_planning/state_utils.hpp>
+
+#include <cstdint>
+#include <memory>
+#include <string>
+#include <vector>
+
+namespace ap_planning {
+class ReachabilityMap;
+using ReachabilityMapPtr = std::shared_ptr<ReachabilityMap>;
+using ReachabilityMapConstPtr = std::shared_ptr<const ReachabilityMap>;
+
+/**
+ * A voxel grid of the poses an EE frame can reach, relative to the link the
+ * move group is mounted on (its base frame), so the map still holds when
+ * joints outside the group move it. Each voxel has a bit for each bin of the
+ * EE Z axis direction it was reached with, and one joint state that reached
+ * it, for seeding IK. The roll about the Z axis is not binned
+ *
+ * Maps are built offline by sampling joint states, and loaded by memory
+ * mapping the saved file, so loading is fast and the map is not copied.
+ * Lookups accept neighboring voxels and bins, so a sparse map does not
+ * reject poses it missed by a little
+ */
+class ReachabilityMap {
+ public:
+  ~ReachabilityMap();
+
+  // The data points into this map, so it can not be copied
+  ReachabilityMap(const ReachabilityMap &) = delete;
+  ReachabilityMap &operator=(const ReachabilityMap &) = delete;
+
+  /** Builds a map by sampling random joint states
+   *
+   * @param robot_state The robot state to sample from. It is copied
+   * @param jmg The joint model group to sample
+   * @param ee_frame_name The EE frame
+   * @param num_samples How many joint states to sample
+   * @param resolution The voxel size (meters)
+   * @param scene If not null, self colliding samples are skipped
+   * @return The map, or nullptr if the EE frame is unknown or nothing was
+   * reached
+   */
+  static ReachabilityMapPtr build(
+      const moveit::core::RobotState &robot_state,
+      const moveit::core::JointModelGroup *jmg,
+      const std::string &ee_frame_name, const size_t num_samples,
+      const double resolution,
+      const planning_scene::PlanningScene *scene = nullptr);
+
+  /** Loads a saved map by memory mapping it
+   *
+   * @param filename The map file
+   * @return The map, or nullptr if the file could not be read
+   */
+  static ReachabilityMapPtr load(const std::string &filename);
+
+  /** Saves the map
+   *
+   * @param filename The file to write
+   * @return True if the file was written, false otherwise
+   */
+  bool save(const std::string &filename) const;
+
+  std::string getGroupName() const;
+  std::string getEEFrameName() const;
+  std::string getBaseFrameName() const;
+  size_t getNumJoints() const { return header_->num_joints; }
+
+  /** Gets where the map's base frame is for a robot state
+   *
+   * @param robot_state The robot state. It must be up to date
+   * @return The base frame's pose, in the robot model frame
+   */
+  Eigen::Isometry3d getBasePose(
+      const moveit::core::RobotState &robot_state) const;
+
+  /** Checks if the map reached a pose, or one next to it
+   *
+   * @param pose The EE pose, in the robot model frame
+   * @param base_pose The base frame's pose, from getBasePose()
+   * @return True if the pose may be reachable, false if it is not
+   */
+  bool isReachable(const Eigen::Isometry3d &pose,
+                   const Eigen::Isometry3d &base_pose) const;
+
+  /** Checks every waypoint of a screw path
+   *
+   * @param pose_table The waypoints, in the robot model frame
+   * @param base_pose The base frame's pose, from getBasePose()
+   * @return True if every waypoint may be reachable, false otherwise
+   */
+  bool isPathReachable(const ScrewPoseTable &pose_table,
+                       const Eigen::Isometry3d &base_pose) const;
+
+  /** Gets the joint state that reached a pose's voxel
+   *
+   * @param pose The EE pose, in the robot model frame
+   * @param base_pose The base frame's pose, from getBasePose()
+   * @param seed Set to the joint state, if the voxel was reached
+   * @return True if the voxel was reached, false otherwise
+   */
+  bool getSeed(const Eigen::Isometry3d &pose,
+               const Eigen::Isometry3d &base_pose,
+               std::vector<double> &seed) const;
+
+ protected:
+  // The start of the map data. The voxel bit masks follow it, then the seeds
+  struct Header {
+    char magic[8];
+    uint32_t num_joints;
+    uint32_t size[3];
+    double origin[3];
+    double resolution;
+    char group_name[64];
+    char ee_frame_name[64];
+    char base_frame_name[64];
+  };
+  static_assert(sizeof(Header) % sizeof(uint64_t) == 0,
+                "The voxel masks must stay aligned");
+
+  ReachabilityMap() = default;
+
+  /** Points the header, masks, and seeds into the data
+   *
+   * @param data The map data
+   * @param size The size of the data in bytes
+   * @return True if the data holds a whole map, false otherwise
+   */
+  bool setData(const char *data, const size_t size);
+
+  /** Checks if the map reached a pose, or one next to it
+   *
+   * @param pose The EE pose, in the base frame
+   * @return True if the pose may be reachable, false if it is not
+   */
+  bool isReachableFromBase(const Eigen::Isometry3d &pose) const;
+
+  /** Finds the voxel a position is in
+   *
+   * @param position The position
+   * @param voxel Set to the voxel indices. They may be outside the grid
+   */
+  void toVoxel(const Eigen::Vector3d &position, int64_t voxel[3]) const;
+
+  /** Gets the index of a voxel
+   *
+   * @param voxel The voxel indices
+   * @return The index, or -1 if the voxel is outside the grid
+   */
+  int64_t voxelIndex(const int64_t voxel[3]) const;
+
+  const Header *header_{nullptr};
+  const uint64_t *masks_{nullptr};
+  const float *seeds_{nullptr};
+  size_t data_size_{0};
+
+  // Built maps own their data, and loaded maps map their file
+  std::vector<uint64_t> storage_;
+  void *mapping_{nullptr};
+  size_t mapping_size_{0};
+};
+}  // namespace ap_planning
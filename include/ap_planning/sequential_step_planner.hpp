@@ -53,6 +53,15 @@ class SequentialStepPlanner {
   SequentialStepPlanner(
       const std::string& move_group_name,
       const std::string& robot_description_name = "robot_description");
+
+  /** Constructor that shares the robot model and planning scene monitor with
+   * other planners
+   *
+   * @param planning_context The shared context
+   * @param move_group_name The group to plan for
+   */
+  SequentialStepPlanner(const PlanningContextPtr& planning_context,
+                        const std::string& move_group_name);
   ~SequentialStepPlanner(){};
 
   bool initialize();
@@ -60,6 +69,20 @@ class SequentialStepPlanner {
   ap_planning::Result plan(const APPlanningRequest& req,
                            APPlanningResponse& res);
 
+  /** Plans a screw-based trajectory, starting from the solution of an earlier
+   * plan for the same task. The hint's joint states are tried at each
+   * waypoint before solving IK
+   *
+   * @param req The planning request
+   * @param hint The response of the earlier plan. It may be the same object as
+   * res
+   * @param res The planning response
+   * @return The result
+   */
+  ap_planning::Result plan(const APPlanningRequest& req,
+                           const APPlanningResponse& hint,
+                           APPlanningResponse& res);
+
   /** Plans a joint trajectory based on an affordance trajectory
    *
    *
@@ -74,6 +97,19 @@ class SequentialStepPlanner {
       const std::vector<double>& start_state, const std::string& ee_name,
       APPlanningResponse& res);
 
+  /** Plans many requests against one planning scene snapshot
+   *
+   * The requests are planned in parallel, and planning stops early once the
+   * options are met
+   *
+   * @param reqs The planning requests
+   * @param options How many threads to use and when to stop early
+   * @param batch_res The results and responses for each request
+   */
+  void planBatch(const std::vector<APPlanningRequest>& reqs,
+                 const APPlanningBatchOptions& options,
+                 APPlanningBatchResponse& batch_res);
+
  protected:
   // node handle
   ros::NodeHandle nh_;
@@ -84,7 +120,18 @@ class SequentialStepPlanner {
       solver_loader_;
   boost::shared_ptr<ap_planning::IKSolverBase> ik_solver_;
 
+  // Solvers for the other threads of planBatch()
+  std::vector<boost::shared_ptr<ap_planning::IKSolverBase>> batch_solvers_;
+  std::string ik_solver_name_;
+
+  /** Loads and initializes a solver plugin
+   *
+   * @return The solver, or null if it could not be loaded or initialized
+   */
+  boost::shared_ptr<ap_planning::IKSolverBase> createSolver();
+
   std::string move_group_name_, robot_description_name_;
+  PlanningContextPtr planning_context_;
 
   bool initialized_;
 };
@@ -41,51 +41,214 @@
 #include <tf2_eigen/tf2_eigen.h>
 #include <affordance_primitives/screw_model/screw_axis.hpp>
 #include <affordance_primitives/screw_planning/screw_constraint.hpp>
+#include <ap_planning/ik_cache.hpp>
+#include <ap_planning/reachability_map.hpp>
+#include <ap_planning/state_utils.hpp>
+
+#include <atomic>
+#include <limits>
 
 namespace ob = ompl::base;
 
 namespace ap_planning {
 
-/** Contains all the functionality for using collision checking during IK
- *
- * @param jmg The joint model group
- * @param robot_state The robot state object
- * @param psm The planning scene monitor to check against
- * @param joints The IK solution to check
- * @param error_code The error code for this solution
+/**
+ * Checks IK solutions for collisions while IK is solved. This only holds plain
+ * pointers to a scene and to a robot state owned by the caller, so it is
+ * cheap to make and calling it does not touch any reference counts. The scene
+ * is only read, so checkers on different threads can share it, but each
+ * thread needs its own checker and robot state
  */
-bool ikCallbackFnAdapter(const moveit::core::JointModelGroupPtr jmg,
-                         const moveit::core::RobotStatePtr robot_state,
-                         const planning_scene_monitor::LockedPlanningSceneRO ps,
-                         const std::vector<double> &joints,
-                         moveit_msgs::MoveItErrorCodes &error_code);
+class IKCollisionChecker {
+ public:
+  /** Constructor
+   *
+   * @param jmg The joint model group
+   * @param robot_state The robot state to check with. It is also the IK seed,
+   * and it is left at the last checked solution
+   * @param scene The planning scene to check against. It must not change
+   * while this is used. If null, every IK solution is accepted
+   * @param counters If not null, IK calls and collision checks are counted
+   */
+  IKCollisionChecker(const moveit::core::JointModelGroup *jmg,
+                     moveit::core::RobotState *robot_state,
+                     const planning_scene::PlanningScene *scene,
+                     PlanningCounters *counters = nullptr);
+
+  /** The IK callback: checks one IK solution for collisions
+   *
+   * @param pose The IK pose (unused)
+   * @param joints The IK solution to check
+   * @param error_code Set to SUCCESS when the solution is collision free
+   */
+  void operator()(const geometry_msgs::Pose &pose,
+                  const std::vector<double> &joints,
+                  moveit_msgs::MoveItErrorCodes &error_code);
+
+  /** Shares solutions through an IK cache. Cached solutions from another
+   * scene are checked again before they are used, since joints outside the
+   * group may have moved the EE as well as what it collides with
+   *
+   * @param cache The cache, or nullptr to stop using one. It must outlive
+   * this checker
+   * @param scene_fingerprint The fingerprint of the scene, from
+   * sceneFingerprint()
+   * @param max_joint_step Cached solutions with any joint farther than this
+   * from the seed are not used
+   */
+  void setCache(IKCache *cache, const std::size_t scene_fingerprint,
+                const double max_joint_step =
+                    std::numeric_limits<double>::infinity()) {
+    cache_ = cache;
+    scene_fingerprint_ = scene_fingerprint;
+    max_joint_step_ = max_joint_step;
+  }
+
+  /** Solves collision free IK, seeded from the robot state. The cache is
+   * tried first, if there is one
+   *
+   * @param ik_solver IK Solver to use
+   * @param pose IK Pose
+   * @param solution The IK solution, if one was found
+   * @param opts The IK options
+   * @return True if a solution was found, false otherwise
+   */
+  bool solve(const kinematics::KinematicsBase &ik_solver,
+             const geometry_msgs::Pose &pose, std::vector<double> &solution,
+             const kinematics::KinematicsQueryOptions &opts =
+                 kinematics::KinematicsQueryOptions());
+
+  /** Checks a cached IK solution, leaving the robot state at it. One from
+   * another scene must still reach the pose and be collision free
+   *
+   * @param tip_frame The IK solver's tip frame
+   * @param pose The IK pose, in the model frame
+   * @param joints The cached solution
+   * @param collision_free Whether the solution was checked in this scene
+   * @return True if the solution can be used, false otherwise
+   */
+  bool checkCached(const std::string &tip_frame,
+                   const geometry_msgs::Pose &pose,
+                   const std::vector<double> &joints,
+                   const bool collision_free);
+
+ protected:
+  const moveit::core::JointModelGroup *jmg_;
+  moveit::core::RobotState *robot_state_;
+  const planning_scene::PlanningScene *scene_;
+  PlanningCounters *counters_;
+  IKCache *cache_{nullptr};
+  std::size_t scene_fingerprint_{0};
+  double max_joint_step_{std::numeric_limits<double>::infinity()};
+  collision_detection::CollisionRequest collision_request_;
+  collision_detection::CollisionResult collision_result_;
+  std::vector<double> seed_state_;
+};
 
 /** Solves IK for a state and adds it to a list of valid states
  *
- * @param jmg The joint model group
- * @param robot_state The robot state object. Current joint vals used as seed
- * state
- * @param psm The planning scene monitor to check against
+ * @param checker The collision checker to use. Its robot state's current joint
+ * vals are used as the seed state
  * @param ik_solver IK Solver to use
  * @param pose IK Pose
  * @param state_list Valid poses, this wil expand if the found solution is
  * sufficiently far from the other states in the list
  */
-void increaseStateList(const moveit::core::JointModelGroupPtr jmg,
-                       const moveit::core::RobotStatePtr robot_state,
-                       const planning_scene_monitor::LockedPlanningSceneRO ps,
-                       const kinematics::KinematicsBasePtr ik_solver,
+void increaseStateList(IKCollisionChecker &checker,
+                       const kinematics::KinematicsBase &ik_solver,
                        const affordance_primitives::Pose &pose,
                        std::vector<std::vector<double>> &state_list);
 
-ob::ValidStateSamplerPtr allocScrewValidSampler(const ob::SpaceInformation *si);
+/** Solves IK for several poses in parallel until each has enough different
+ * valid states
+ *
+ * @param jmg The joint model group
+ * @param robot_state The robot state to seed from. Each thread uses a copy
+ * @param scene The planning scene to check against. It must not change
+ * @param ik_solvers IK Solvers to use, one per thread
+ * @param poses IK Poses
+ * @param num_states How many states to find for each pose
+ * @param max_attempts The most IK attempts to make for each pose
+ * @param state_lists Valid states found for each pose
+ * @param counters If not null, IK calls and collision checks are counted
+ * @param reachability If not null, the first attempt for each pose is seeded
+ * from the map
+ * @param ik_cache If not null, the lists start with the cached solutions for
+ * each pose, and new solutions are added to it
+ * @param scene_fingerprint The fingerprint of the scene, for the cache
+ */
+void increaseStateLists(
+    const moveit::core::JointModelGroup *jmg,
+    const moveit::core::RobotState &robot_state,
+    const planning_scene::PlanningScene &scene,
+    const std::vector<kinematics::KinematicsBasePtr> &ik_solvers,
+    const std::vector<affordance_primitives::Pose> &poses,
+    const std::vector<size_t> &num_states, const size_t max_attempts,
+    std::vector<std::vector<std::vector<double>>> &state_lists,
+    PlanningCounters *counters = nullptr,
+    const ReachabilityMap *reachability = nullptr, IKCache *ik_cache = nullptr,
+    const std::size_t scene_fingerprint = 0);
+
+/** Gets an IK solver for a sampler to use on its own
+ *
+ * @param context The plan context
+ * @return A solver from the context's pool, or the group's shared solver if
+ * the pool has none
+ */
+kinematics::KinematicsBasePtr acquireSamplerIKSolver(const DSSContext &context);
+
+/**
+ * Solves IK for goal states while the planner runs. This is meant to be used
+ * as the sampling function of a ScrewGoal
+ */
+class ScrewGoalSampler {
+ public:
+  /** Constructor
+   *
+   * @param context The plan context
+   * @param ik_solver IK solver to use. Only this sampler should use it
+   * @param max_goals Stop once the goal has this many states
+   * @param max_attempts Stop after this many IK attempts
+   */
+  ScrewGoalSampler(const DSSContextPtr &context,
+                   const kinematics::KinematicsBasePtr &ik_solver,
+                   const size_t max_goals, const size_t max_attempts);
+
+  /** Samples a goal state
+   *
+   * @param goal The goal being sampled for
+   * @param state The new goal state
+   * @return True if a new state was found, false if sampling should stop
+   */
+  bool sample(const ob::GoalLazySamples *goal, ob::State *state);
+
+  /** Makes sample() return as soon as possible
+   */
+  void stop() { stop_ = true; }
+
+ protected:
+  DSSContextPtr context_;
+  kinematics::KinematicsBasePtr ik_solver_;
+  moveit::core::RobotStatePtr kinematic_state_;
+  moveit::core::JointModelGroupPtr joint_model_group_;
+  geometry_msgs::Pose goal_pose_;
+  std::vector<double> goal_phi_;
+  std::vector<std::vector<double>> found_states_;
+  const size_t max_goals_, max_attempts_;
+  size_t attempts_;
+  std::atomic<bool> stop_;
+};
+
+ob::ValidStateSamplerPtr allocScrewValidSampler(const ob::SpaceInformation *si,
+                                                const DSSContextPtr &context);
 
 /**
  * Creates valid samples in the screw state space
  */
 class ScrewValidSampler : public ob::ValidStateSampler {
  public:
-  ScrewValidSampler(const ob::SpaceInformation *si);
+  ScrewValidSampler(const ob::SpaceInformation *si,
+                    const DSSContextPtr &context);
 
   bool sample(ob::State *state) override;
   bool sampleNear(ob::State * /*state*/, const ob::State * /*near*/,
@@ -94,28 +257,20 @@ class ScrewValidSampler : public ob::ValidStateSampler {
     return false;
   }
 
-  // Holds the kinematic model
-  // NOTE: You must set this before creating instances of this class!
-  inline static moveit::core::RobotModelPtr kinematic_model;
-
-  // Holds the planning scene, for collision checking
-  // NOTE: You must set this before creating instances of this class!
-  inline static std::shared_ptr<planning_scene_monitor::LockedPlanningSceneRO>
-      planning_scene;
-
-  // Holds the constraints used for this plan
-  // NOTE: You must set this before creating instances of this class!
-  inline static std::shared_ptr<affordance_primitives::ScrewConstraint>
-      constraints;
-
  protected:
+  DSSContextPtr context_;
+  DSSStateLayout layout_;
   ompl::RNG rng_;
   moveit::core::RobotStatePtr kinematic_state_;
   moveit::core::JointModelGroupPtr joint_model_group_;
   kinematics::KinematicsBasePtr ik_solver_;
+
+  // This sampler's copy of the context's constraints
+  std::shared_ptr<affordance_primitives::ScrewConstraint> constraints_;
 };
 
-ob::StateSamplerPtr allocScrewSampler(const ob::StateSpace *state_space);
+ob::StateSamplerPtr allocScrewSampler(const ob::StateSpace *state_space,
+                                      const DSSContextPtr &context);
 
 /**
  * Draws random screw space samples. These are guaranteed to be valid (i.e the
@@ -123,7 +278,8 @@ ob::StateSamplerPtr allocScrewSampler(const ob::StateSpace *state_space);
  */
 class ScrewSampler : public ob::StateSampler {
  public:
-  ScrewSampler(const ob::StateSpace *state_space);
+  ScrewSampler(const ob::StateSpace *state_space,
+               const DSSContextPtr &context);
 
   void sample(ob::State *state, const std::vector<double> screw_theta);
   void sampleUniform(ob::State *state) override;
@@ -132,25 +288,16 @@ class ScrewSampler : public ob::StateSampler {
   void sampleGaussian(ob::State *state, const ob::State *mean,
                       double stdDev) override;
 
-  // Holds the kinematic model
-  // NOTE: You must set this before creating instances of this class!
-  inline static moveit::core::RobotModelPtr kinematic_model;
-
-  // Holds the planning scene, for collision checking
-  // NOTE: You must set this before creating instances of this class!
-  inline static std::shared_ptr<planning_scene_monitor::LockedPlanningSceneRO>
-      planning_scene;
-
-  // Holds the constraints used for this plan
-  // NOTE: You must set this before creating instances of this class!
-  inline static std::shared_ptr<affordance_primitives::ScrewConstraint>
-      constraints;
-
  protected:
+  DSSContextPtr context_;
+  DSSStateLayout layout_;
   ompl::RNG rng_;
   moveit::core::RobotStatePtr kinematic_state_;
   moveit::core::JointModelGroupPtr joint_model_group_;
   kinematics::KinematicsBasePtr ik_solver_;
+
+  // This sampler's copy of the context's constraints
+  std::shared_ptr<affordance_primitives::ScrewConstraint> constraints_;
 };
 
 }  // namespace ap_planning
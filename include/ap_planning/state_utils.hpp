@@ -37,16 +37,235 @@
 #include <moveit/robot_model/robot_model.h>
 #include <moveit/robot_state/robot_state.h>
 #include <ompl/base/SpaceInformation.h>
-#include <ompl/base/goals/GoalStates.h>
+#include <ompl/base/MotionValidator.h>
+#include <ompl/base/ScopedState.h>
+#include <ompl/base/goals/GoalLazySamples.h>
 #include <ompl/base/spaces/RealVectorStateSpace.h>
 #include <tf2_eigen/tf2_eigen.h>
 #include <trajectory_msgs/JointTrajectory.h>
 #include <affordance_primitives/screw_model/screw_axis.hpp>
 #include <affordance_primitives/screw_planning/screw_constraint.hpp>
+#include <ap_planning/ap_planning_common.hpp>
+#include <ap_planning/planning_context.hpp>
+
+#include <atomic>
+#include <condition_variable>
+#include <cstdint>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <unordered_map>
 
 namespace ob = ompl::base;
 
 namespace ap_planning {
+/**
+ * Hands out robot states copied from a prototype. States that are no longer
+ * used go back to the pool and are reused, so creating samplers and checkers
+ * does not allocate new states each plan. This is thread safe. Make it with
+ * std::make_shared, since the states it hands out refer back to it
+ */
+class RobotStatePool : public std::enable_shared_from_this<RobotStatePool> {
+ public:
+  /** Constructor
+   *
+   * @param prototype The state to copy from
+   */
+  RobotStatePool(const moveit::core::RobotState &prototype);
+
+  /** Sets the state to copy from. States already handed out are unchanged
+   *
+   * @param prototype The state to copy from
+   */
+  void setPrototype(const moveit::core::RobotState &prototype);
+
+  /** Gets a state with the prototype's values. It goes back to the pool when
+   * the last pointer to it is released
+   *
+   * @return The robot state
+   */
+  moveit::core::RobotStatePtr acquire();
+
+ protected:
+  void release(moveit::core::RobotState *robot_state);
+
+  std::mutex mutex_;
+  moveit::core::RobotState prototype_;
+  std::vector<std::unique_ptr<moveit::core::RobotState>> free_states_;
+};
+
+/** Gets a joint model group that shares ownership with its robot model, instead
+ * of deep copying the group
+ *
+ * @param model The robot model
+ * @param group_name The name of the group
+ * @return The group, or nullptr if the model does not have it
+ */
+moveit::core::JointModelGroupPtr shareJointModelGroup(
+    const moveit::core::RobotModelPtr &model, const std::string &group_name);
+
+/**
+ * Counts what the samplers, IK, and validity checker do during a plan. The
+ * counters are atomic, so any thread can add to them
+ */
+struct PlanningCounters {
+  std::atomic<size_t> ik_calls{0};
+  std::atomic<size_t> ik_successes{0};
+  std::atomic<size_t> ik_collision_checks{0};
+  std::atomic<size_t> is_valid_calls{0};
+  std::atomic<size_t> rejected_bounds{0};
+  std::atomic<size_t> rejected_screw_error{0};
+  std::atomic<size_t> rejected_phi_mismatch{0};
+  std::atomic<size_t> rejected_collision{0};
+  std::atomic<size_t> ik_cache_hits{0};
+  std::atomic<size_t> ik_cache_misses{0};
+  std::atomic<size_t> piece_joins{0};
+  std::atomic<size_t> failed_piece_joins{0};
+
+  /** Adds one to a counter, if counting is on
+   *
+   * @param counters The counters. If null, nothing is counted
+   * @param counter The counter to add to
+   */
+  static void increment(PlanningCounters *counters,
+                        std::atomic<size_t> PlanningCounters::*counter) {
+    if (counters) {
+      (counters->*counter).fetch_add(1, std::memory_order_relaxed);
+    }
+  }
+
+  /** Copies the counts to the response statistics
+   *
+   * @param statistics The statistics to fill in
+   */
+  void copyTo(APPlanningStatistics &statistics) const;
+};
+
+class ScrewPoseTable;
+class IKCache;
+
+/**
+ * Holds everything the samplers, goal, and validity checker need for one DSS
+ * plan. Each plan gets its own context, so concurrent plans do not interfere
+ */
+struct DSSContext {
+  // The kinematic model
+  moveit::core::RobotModelPtr kinematic_model;
+
+  // The planning scene, for collision checking
+  planning_scene::PlanningSceneConstPtr planning_scene;
+
+  // The constraints used for this plan
+  std::shared_ptr<affordance_primitives::ScrewConstraint> constraints;
+
+  // The request the constraints were made from
+  APPlanningRequest request;
+
+  std::string move_group_name;
+  std::string ee_frame_name;
+
+  // The group being planned for. This is shared with the kinematic model
+  moveit::core::JointModelGroupPtr joint_model_group;
+
+  // Robot states at the start of the plan, for the samplers and checkers
+  std::shared_ptr<RobotStatePool> state_pool;
+
+  // The counters for this plan, or null if statistics are not collected
+  std::shared_ptr<PlanningCounters> counters;
+
+  // Where the samplers get their own IK solvers from
+  PlanningContextPtr planning_context;
+
+  // The poses along the screw path for this plan
+  std::shared_ptr<const ScrewPoseTable> pose_table;
+
+  // The IK cache, or null if it is not used, and the fingerprint of the
+  // planning scene its solutions are checked against
+  std::shared_ptr<IKCache> ik_cache;
+  std::size_t scene_fingerprint{0};
+
+  /** Makes a separate copy of the constraints. The constraints are not thread
+   * safe, so each thread that uses them needs its own copy
+   *
+   * @return The new constraints, with the same reference frame as constraints
+   */
+  std::shared_ptr<affordance_primitives::ScrewConstraint> copyConstraints()
+      const;
+
+  /** Gets the pose at a screw state from the pose table, falling back to the
+   * constraints if the state is not on the table's path
+   *
+   * @param phi The screw state
+   * @param constraints The constraints to fall back to. These are not thread
+   * safe, so pass the calling thread's copy
+   * @return The pose
+   */
+  Eigen::Isometry3d getPose(
+      const std::vector<double> &phi,
+      affordance_primitives::ScrewConstraint &constraints) const;
+};
+using DSSContextPtr = std::shared_ptr<DSSContext>;
+
+/**
+ * Gives each thread that calls get() its own instance of T, which is created
+ * the first time that thread asks for it. Each thread remembers the last
+ * instance it got, so repeat calls from the same thread do not lock
+ */
+template <typename T>
+class PerThread {
+ public:
+  PerThread(const std::function<std::unique_ptr<T>()> &factory)
+      : factory_(factory), id_(nextId()) {}
+
+  T &get() const {
+    // The instance is in the cache only if it came from this object, and
+    // clear() has not been called since
+    thread_local Cached cached;
+    const size_t generation = generation_.load(std::memory_order_acquire);
+    if (cached.id == id_ && cached.generation == generation) {
+      return *cached.instance;
+    }
+
+    std::lock_guard<std::mutex> lock(mutex_);
+    std::unique_ptr<T> &instance = instances_[std::this_thread::get_id()];
+    if (!instance) {
+      instance = factory_();
+    }
+    cached = Cached{id_, generation, instance.get()};
+    return *instance;
+  }
+
+  /** Destroys every thread's instance. Threads that call get() after this get
+   * new ones. No thread may be using an instance while this runs
+   */
+  void clear() {
+    std::lock_guard<std::mutex> lock(mutex_);
+    instances_.clear();
+    generation_.fetch_add(1, std::memory_order_release);
+  }
+
+ protected:
+  // The last instance a thread got. Ids are never reused, so a cache entry
+  // can not match an object made after its own was destroyed
+  struct Cached {
+    uint64_t id{0};
+    size_t generation{0};
+    T *instance{nullptr};
+  };
+
+  static uint64_t nextId() {
+    static std::atomic<uint64_t> next_id(1);
+    return next_id++;
+  }
+
+  std::function<std::unique_ptr<T>()> factory_;
+  const uint64_t id_;
+  std::atomic<size_t> generation_{0};
+  mutable std::mutex mutex_;
+  mutable std::unordered_map<std::thread::id, std::unique_ptr<T>> instances_;
+};
+
 /** Checks if a state is close to any in a list of others
  *
  * @param states The list of already generated states
@@ -57,6 +276,350 @@ namespace ap_planning {
 bool checkDuplicateState(const std::vector<std::vector<double>> &states,
                          const std::vector<double> &new_state);
 
+/** Checks if two poses are within a distance and angle of each other
+ *
+ * @param pose_a The first pose
+ * @param pose_b The second pose
+ * @param position_tolerance The farthest apart they can be (meters)
+ * @param orientation_tolerance The most they can be rotated apart (radians)
+ * @return True if the poses are close, false otherwise
+ */
+bool posesAreClose(const Eigen::Isometry3d &pose_a,
+                   const Eigen::Isometry3d &pose_b,
+                   const double position_tolerance,
+                   const double orientation_tolerance);
+
+/** Computes a hash of the things that affect collision checking for a group:
+ * the world, the attached bodies, and the positions of all joints that are
+ * not in the group. The world is keyed on the scene version, since the
+ * octomap is changed in place and its shape does not show it. The joints are
+ * rounded, so sensor noise on them (e.g. a gripper) does not change it
+ *
+ * @param scene_version The version of the scene (see
+ * PlanningContext::getSceneVersion())
+ * @param robot_state The current robot state
+ * @param jmg The joint model group being planned for
+ * @param joint_resolution How finely the other joints are rounded (radians or
+ * meters)
+ * @return The fingerprint. If it changes, old collision checks may be wrong
+ */
+std::size_t sceneFingerprint(const std::size_t scene_version,
+                             const moveit::core::RobotState &robot_state,
+                             const moveit::core::JointModelGroup &jmg,
+                             const double joint_resolution = 1e-3);
+
+/** Calculates the spacing in theta between waypoints on a screw segment
+ *
+ * @param segment The screw segment
+ * @param waypoint_dist The farthest apart waypoints can be (meters)
+ * @param waypoint_ang The farthest apart waypoints can be (radians)
+ * @return The theta step between waypoints
+ */
+double calculateSegmentSpacing(const ScrewSegment &segment,
+                               const double waypoint_dist,
+                               const double waypoint_ang);
+
+/**
+ * Poses along a screw path, calculated once per plan so the waypoints,
+ * samplers, and start and goal poses do not recompute the screw exponentials.
+ * The path moves each segment from its lower to its upper bound in order, and
+ * poses between the stored waypoints are interpolated. It is not changed
+ * after construction, so threads can share it
+ */
+class ScrewPoseTable {
+ public:
+  /** Constructor
+   *
+   * @param constraints The constraints to calculate poses with. The reference
+   * frame must already be set
+   * @param segments The screw segments, for calculating the waypoint spacing
+   * @param waypoint_dist The farthest apart waypoints can be (meters)
+   * @param waypoint_ang The farthest apart waypoints can be (radians)
+   */
+  ScrewPoseTable(affordance_primitives::ScrewConstraint &constraints,
+                 const std::vector<ScrewSegment> &segments,
+                 const double waypoint_dist = 0.01,
+                 const double waypoint_ang = 0.02);
+
+  /** Gets the pose at a screw state by interpolating the nearest waypoints
+   *
+   * @param phi The screw state
+   * @param pose Set to the pose, if phi is on the path
+   * @return True if phi is on the path, false otherwise
+   */
+  bool getPose(const std::vector<double> &phi, Eigen::Isometry3d &pose) const;
+
+  size_t numSegments() const { return segments_.size(); }
+
+  /** Gets how many waypoints a segment has. The first waypoint of a segment
+   * is the same as the last waypoint of the segment before it
+   *
+   * @param segment The segment index
+   * @return The number of waypoints, including both ends
+   */
+  size_t numWaypoints(const size_t segment) const {
+    return segments_.at(segment).count;
+  }
+
+  /** Gets the distance in theta between the waypoints of a segment
+   *
+   * @param segment The segment index
+   * @return The spacing, which is not negative
+   */
+  double getSpacing(const size_t segment) const {
+    return fabs(segments_.at(segment).spacing);
+  }
+
+  /** Gets a stored waypoint
+   *
+   * @param segment The segment index
+   * @param index The waypoint index within the segment
+   * @return The pose
+   */
+  Eigen::Isometry3d getWaypoint(const size_t segment, const size_t index) const;
+
+ protected:
+  struct Segment {
+    double start, end, spacing;
+    size_t offset, count;
+  };
+  struct Waypoint {
+    Eigen::Quaterniond rotation;
+    Eigen::Vector3d translation;
+  };
+
+  std::vector<Segment> segments_;
+  std::vector<Waypoint, Eigen::aligned_allocator<Waypoint>> waypoints_;
+};
+
+/** Moves a robot state so a frame reaches a target pose, using damped least
+ * squares steps with the Jacobian. This is meant for small moves, such as
+ * between nearby waypoints
+ *
+ * @param jmg The joint model group to move
+ * @param ee_frame The frame to move to the target
+ * @param target The target pose of ee_frame, in the model frame
+ * @param robot_state The starting state. It is updated to the result
+ * @param max_iterations The most steps to take
+ * @param tolerance Stop once the position (m) and rotation (rad) errors
+ * are both under this
+ * @return True if the target was reached, false otherwise
+ */
+bool projectToPose(const moveit::core::JointModelGroup *jmg,
+                   const std::string &ee_frame, const Eigen::Isometry3d &target,
+                   moveit::core::RobotState &robot_state,
+                   const size_t max_iterations = 10,
+                   const double tolerance = 1e-4);
+
+/** Moves a robot state so a frame reaches a target pose, using damped least
+ * squares steps with the group Jacobian (the tip link Jacobian from
+ * RobotState::getJacobian). Passing in the Jacobian from the previous step
+ * saves computing it again
+ *
+ * @param jmg The joint model group to move
+ * @param ee_frame The frame to move to the target. It must be rigidly
+ * attached to the tip link of the group
+ * @param target The target pose of ee_frame, in the model frame
+ * @param robot_state The starting state. It is updated to the result
+ * @param jacobian The group Jacobian at the starting state, or empty to
+ * compute it. If the target was reached, it is set to the Jacobian at the
+ * result
+ * @param max_iterations The most steps to take
+ * @param tolerance Stop once the position (m) and rotation (rad) errors
+ * are both under this
+ * @return True if the target was reached, false otherwise
+ */
+bool stepToPose(const moveit::core::JointModelGroup *jmg,
+                const std::string &ee_frame, const Eigen::Isometry3d &target,
+                moveit::core::RobotState &robot_state,
+                Eigen::MatrixXd &jacobian, const size_t max_iterations = 5,
+                const double tolerance = 1e-5);
+
+/** Calculates the condition number of a Jacobian with at most 6 rows. This
+ * uses the eigenvalues of the smaller of J*J^T and J^T*J, which is much
+ * cheaper than an SVD and does not allocate. Squaring the Jacobian loses
+ * precision for condition numbers past about 1e7, so this is only meant for
+ * singularity limits below that
+ *
+ * @param jacobian The Jacobian
+ * @return The condition number, or infinity if the Jacobian is rank deficient
+ */
+double conditionNumber(const Eigen::MatrixXd &jacobian);
+
+/** Checks whether a robot state is in collision with itself or the world.
+ * Unlike getCollidingPairs, this does not build a contact map
+ *
+ * @param scene The planning scene to check in
+ * @param robot_state The robot state to check. Its transforms must be updated
+ * @param request The collision request. Turn contacts off for speed
+ * @param result Filled in with the result. It is cleared first, so it can be
+ * reused between calls
+ * @return True if the state is in collision, false otherwise
+ */
+bool isStateColliding(const planning_scene::PlanningScene &scene,
+                      const moveit::core::RobotState &robot_state,
+                      const collision_detection::CollisionRequest &request,
+                      collision_detection::CollisionResult &result);
+
+/** Plans one request of a batch
+ *
+ * @param thread_idx Which thread is planning, from 0 to the thread count
+ * @param req The planning request
+ * @param stop Set once the batch has stopped early, so planning can end
+ * @param res The planning response
+ * @return The result
+ */
+using BatchPlanFn = std::function<Result(
+    size_t thread_idx, const APPlanningRequest &req,
+    const std::atomic<bool> &stop, APPlanningResponse &res)>;
+
+/** Calculates how many threads a batch should use
+ *
+ * @param options The batch options
+ * @param num_requests How many requests are in the batch
+ * @return The thread count, at least 1
+ */
+size_t batchThreadCount(const APPlanningBatchOptions &options,
+                        const size_t num_requests);
+
+/** Plans a batch of requests in parallel, stopping early as the options say
+ *
+ * @param reqs The planning requests
+ * @param options When to stop early
+ * @param num_threads How many threads to plan on
+ * @param plan_fn Plans one request. Each thread index is only used by one
+ * thread at a time
+ * @param batch_res The results, the responses, which requests were planned,
+ * and the best success
+ */
+void runBatch(const std::vector<APPlanningRequest> &reqs,
+              const APPlanningBatchOptions &options, const size_t num_threads,
+              const BatchPlanFn &plan_fn, APPlanningBatchResponse &batch_res);
+
+/** Runs a function on a number of threads and waits for all of them to finish
+ *
+ * @param num_threads The number of threads to run. The calling thread is used
+ * as one of them
+ * @param fn The function to run. It is passed the index of its thread
+ */
+void runInParallel(const size_t num_threads,
+                   const std::function<void(size_t)> &fn);
+
+/**
+ * Threads kept between calls, to run functions like runInParallel() without
+ * starting new threads every time. One run() happens at a time
+ */
+class WorkerPool {
+ public:
+  /** Starts the workers
+   *
+   * @param num_workers How many threads to start. The threads that call run()
+   * also do work, so this is one less than the most threads a run can use
+   */
+  WorkerPool(const size_t num_workers);
+  ~WorkerPool();
+
+  size_t numThreads() const { return workers_.size() + 1; }
+
+  /** Runs a function on a number of threads, like runInParallel()
+   *
+   * @param num_threads The number of threads to run, including the calling
+   * thread. It is capped at numThreads()
+   * @param fn The function to run. It is passed the index of its thread
+   */
+  void run(const size_t num_threads, const std::function<void(size_t)> &fn);
+
+ protected:
+  void work(const size_t worker_idx);
+
+  std::vector<std::thread> workers_;
+
+  // Only one run at a time
+  std::mutex run_mutex_;
+
+  // Guards the current run. Each run bumps the generation, and the workers
+  // with an index below num_active_ take part
+  std::mutex mutex_;
+  std::condition_variable start_cv_, done_cv_;
+  const std::function<void(size_t)> *fn_{nullptr};
+  size_t generation_{0};
+  size_t num_active_{0};
+  size_t num_running_{0};
+  bool stopping_{false};
+};
+
+/**
+ * A DSS state space with the screw and joint values in one contiguous array,
+ * screw values first. The distance and extent match a compound space of a
+ * screw and a joint RealVectorStateSpace, weighted like the subspaces of a
+ * CompoundStateSpace, without the extra allocations and virtual calls
+ */
+class DSSStateSpace : public ob::RealVectorStateSpace {
+ public:
+  /** Constructor. Add the screw dimensions first, then the joint dimensions
+   *
+   * @param num_screw_dims How many of the dimensions are screw values
+   * @param screw_weight The weight of the screw distance
+   * @param joint_weight The weight of the joint distance
+   */
+  DSSStateSpace(const size_t num_screw_dims, const double screw_weight = 1.0,
+                const double joint_weight = 1.0);
+
+  size_t getNumScrewDimensions() const { return num_screw_dims_; }
+
+  double distance(const ob::State *state1,
+                  const ob::State *state2) const override;
+
+  double getMaximumExtent() const override;
+
+ protected:
+  size_t num_screw_dims_;
+  double screw_weight_, joint_weight_;
+};
+
+/**
+ * Finds the screw and joint values in DSS states. The state space is either
+ * a CompoundStateSpace of a screw and a joint RealVectorStateSpace, or a
+ * DSSStateSpace. The layout is found once, so the accessors are cheap
+ */
+class DSSStateLayout {
+ public:
+  /** Constructor
+   *
+   * @param space The DSS state space
+   */
+  explicit DSSStateLayout(const ob::StateSpace *space);
+
+  double *screwValues(ob::State *state) const {
+    return flat_ ? state->as<ob::RealVectorStateSpace::StateType>()->values
+                 : state->as<ob::CompoundStateSpace::StateType>()
+                       ->as<ob::RealVectorStateSpace::StateType>(0)
+                       ->values;
+  }
+  const double *screwValues(const ob::State *state) const {
+    return screwValues(const_cast<ob::State *>(state));
+  }
+
+  double *jointValues(ob::State *state) const {
+    return flat_ ? state->as<ob::RealVectorStateSpace::StateType>()->values +
+                       num_screw_dims_
+                 : state->as<ob::CompoundStateSpace::StateType>()
+                       ->as<ob::RealVectorStateSpace::StateType>(1)
+                       ->values;
+  }
+  const double *jointValues(const ob::State *state) const {
+    return jointValues(const_cast<ob::State *>(state));
+  }
+
+  ob::RealVectorBounds getScrewBounds() const { return screw_bounds_; }
+  ob::RealVectorBounds getJointBounds() const { return joint_bounds_; }
+
+ protected:
+  bool flat_;
+  size_t num_screw_dims_;
+  ob::RealVectorBounds screw_bounds_, joint_bounds_;
+};
+
 /** Takes vectors and makes a screw/robot hybrid state
  *
  * @param space State space
@@ -88,11 +651,13 @@ class StringParam : public ob::GenericParam {
 
 /**
  * Holds a number of goal poses and allows checking if a state satisfies the
- * goal
+ * goal. If given a sampling function, more goal states can be added in the
+ * background while planning (see startSampling())
  */
-class ScrewGoal : public ob::GoalStates {
+class ScrewGoal : public ob::GoalLazySamples {
  public:
-  ScrewGoal(const ob::SpaceInformationPtr si);
+  ScrewGoal(const ob::SpaceInformationPtr si,
+            const ob::GoalSamplingFn &sampler = ob::GoalSamplingFn());
 
   /**
    * Returns the distance of the state to the goal. This is simple, and only
@@ -101,39 +666,174 @@ class ScrewGoal : public ob::GoalStates {
   double distanceGoal(const ob::State *state) const override;
 
  protected:
+  DSSStateLayout layout_;
   ob::RealVectorBounds screw_bounds_;
 };
 
 /**
  * Checks a state to make sure it is valid. That mostly means checking to make
  * sure the robot state places the EE link on the required screw axis
+ *
+ * This is thread safe: each calling thread gets its own robot state and
+ * constraints to work with
  */
-// TODO: this must be thread safe, is it?
 class ScrewValidityChecker : public ob::StateValidityChecker {
  public:
-  ScrewValidityChecker(const ob::SpaceInformationPtr &si);
+  ScrewValidityChecker(const ob::SpaceInformationPtr &si,
+                       const DSSContextPtr &context);
 
+  /** Checks a state, cheapest checks first: bounds, then the screw
+   * constraint, then collision. Nothing is allocated once a thread's
+   * workspace exists
+   */
   virtual bool isValid(const ob::State *state) const;
 
-  // Holds the kinematic model
-  // NOTE: You must set this before creating instances of this class!
-  inline static moveit::core::RobotModelPtr kinematic_model;
-
-  // Holds the planning scene, for collision checking
-  // NOTE: You must set this before creating instances of this class!
-  inline static std::shared_ptr<planning_scene_monitor::LockedPlanningSceneRO>
-      planning_scene;
+  /** Checks many states, split across threads in blocks. Each state gets
+   * the cheap checks first, and is only collision checked if it passes them,
+   * with the robot state they already updated
+   *
+   * @param states The states to check
+   * @param valid Set to whether each state is valid. Its storage is reused
+   * @param stop_at_invalid If true, states after the first invalid one may be
+   * skipped, and are marked invalid
+   * @param num_threads How many threads to use. If 0, the number of hardware
+   * threads
+   * @param pool If not null, the threads come from this pool, and there are
+   * at most its numThreads()
+   * @return The number of valid states
+   */
+  size_t areValid(const std::vector<ob::State *> &states,
+                  std::vector<char> &valid, const bool stop_at_invalid = false,
+                  size_t num_threads = 0, WorkerPool *pool = nullptr) const;
 
-  // Holds the constraints used for this plan
-  // NOTE: You must set this before creating instances of this class!
-  inline static std::shared_ptr<affordance_primitives::ScrewConstraint>
-      constraints;
+  /** Releases every thread's workspace, and the robot states they hold. Call
+   * it when a plan ends, while no thread is checking states
+   */
+  void releaseWorkspaces();
 
  protected:
+  // The data each thread needs to check states. The buffers are sized once so
+  // isValid does not allocate
+  struct Workspace {
+    moveit::core::RobotStatePtr kinematic_state;
+    std::shared_ptr<affordance_primitives::ScrewConstraint> constraints;
+    std::vector<double> screw_state;
+    affordance_primitives::ScrewConstraintSolution solution;
+    collision_detection::CollisionRequest collision_request;
+    collision_detection::CollisionResult collision_result;
+  };
+
+  std::unique_ptr<Workspace> makeWorkspace() const;
+
+  /** Runs every check but collision: bounds, then the screw constraint. The
+   * workspace's robot state is left at the state
+   *
+   * @param state The state to check
+   * @param workspace The calling thread's workspace
+   * @return True if the state passes, false otherwise
+   */
+  bool checkScrew(const ob::State *state, Workspace &workspace) const;
+
+  /** Checks the workspace's robot state for collisions
+   *
+   * @param workspace The calling thread's workspace
+   * @return True if the state is collision free, false otherwise
+   */
+  bool checkCollision(Workspace &workspace) const;
+
+  DSSContextPtr context_;
+  DSSStateLayout layout_;
   ob::RealVectorBounds robot_bounds_;
-  moveit::core::RobotStatePtr kinematic_state_;
   moveit::core::JointModelGroupPtr joint_model_group_;
   std::string ee_frame_name_;
+
+  // The link the EE frame is rigidly attached to, and the offset from it, so
+  // the EE pose does not need a frame lookup
+  const moveit::core::LinkModel *ee_link_;
+  Eigen::Isometry3d ee_offset_;
+
+  PerThread<Workspace> workspaces_;
+
+  // The workspaces of areValid()'s threads, kept between calls. One call runs
+  // at a time
+  mutable std::mutex batch_mutex_;
+  mutable std::vector<std::unique_ptr<Workspace>> batch_workspaces_;
+};
+
+/**
+ * Checks motions between states by following the screw: theta is stepped
+ * from the start to the end state, and at each step the joints are projected
+ * onto the screw pose with the Jacobian, starting from the previous step. The
+ * step size comes from the screw geometry, like SPS waypoints
+ *
+ * This is thread safe, like ScrewValidityChecker
+ */
+class ScrewMotionValidator : public ob::MotionValidator {
+ public:
+  /** Constructor
+   *
+   * @param si The space information
+   * @param context The plan context
+   * @param waypoint_dist The farthest apart steps can be (meters)
+   * @param waypoint_ang The farthest apart steps can be (radians)
+   * @param max_joint_step The most any joint may move in one step (radians or
+   * meters)
+   */
+  ScrewMotionValidator(const ob::SpaceInformationPtr &si,
+                       const DSSContextPtr &context,
+                       const double waypoint_dist = 0.01,
+                       const double waypoint_ang = 0.02,
+                       const double max_joint_step = 0.05);
+
+  bool checkMotion(const ob::State *s1, const ob::State *s2) const override;
+
+  bool checkMotion(const ob::State *s1, const ob::State *s2,
+                   std::pair<ob::State *, double> &last_valid) const override;
+
+  /** Computes the states along the motion from s1 to s2
+   *
+   * @param s1 The start state
+   * @param s2 The end state
+   * @param states The states along the motion, not including s1 but including
+   * s2. These are allocated and must be freed by the caller
+   * @return True if the whole motion is valid, false otherwise. The states up
+   * to the first invalid one are still returned
+   */
+  bool computeMotion(const ob::State *s1, const ob::State *s2,
+                     std::vector<ob::State *> &states) const;
+
+  /** Releases every thread's workspace, like
+   * ScrewValidityChecker::releaseWorkspaces()
+   */
+  void releaseWorkspaces() { workspaces_.clear(); }
+
+ protected:
+  // The data each thread needs to check motions
+  struct Workspace {
+    moveit::core::RobotStatePtr kinematic_state;
+    std::shared_ptr<affordance_primitives::ScrewConstraint> constraints;
+    ompl::base::ScopedState<> step_state, last_state;
+    std::vector<double> phi_a, phi_b, phi, q_a, q_b, q_prev, q;
+  };
+
+  /** Steps along the motion from s1 to s2
+   *
+   * @param s1 The start state
+   * @param s2 The end state
+   * @param states If not null, the states along the motion are added to it
+   * @param last_valid If not null, filled in with the last valid state
+   * @return True if the whole motion is valid, false otherwise
+   */
+  bool followMotion(const ob::State *s1, const ob::State *s2,
+                    std::vector<ob::State *> *states,
+                    std::pair<ob::State *, double> *last_valid) const;
+
+  DSSContextPtr context_;
+  DSSStateLayout layout_;
+  moveit::core::JointModelGroupPtr joint_model_group_;
+  std::vector<double> screw_steps_;
+  double max_joint_step_;
+  PerThread<Workspace> workspaces_;
 };
 
 }  // namespace ap_planning
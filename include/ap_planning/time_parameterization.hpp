@@ -0,0 +1,68 @@
+///////////////////////////////////////////////////////////////////////////////
+//      Title     : time_parameterization.hpp
+//      Project   : ap_planning
+//      Created   : 10/14/2026
+//      Author    : Adam Pettinger
+//      Copyright : Copyright© The University of Texas at Austin, 2014-2022. All
+//      rights reserved.
+//
+//          All files within this directory are subject to the following, unless
+//          an alternative license is explicitly included within the text of
+//          each file.
+//
+//          This software and documentation constitute an unpublished work
+//          and contain valuable trade secrets and proprietary information
+//          belonging to the University. None of the foregoing material may be
+//          copied or duplicated or disclosed without the express, written
+//          permission of the University. THE UNIVERSITY EXPRESSLY DISCLAIMS ANY
+//          AND ALL WARRANTIES CONCERNING THIS SOFTWARE AND DOCUMENTATION,
+//          INCLUDING ANY WARRANTIES OF MERCHANTABILITY AND/OR FITNESS FOR A
+//          PARTICULAR PURPOSE, AND WARRANTIES OF PERFORMANCE, AND ANY WARRANTY
+//          THAT MIGHT OTHERWISE ARISE FROM COURSE OF DEALING OR USAGE OF TRADE.
+//          NO WARRANTY IS EITHER EXPRESS OR IMPLIED WITH RESPECT TO THE USE OF
+//          THE SOFTWARE OR DOCUMENTATION. Under no circumstances shall the
+//          University be liable for incidental, special, indirect, direct or
+//          consequential damages or loss of profits, interruption of business,
+//          or related expenses which may arise from use of software or
+//          documentation, including but not limited to those resulting from
+//          defects in software and/or documentation, or loss or inaccuracy of
+//          data of any kind.
+//
+
+
+#pragma once
+
+#include <moveit/robot_model/joint_model_group.h>
+#include <trajectory_msgs/JointTrajectory.h>
+
+#include <vector>
+
+namespace ap_planning {
+
+/** Times a trajectory to follow its points as fast as the limits allow
+ *
+ * The points are kept, and the path between them is followed at the fastest
+ * speed profile that starts and ends at rest and keeps every joint within
+ * its velocity and acceleration limits. The screw progress between points
+ * can be limited too. Direction changes at the points are not limited, so
+ * the points should be close together, like the planners' outputs
+ *
+ * @param jmg The group the trajectory is for. Its joints' limits are used,
+ * and joints without limits do not slow the trajectory
+ * @param screw_steps The screw progress between each pair of points, or
+ * empty if it is not limited
+ * @param max_screw_velocity The screw velocity limit. 0 means no limit
+ * @param max_screw_acceleration The screw acceleration limit. 0 means no
+ * limit
+ * @param trajectory The trajectory. The times, velocities, and
+ * accelerations of its points are set
+ * @return True if the trajectory was timed, false if its points do not match
+ * the group or screw steps
+ */
+bool timeParameterize(const moveit::core::JointModelGroup& jmg,
+                      const std::vector<double>& screw_steps,
+                      const double max_screw_velocity,
+                      const double max_screw_acceleration,
+                      trajectory_msgs::JointTrajectory& trajectory);
+
+}  // namespace ap_planning
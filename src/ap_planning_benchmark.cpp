@@ -0,0 +1,442 @@
+#include <moveit/planning_scene_monitor/planning_scene_monitor.h>
+#include <ompl/config.h>
+#include <ompl/tools/benchmark/MachineSpecs.h>
+#include <ompl/util/RandomNumbers.h>
+#include <ros/ros.h>
+#include <ap_planning/ap_planning.hpp>
+
+#include <algorithm>
+#include <ctime>
+#include <fstream>
+#include <map>
+#include <sstream>
+
+namespace {
+// The properties written for each run, with their OMPL log types
+const std::vector<std::string> RUN_PROPERTIES{
+    "solved BOOLEAN",
+    "result INTEGER",
+    "time REAL",
+    "percentage complete REAL",
+    "path length REAL",
+    "trajectory duration REAL",
+    "scene time REAL",
+    "seeding time REAL",
+    "solve time REAL",
+    "simplify time REAL",
+    "interpolate time REAL",
+    "validate time REAL",
+    "ik calls INTEGER",
+    "ik successes INTEGER",
+    "ik collision checks INTEGER",
+    "is valid calls INTEGER",
+    "rejected bounds INTEGER",
+    "rejected screw error INTEGER",
+    "rejected phi mismatch INTEGER",
+    "rejected collision INTEGER",
+    "ik cache hits INTEGER",
+    "ik cache misses INTEGER",
+    "piece joins INTEGER",
+    "failed piece joins INTEGER",
+    "roadmap vertices INTEGER",
+    "roadmap edges INTEGER"};
+
+/**
+ * A recorded screw task to benchmark
+ */
+struct BenchmarkTask {
+  std::string name;
+  std::string scene_file;
+  ap_planning::APPlanningRequest request;
+};
+
+/**
+ * The runs of one planner on one task
+ */
+struct PlannerRuns {
+  std::string name;
+  std::vector<std::vector<std::string>> runs;
+  std::vector<double> solved_times;
+  std::vector<double> path_lengths;
+};
+
+double toDouble(XmlRpc::XmlRpcValue& value) {
+  if (value.getType() == XmlRpc::XmlRpcValue::TypeInt) {
+    return int(value);
+  }
+  return double(value);
+}
+
+bool toVector(XmlRpc::XmlRpcValue& value, std::vector<double>& output) {
+  if (value.getType() != XmlRpc::XmlRpcValue::TypeArray) {
+    return false;
+  }
+  output.clear();
+  for (int i = 0; i < value.size(); ++i) {
+    output.push_back(toDouble(value[i]));
+  }
+  return true;
+}
+
+/** Reads a task from the parameter server. See the README for the format
+ *
+ * @param value The task parameter
+ * @param task The task to fill out. The request's EE frame and planning time
+ * should already be set
+ * @return True if the task could be read, false otherwise
+ */
+bool readTask(XmlRpc::XmlRpcValue& value, BenchmarkTask& task) {
+  try {
+    task.name = std::string(value["name"]);
+    if (value.hasMember("scene_file")) {
+      task.scene_file = std::string(value["scene_file"]);
+    }
+
+    // Read the screw path
+    XmlRpc::XmlRpcValue& screws = value["screws"];
+    for (int i = 0; i < screws.size(); ++i) {
+      XmlRpc::XmlRpcValue& screw = screws[i];
+      ap_planning::ScrewSegment segment;
+      std::vector<double> origin, axis;
+      if (!toVector(screw["origin"], origin) ||
+          !toVector(screw["axis"], axis) || origin.size() != 3 ||
+          axis.size() != 3) {
+        ROS_ERROR_STREAM("Task " << task.name << " has a bad screw axis");
+        return false;
+      }
+      segment.screw_msg.header.frame_id = std::string(screw["frame"]);
+      segment.screw_msg.origin.x = origin[0];
+      segment.screw_msg.origin.y = origin[1];
+      segment.screw_msg.origin.z = origin[2];
+      segment.screw_msg.axis.x = axis[0];
+      segment.screw_msg.axis.y = axis[1];
+      segment.screw_msg.axis.z = axis[2];
+      segment.screw_msg.is_pure_translation =
+          screw.hasMember("pure_translation") &&
+          bool(screw["pure_translation"]);
+      segment.start_theta = toDouble(screw["start_theta"]);
+      segment.end_theta = toDouble(screw["end_theta"]);
+      task.request.screw_path.push_back(segment);
+    }
+
+    // Read the start, either a joint state or a pose
+    if (value.hasMember("start_joint_state")) {
+      toVector(value["start_joint_state"], task.request.start_joint_state);
+    } else {
+      XmlRpc::XmlRpcValue& pose = value["start_pose"];
+      std::vector<double> position, orientation;
+      if (!toVector(pose["position"], position) ||
+          !toVector(pose["orientation"], orientation) ||
+          position.size() != 3 || orientation.size() != 4) {
+        ROS_ERROR_STREAM("Task " << task.name << " has a bad start pose");
+        return false;
+      }
+      task.request.start_pose.header.frame_id = std::string(pose["frame"]);
+      task.request.start_pose.pose.position.x = position[0];
+      task.request.start_pose.pose.position.y = position[1];
+      task.request.start_pose.pose.position.z = position[2];
+      task.request.start_pose.pose.orientation.x = orientation[0];
+      task.request.start_pose.pose.orientation.y = orientation[1];
+      task.request.start_pose.pose.orientation.z = orientation[2];
+      task.request.start_pose.pose.orientation.w = orientation[3];
+    }
+  } catch (const XmlRpc::XmlRpcException& ex) {
+    ROS_ERROR_STREAM("Could not read task: " << ex.getMessage());
+    return false;
+  }
+  return !task.request.screw_path.empty();
+}
+
+/** Replaces the world in the monitored planning scene with a scene file
+ *
+ * @param psm The planning scene monitor
+ * @param scene_file The MoveIt .scene file
+ * @return True if the scene was loaded, false otherwise
+ */
+bool loadScene(const planning_scene_monitor::PlanningSceneMonitorPtr& psm,
+               const std::string& scene_file) {
+  bool loaded = true;
+  {
+    planning_scene_monitor::LockedPlanningSceneRW scene(psm);
+    scene->removeAllCollisionObjects();
+    if (!scene_file.empty()) {
+      std::ifstream file(scene_file);
+      loaded = file.good() && scene->loadGeometryFromStream(file);
+    }
+  }
+
+  // Editing the scene directly does not tell the monitor's listeners, so the
+  // scene version would not change
+  psm->triggerSceneUpdateEvent(
+      planning_scene_monitor::PlanningSceneMonitor::UPDATE_GEOMETRY);
+  return loaded;
+}
+
+std::vector<std::string> runProperties(
+    const ap_planning::Result result,
+    const ap_planning::APPlanningResponse& res) {
+  const bool solved = result == ap_planning::SUCCESS && res.trajectory_is_valid;
+  const ap_planning::APPlanningStatistics& stats = res.statistics;
+  const double duration =
+      res.joint_trajectory.points.empty()
+          ? 0
+          : res.joint_trajectory.points.back().time_from_start.toSec();
+  std::vector<double> values{double(solved),
+                             double(result),
+                             stats.total_time,
+                             res.percentage_complete,
+                             res.path_length,
+                             duration,
+                             stats.scene_time,
+                             stats.seeding_time,
+                             stats.solve_time,
+                             stats.simplify_time,
+                             stats.interpolate_time,
+                             stats.validate_time,
+                             double(stats.ik_calls),
+                             double(stats.ik_successes),
+                             double(stats.ik_collision_checks),
+                             double(stats.is_valid_calls),
+                             double(stats.rejected_bounds),
+                             double(stats.rejected_screw_error),
+                             double(stats.rejected_phi_mismatch),
+                             double(stats.rejected_collision),
+                             double(stats.ik_cache_hits),
+                             double(stats.ik_cache_misses),
+                             double(stats.piece_joins),
+                             double(stats.failed_piece_joins),
+                             double(stats.roadmap_vertices),
+                             double(stats.roadmap_edges)};
+
+  std::vector<std::string> output;
+  output.reserve(values.size());
+  for (const double value : values) {
+    // Keep enough digits that large counts stay integers
+    std::ostringstream ss;
+    ss.precision(15);
+    ss << value;
+    output.push_back(ss.str());
+  }
+  return output;
+}
+
+double percentile(std::vector<double> values, const double fraction) {
+  if (values.empty()) {
+    return 0;
+  }
+  std::sort(values.begin(), values.end());
+  const size_t idx = std::min(values.size() - 1,
+                              size_t(fraction * double(values.size() - 1)));
+  return values[idx];
+}
+
+/** Writes the runs of a task in the OMPL benchmark log format, which Planner
+ * Arena can read
+ */
+void writeLog(const std::string& filename, const BenchmarkTask& task,
+              const std::vector<PlannerRuns>& planners, const int seed,
+              const int num_runs, const double total_time,
+              const std::time_t start_time) {
+  std::ofstream out(filename);
+  out << "OMPL version " << OMPL_VERSION << std::endl;
+  out << "Experiment " << task.name << std::endl;
+  out << "1 experiment properties" << std::endl;
+  out << "use_ik_cache BOOLEAN = " << task.request.use_ik_cache << std::endl;
+  out << "Running on " << ompl::machine::getHostname() << std::endl;
+  out << "Starting at " << std::asctime(std::localtime(&start_time));
+  out << "<<<|" << std::endl
+      << "Scene file: " << task.scene_file << std::endl
+      << "|>>>" << std::endl;
+  out << "<<<|" << std::endl
+      << ompl::machine::getCPUInfo() << "|>>>" << std::endl;
+  out << seed << " is the random seed" << std::endl;
+  out << task.request.planning_time << " seconds per run" << std::endl;
+  out << "0 MB per run" << std::endl;
+  out << num_runs << " runs per planner" << std::endl;
+  out << total_time << " seconds spent to collect the data" << std::endl;
+  out << "0 enum types" << std::endl;
+  out << planners.size() << " planners" << std::endl;
+  for (const auto& planner : planners) {
+    out << planner.name << std::endl;
+    out << "0 common properties" << std::endl;
+    out << RUN_PROPERTIES.size() << " properties for each run" << std::endl;
+    for (const auto& property : RUN_PROPERTIES) {
+      out << property << std::endl;
+    }
+    out << planner.runs.size() << " runs" << std::endl;
+    for (const auto& run : planner.runs) {
+      for (const auto& value : run) {
+        out << value << "; ";
+      }
+      out << std::endl;
+    }
+    out << "." << std::endl;
+  }
+}
+}  // namespace
+
+int main(int argc, char** argv) {
+  ros::init(argc, argv, "ap_planning_benchmark");
+  ros::NodeHandle nh("~");
+  ros::AsyncSpinner spinner(2);
+  spinner.start();
+
+  // Read the benchmark parameters
+  std::string move_group_name, robot_description_name, ee_frame_name;
+  std::string output_directory;
+  int num_runs, seed;
+  double planning_time;
+  std::vector<std::string> planner_names;
+  if (!nh.getParam("move_group_name", move_group_name) ||
+      !nh.getParam("ee_frame_name", ee_frame_name)) {
+    ROS_ERROR("Parameters move_group_name and ee_frame_name are required");
+    return 1;
+  }
+  nh.param<std::string>("robot_description_name", robot_description_name,
+                        "robot_description");
+  nh.param<std::string>("output_directory", output_directory, ".");
+  nh.param<int>("runs", num_runs, 10);
+  nh.param<int>("seed", seed, 0);
+  nh.param<double>("planning_time", planning_time, 5.0);
+  nh.param<std::vector<std::string>>(
+      "planners", planner_names,
+      {"SPS", "PRM", "PRMstar", "RRT", "RRTconnect"});
+
+  // The DSS nearest neighbor structure and distance metric
+  std::string nn_name;
+  double screw_distance_weight;
+  nh.param<std::string>("nearest_neighbors", nn_name, "default");
+  nh.param<double>("screw_distance_weight", screw_distance_weight, 1.0);
+  bool lazy_collision_checking;
+  nh.param<bool>("lazy_collision_checking", lazy_collision_checking, false);
+
+  // The IK cache is cleared before each run, so runs do not help each other
+  bool use_ik_cache;
+  nh.param<bool>("use_ik_cache", use_ik_cache, false);
+  const std::map<std::string, ap_planning::NearestNeighborsType> nn_types{
+      {"default", ap_planning::DEFAULT_NN},
+      {"gnat", ap_planning::GNAT},
+      {"sqrt_approx", ap_planning::SQRT_APPROX},
+      {"linear", ap_planning::LINEAR}};
+  if (nn_types.count(nn_name) == 0) {
+    ROS_ERROR_STREAM("Unknown nearest_neighbors: " << nn_name);
+    return 1;
+  }
+
+  // Seeding OMPL makes the DSS runs repeatable. It must be done first
+  if (seed != 0) {
+    ompl::RNG::setSeed(seed);
+  }
+
+  // Read the tasks
+  std::vector<BenchmarkTask> tasks;
+  XmlRpc::XmlRpcValue task_params;
+  if (!nh.getParam("tasks", task_params) ||
+      task_params.getType() != XmlRpc::XmlRpcValue::TypeArray) {
+    ROS_ERROR("Parameter tasks is required, and must be a list");
+    return 1;
+  }
+  for (int i = 0; i < task_params.size(); ++i) {
+    BenchmarkTask task;
+    task.request.ee_frame_name = ee_frame_name;
+    task.request.planning_time = planning_time;
+    task.request.collect_statistics = true;
+    task.request.nearest_neighbors = nn_types.at(nn_name);
+    task.request.screw_distance_weight = screw_distance_weight;
+    task.request.lazy_collision_checking = lazy_collision_checking;
+    task.request.use_ik_cache = use_ik_cache;
+    if (readTask(task_params[i], task)) {
+      tasks.push_back(task);
+    }
+  }
+
+  // All planners share one robot model and scene monitor
+  const ap_planning::PlanningContextPtr context =
+      ap_planning::PlanningContext::get(robot_description_name);
+  if (!context->isValid()) {
+    return 1;
+  }
+
+  // Reachability maps let the planners reject unreachable tasks early
+  std::vector<std::string> reachability_maps;
+  nh.param<std::vector<std::string>>("reachability_maps", reachability_maps,
+                                     {});
+  for (const auto& map_file : reachability_maps) {
+    if (!context->loadReachabilityMap(map_file)) {
+      ROS_WARN_STREAM("Could not load reachability map " << map_file);
+    }
+  }
+  ap_planning::DSSPlanner dss_planner(context, move_group_name);
+  ap_planning::SequentialStepPlanner sps_planner(context, move_group_name);
+  if (!sps_planner.initialize()) {
+    ROS_ERROR("Could not initialize SPS");
+    return 1;
+  }
+
+  const std::map<std::string, ap_planning::PlannerType> dss_types{
+      {"PRM", ap_planning::PRM},
+      {"PRMstar", ap_planning::PRMstar},
+      {"RRT", ap_planning::RRT},
+      {"RRTconnect", ap_planning::RRTconnect},
+      {"PORTFOLIO", ap_planning::PORTFOLIO}};
+
+  for (const auto& task : tasks) {
+    if (!loadScene(context->getPlanningSceneMonitor(), task.scene_file)) {
+      ROS_ERROR_STREAM("Could not load scene for task " << task.name);
+      continue;
+    }
+
+    const std::time_t start_time = std::time(nullptr);
+    const ros::WallTime task_start = ros::WallTime::now();
+    std::vector<PlannerRuns> planners;
+    for (const auto& planner_name : planner_names) {
+      const bool is_sps = planner_name == "SPS";
+      if (!is_sps && dss_types.count(planner_name) == 0) {
+        ROS_WARN_STREAM("Unknown planner: " << planner_name);
+        continue;
+      }
+
+      PlannerRuns runs;
+      runs.name = is_sps ? "SPS" : "DSS_" + planner_name;
+      ap_planning::APPlanningRequest req = task.request;
+      if (!is_sps) {
+        req.planner = dss_types.at(planner_name);
+      }
+
+      for (int run = 0; run < num_runs && ros::ok(); ++run) {
+        context->getIKCache()->clear();
+        ap_planning::APPlanningResponse res;
+        const ap_planning::Result result =
+            is_sps ? sps_planner.plan(req, res) : dss_planner.plan(req, res);
+        runs.runs.push_back(runProperties(result, res));
+        if (result == ap_planning::SUCCESS && res.trajectory_is_valid) {
+          runs.solved_times.push_back(res.statistics.total_time);
+          runs.path_lengths.push_back(res.path_length);
+        }
+      }
+
+      // Summarize
+      const double success_rate =
+          runs.runs.empty() ? 0
+                            : double(runs.solved_times.size()) /
+                                  double(runs.runs.size());
+      ROS_INFO_STREAM(task.name
+                      << " " << runs.name << ": success "
+                      << 100 * success_rate << "%, time p50 "
+                      << percentile(runs.solved_times, 0.5) << " s, p90 "
+                      << percentile(runs.solved_times, 0.9) << " s, p99 "
+                      << percentile(runs.solved_times, 0.99)
+                      << " s, path length p50 "
+                      << percentile(runs.path_lengths, 0.5));
+      planners.push_back(runs);
+    }
+
+    const std::string filename = output_directory + "/" + task.name + ".log";
+    writeLog(filename, task, planners, seed, num_runs,
+             (ros::WallTime::now() - task_start).toSec(), start_time);
+    ROS_INFO_STREAM("Wrote " << filename);
+  }
+
+  ros::shutdown();
+  return 0;
+}
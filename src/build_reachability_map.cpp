@@ -0,0 +1,55 @@
+#include <moveit/planning_scene/planning_scene.h>
+#include <moveit/robot_model_loader/robot_model_loader.h>
+#include <ros/ros.h>
+#include <ap_planning/reachability_map.hpp>
+
+int main(int argc, char** argv) {
+  ros::init(argc, argv, "build_reachability_map");
+  ros::NodeHandle nh("~");
+
+  // Read the map parameters
+  std::string move_group_name, ee_frame_name, robot_description_name;
+  std::string output_file;
+  int num_samples;
+  double resolution;
+  if (!nh.getParam("move_group_name", move_group_name) ||
+      !nh.getParam("ee_frame_name", ee_frame_name) ||
+      !nh.getParam("output_file", output_file)) {
+    ROS_ERROR(
+        "Parameters move_group_name, ee_frame_name, and output_file are "
+        "required");
+    return 1;
+  }
+  nh.param<std::string>("robot_description_name", robot_description_name,
+                        "robot_description");
+  nh.param<int>("samples", num_samples, 1000000);
+  nh.param<double>("resolution", resolution, 0.05);
+
+  robot_model_loader::RobotModelLoader loader(robot_description_name);
+  const moveit::core::RobotModelPtr& model = loader.getModel();
+  if (!model || !model->hasJointModelGroup(move_group_name)) {
+    ROS_ERROR("Could not load the robot model or move group");
+    return 1;
+  }
+
+  // Only self collisions are checked, so the map does not depend on a scene
+  moveit::core::RobotState state(model);
+  state.setToDefaultValues();
+  const planning_scene::PlanningScene scene(model);
+  const ros::WallTime start = ros::WallTime::now();
+  const ap_planning::ReachabilityMapPtr map =
+      ap_planning::ReachabilityMap::build(
+          state, model->getJointModelGroup(move_group_name), ee_frame_name,
+          std::max(num_samples, 1), resolution, &scene);
+  if (!map) {
+    ROS_ERROR("Could not build the reachability map");
+    return 1;
+  }
+  if (!map->save(output_file)) {
+    ROS_ERROR_STREAM("Could not write " << output_file);
+    return 1;
+  }
+  ROS_INFO_STREAM("Wrote " << output_file << " in "
+                           << (ros::WallTime::now() - start).toSec() << " s");
+  return 0;
+}
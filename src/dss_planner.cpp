@@ -1,98 +1,207 @@
 #include <moveit/robot_model_loader/robot_model_loader.h>
+#include <ompl/base/PlannerDataStorage.h>
+#include <ompl/datastructures/NearestNeighborsGNAT.h>
+#include <ompl/datastructures/NearestNeighborsGNATNoThreadSafety.h>
+#include <ompl/datastructures/NearestNeighborsLinear.h>
+#include <ompl/datastructures/NearestNeighborsSqrtApprox.h>
 #include <ap_planning/dss_planner.hpp>
 
+#include <cmath>
+#include <iterator>
+#include <sstream>
+#include <thread>
+
 namespace ap_planning {
+namespace {
+// The most roadmaps to keep in the roadmap cache
+const size_t MAX_CACHED_ROADMAPS = 16;
+
+// How finely the start pose is rounded in roadmap keys
+const double ROADMAP_POSITION_RESOLUTION = 1e-4;     // meters
+const double ROADMAP_ORIENTATION_RESOLUTION = 1e-4;  // quaternion
+
+// Writes a pose to a roadmap key, rounded so sensor noise does not change it
+void writeRoundedPose(const Eigen::Isometry3d& pose, std::ostream& key) {
+  // q and -q are the same rotation, so keep w positive
+  Eigen::Quaterniond q(pose.linear());
+  if (q.w() < 0) {
+    q.coeffs() *= -1;
+  }
+  for (int i = 0; i < 3; ++i) {
+    key << llround(pose.translation()[i] / ROADMAP_POSITION_RESOLUTION) << " ";
+  }
+  for (int i = 0; i < 4; ++i) {
+    key << llround(q.coeffs()[i] / ROADMAP_ORIENTATION_RESOLUTION) << " ";
+  }
+  key << "\n";
+}
+
+// Sets the nearest neighbor structure of an OMPL planner. GNATType is the
+// thread safe or unsafe GNAT, to match the planner
+template <template <typename> class GNATType, typename PlannerT>
+void setNearestNeighbors(PlannerT& planner, const NearestNeighborsType type) {
+  switch (type) {
+    case NearestNeighborsType::GNAT:
+      planner.template setNearestNeighbors<GNATType>();
+      break;
+    case NearestNeighborsType::SQRT_APPROX:
+      planner.template setNearestNeighbors<ompl::NearestNeighborsSqrtApprox>();
+      break;
+    case NearestNeighborsType::LINEAR:
+      planner.template setNearestNeighbors<ompl::NearestNeighborsLinear>();
+      break;
+    case NearestNeighborsType::DEFAULT_NN:
+      break;
+  }
+}
+}  // namespace
+
 DSSPlanner::DSSPlanner(const std::string& move_group_name,
-                       const std::string& robot_description_name) {
-  // Load the robot model
-  robot_description_name_ = robot_description_name;
-  robot_model_loader::RobotModelLoader robot_model_loader(
-      robot_description_name);
-  kinematic_model_ = robot_model_loader.getModel();
+                       const std::string& robot_description_name)
+    : DSSPlanner(PlanningContext::get(robot_description_name),
+                 move_group_name) {}
+
+DSSPlanner::DSSPlanner(const PlanningContextPtr& planning_context,
+                       const std::string& move_group_name,
+                       const size_t num_ik_threads)
+    : planning_context_(planning_context) {
+  // Share the robot model and scene monitor
+  robot_description_name_ = planning_context_->getRobotDescriptionName();
+  kinematic_model_ = planning_context_->getRobotModel();
+  psm_ = planning_context_->getPlanningSceneMonitor();
 
   // Get information about the robot
-  joint_model_group_ = std::make_shared<moveit::core::JointModelGroup>(
-      *kinematic_model_->getJointModelGroup(move_group_name));
+  joint_model_group_ = planning_context_->getJointModelGroup(move_group_name);
 
   ik_solver_ = joint_model_group_->getSolverInstance();
 
-  psm_ = std::make_shared<planning_scene_monitor::PlanningSceneMonitor>(
-      robot_description_name_);
-  psm_->startSceneMonitor();
-  psm_->startStateMonitor();
-
-  // Set kinematic model for classes that will need it
-  ScrewSampler::kinematic_model = kinematic_model_;
-  ScrewValidityChecker::kinematic_model = kinematic_model_;
-  ScrewValidSampler::kinematic_model = kinematic_model_;
+  // Each IK seeding thread needs its own solver instance
+  const size_t num_solvers =
+      num_ik_threads > 0
+          ? num_ik_threads
+          : std::max(1u, std::thread::hardware_concurrency());
+  ik_solvers_ =
+      planning_context_->acquireIKSolvers(move_group_name, num_solvers);
+  validate_pool_.reset(
+      new WorkerPool(std::max<size_t>(ik_solvers_.size(), 1) - 1));
 }
+
 DSSPlanner::~DSSPlanner() { cleanUp(); }
 
 ap_planning::Result DSSPlanner::plan(const APPlanningRequest& req,
                                      APPlanningResponse& res) {
-  // Set response to failing case
-  res.joint_trajectory.joint_names.clear();
-  res.joint_trajectory.points.clear();
-  res.percentage_complete = 0.0;
-  res.trajectory_is_valid = false;
-
-  kinematic_state_ = std::make_shared<moveit::core::RobotState>(
-      *(psm_->getStateMonitor()->getCurrentState()));
-
   // Get the planning scene
-  psm_->requestPlanningSceneState();
+  const ros::WallTime scene_start = ros::WallTime::now();
+  const SceneSnapshotPtr snapshot = planning_context_->takeSnapshot();
+  const double scene_time = (ros::WallTime::now() - scene_start).toSec();
 
-  planning_scene_ =
-      std::make_shared<planning_scene_monitor::LockedPlanningSceneRO>(psm_);
-
-  // Set planning scene for classes that will need it
-  ScrewSampler::planning_scene = planning_scene_;
-  ScrewValidSampler::planning_scene = planning_scene_;
-  ScrewValidityChecker::planning_scene = planning_scene_;
+  const ap_planning::Result result = plan(req, snapshot, res);
+  res.statistics.scene_time = scene_time;
+  res.statistics.total_time += scene_time;
+  return result;
+}
 
-  constraints_ = req.toConstraint();
+ap_planning::Result DSSPlanner::plan(const APPlanningRequest& req,
+                                     const SceneSnapshotPtr& snapshot,
+                                     APPlanningResponse& res) {
+  return plan(req, snapshot, nullptr, nullptr, res);
+}
 
-  // Set up the state space for this plan
-  if (!setupStateSpace(req)) {
-    cleanUp();
-    return INITIALIZATION_FAIL;
-  }
+ap_planning::Result DSSPlanner::plan(const APPlanningRequest& req,
+                                     const APPlanningResponse& hint,
+                                     APPlanningResponse& res) {
+  // The hint is copied, since it may be the response being filled in
+  const trajectory_msgs::JointTrajectory hint_trajectory =
+      hint.joint_trajectory;
 
-  // Set the parameters for the state space
-  if (!setSpaceParameters(req, state_space_)) {
-    cleanUp();
-    return INITIALIZATION_FAIL;
-  }
+  // Get the planning scene
+  const ros::WallTime scene_start = ros::WallTime::now();
+  const SceneSnapshotPtr snapshot = planning_context_->takeSnapshot();
+  const double scene_time = (ros::WallTime::now() - scene_start).toSec();
+
+  const ap_planning::Result result =
+      plan(req, snapshot, nullptr, &hint_trajectory, res);
+  res.statistics.scene_time = scene_time;
+  res.statistics.total_time += scene_time;
+  return result;
+}
 
-  // Set the sampler and lock
-  state_space_->setStateSamplerAllocator(ap_planning::allocScrewSampler);
-  state_space_->as<ob::CompoundStateSpace>()->lock();
+ap_planning::Result DSSPlanner::plan(
+    const APPlanningRequest& req, const SceneSnapshotPtr& snapshot,
+    const std::atomic<bool>* cancel,
+    const trajectory_msgs::JointTrajectory* hint, APPlanningResponse& res) {
+  // Set response to failing case
+  res.joint_trajectory.joint_names.clear();
+  res.joint_trajectory.points.clear();
+  res.percentage_complete = 0.0;
+  res.trajectory_is_valid = false;
+  res.path_length = -1;
+  res.statistics = APPlanningStatistics();
+  const ros::WallTime plan_start = ros::WallTime::now();
+  ros::WallTime phase_start = plan_start;
+
+  // Plan in the snapshot's scene. The state is copied, since it is changed
+  kinematic_state_ =
+      std::make_shared<moveit::core::RobotState>(*snapshot->robot_state);
+  kinematic_state_->update();
+  planning_scene_ = snapshot->planning_scene;
+  scene_fingerprint_ = sceneFingerprint(
+      snapshot->scene_version, *kinematic_state_, *joint_model_group_);
 
-  // Set up... the SimpleSetup
-  if (!setSimpleSetup(state_space_, req)) {
+  constraints_ = req.toConstraint();
+  counters_ = req.collect_statistics ? std::make_shared<PlanningCounters>()
+                                     : nullptr;
+  reachability_map_ =
+      req.check_reachability
+          ? planning_context_->getReachabilityMap(
+                joint_model_group_->getName(), req.ee_frame_name)
+          : nullptr;
+
+  // Reject paths the arm can not reach before setting up a planner or
+  // solving any IK
+  getStartTF(req);
+  pose_table_ =
+      std::make_shared<const ScrewPoseTable>(*constraints_, req.screw_path);
+  if (reachability_map_ &&
+      !reachability_map_->isPathReachable(
+          *pose_table_, reachability_map_->getBasePose(*kinematic_state_))) {
+    finishStatistics(req, plan_start, res);
     cleanUp();
-    return INITIALIZATION_FAIL;
+    return NO_IK_SOLUTION;
   }
 
-  // Set constraints for classes that will need it
-  ScrewSampler::constraints = constraints_;
-  ScrewValidSampler::constraints = constraints_;
-  ScrewValidityChecker::constraints = constraints_;
-
-  // Create start and goal states
-  std::vector<std::vector<double>> start_configs, goal_configs;
-  if (passed_start_config_) {
-    if (!findGoalStates(req, 30, start_configs, goal_configs)) {
+  // Reuse the roadmap from an earlier plan of this task, if asked to
+  const bool reuse_roadmap = req.reuse_roadmap &&
+                             !req.lazy_collision_checking &&
+                             (req.planner == PlannerType::PRM ||
+                              req.planner == PlannerType::PRMstar);
+  const std::string roadmap_key = reuse_roadmap ? roadmapKey(req) : "";
+  if (!reuse_roadmap || !useCachedRoadmap(req, roadmap_key)) {
+    if (!setUpPlanner(req)) {
       cleanUp();
-      return NO_IK_SOLUTION;
+      return INITIALIZATION_FAIL;
     }
-  } else {
-    if (!findStartGoalStates(req, 20, 30, start_configs, goal_configs)) {
-      cleanUp();
-      return NO_IK_SOLUTION;
+    if (reuse_roadmap) {
+      cacheRoadmap(req, roadmap_key);
     }
   }
 
+  // Create start and goal states. Lazy goals are solved while planning
+  phase_start = ros::WallTime::now();
+  const size_t num_goal = req.lazy_goal_sampling ? 0 : req.num_goal_configs;
+  std::vector<std::vector<double>> start_configs, goal_configs;
+  const bool seeded =
+      passed_start_config_
+          ? findGoalStates(req, num_goal, start_configs, goal_configs)
+          : findStartGoalStates(req, req.num_start_configs, num_goal,
+                                start_configs, goal_configs);
+  res.statistics.seeding_time = (ros::WallTime::now() - phase_start).toSec();
+  if (!seeded) {
+    finishStatistics(req, plan_start, res);
+    cleanUp();
+    return NO_IK_SOLUTION;
+  }
+
   // Set the start states
   for (const auto& start_state : start_configs) {
     ss_->addStartState(
@@ -100,45 +209,205 @@ ap_planning::Result DSSPlanner::plan(const APPlanningRequest& req,
   }
 
   // Create and populate the goal object
-  auto goal_obj = std::make_shared<ScrewGoal>(ss_->getSpaceInformation());
+  if (req.lazy_goal_sampling) {
+    // Seeding is done, so this planner's solvers are idle until the next
+    // plan. The goal sampler borrows one of them instead of taking another
+    // from the context's pool, as the samplers do with
+    // acquireSamplerIKSolver()
+    goal_sampler_ = std::make_shared<ScrewGoalSampler>(
+        context_, ik_solvers_.back(), req.num_goal_configs,
+        2 * req.num_goal_configs);
+    const std::shared_ptr<ScrewGoalSampler> goal_sampler = goal_sampler_;
+    screw_goal_ = std::make_shared<ScrewGoal>(
+        ss_->getSpaceInformation(),
+        [goal_sampler](const ob::GoalLazySamples* goal, ob::State* state) {
+          return goal_sampler->sample(goal, state);
+        });
+  } else {
+    screw_goal_ = std::make_shared<ScrewGoal>(ss_->getSpaceInformation());
+  }
   for (const auto& goal_state : goal_configs) {
-    goal_obj->addState(
+    screw_goal_->addState(
         vectorToState(state_space_, constraints_->goalPhi(), goal_state));
   }
-  ss_->setGoal(goal_obj);
+  ss_->setGoal(screw_goal_);
+  if (goal_sampler_) {
+    screw_goal_->startSampling();
+  }
+
+  // Plan, unless the hint's path is still a solution
+  phase_start = ros::WallTime::now();
+  ob::PlannerStatus solved = ob::PlannerStatus::EXACT_SOLUTION;
+  if (!hint || !useWarmStart(req, *hint)) {
+    solved = cancel ? ss_->solve(ob::plannerOrTerminationCondition(
+                          ob::timedPlannerTerminationCondition(
+                              req.planning_time),
+                          ob::PlannerTerminationCondition(
+                              [cancel]() { return bool(*cancel); })))
+                    : ss_->solve(req.planning_time);
+  }
+  stopGoalSampling();
+  res.statistics.solve_time = (ros::WallTime::now() - phase_start).toSec();
+  if (screw_goal_->getStateCount() == 0) {
+    finishStatistics(req, plan_start, res);
+    cleanUp();
+    return NO_IK_SOLUTION;
+  }
 
-  // Plan
-  ob::PlannerStatus solved = ss_->solve(req.planning_time);
   ap_planning::Result result = PLANNING_FAIL;
   if (solved == ompl::base::PlannerStatus::EXACT_SOLUTION ||
       solved == ompl::base::PlannerStatus::APPROXIMATE_SOLUTION) {
+    phase_start = ros::WallTime::now();
     ss_->simplifySolution(1.0);
+    res.statistics.simplify_time =
+        (ros::WallTime::now() - phase_start).toSec();
 
     populateResponse(ss_->getSolutionPath(), req, res);
     result = solved == ompl::base::PlannerStatus::EXACT_SOLUTION
                  ? ap_planning::Result::SUCCESS
                  : ap_planning::Result::PLANNING_FAIL;
   }
+  finishStatistics(req, plan_start, res);
   cleanUp();
   return result;
 }
 
+void DSSPlanner::planBatch(const std::vector<APPlanningRequest>& reqs,
+                           const APPlanningBatchOptions& options,
+                           APPlanningBatchResponse& batch_res) {
+  // Every request uses one scene, taken now
+  const SceneSnapshotPtr snapshot = planning_context_->takeSnapshot();
+
+  // Each thread plans on its own planner. The first is this one, and the
+  // rest are kept for later batches. They seed IK on one thread each, since
+  // the batch is already parallel
+  const size_t num_threads = batchThreadCount(options, reqs.size());
+  while (batch_workers_.size() + 1 < num_threads) {
+    batch_workers_.emplace_back(new DSSPlanner(
+        planning_context_, joint_model_group_->getName(), 1));
+  }
+
+  runBatch(reqs, options, num_threads,
+           [&](size_t thread_idx, const APPlanningRequest& req,
+               const std::atomic<bool>& stop, APPlanningResponse& res) {
+             DSSPlanner& planner =
+                 thread_idx == 0 ? *this : *batch_workers_.at(thread_idx - 1);
+             return planner.plan(req, snapshot, &stop, nullptr, res);
+           },
+           batch_res);
+}
+
+void DSSPlanner::finishStatistics(const APPlanningRequest& req,
+                                  const ros::WallTime& plan_start,
+                                  APPlanningResponse& res) {
+  if (counters_) {
+    counters_->copyTo(res.statistics);
+  }
+  if (req.collect_statistics && ss_ && ss_->getPlanner()) {
+    ob::PlannerData data(ss_->getSpaceInformation());
+    ss_->getPlanner()->getPlannerData(data);
+    res.statistics.roadmap_vertices = data.numVertices();
+    res.statistics.roadmap_edges = data.numEdges();
+  }
+  res.statistics.total_time = (ros::WallTime::now() - plan_start).toSec();
+}
+
+bool DSSPlanner::setUpPlanner(const APPlanningRequest& req) {
+  // Set up the context this plan's samplers and checkers will use
+  context_ = std::make_shared<DSSContext>();
+  context_->kinematic_model = kinematic_model_;
+  context_->planning_scene = planning_scene_;
+  context_->constraints = constraints_;
+  context_->request = req;
+  context_->move_group_name = joint_model_group_->getName();
+  context_->ee_frame_name = req.ee_frame_name;
+  context_->joint_model_group = joint_model_group_;
+  context_->state_pool = std::make_shared<RobotStatePool>(*kinematic_state_);
+  context_->counters = counters_;
+  context_->planning_context = planning_context_;
+  context_->ik_cache =
+      req.use_ik_cache ? planning_context_->getIKCache() : nullptr;
+  context_->scene_fingerprint = scene_fingerprint_;
+
+  // Set up the state space for this plan
+  if (!setupStateSpace(req)) {
+    return false;
+  }
+
+  // Set the parameters for the state space
+  if (!setSpaceParameters(req, state_space_)) {
+    return false;
+  }
+
+  // Set the sampler and lock
+  const DSSContextPtr context = context_;
+  state_space_->setStateSamplerAllocator(
+      [context](const ob::StateSpace* space) {
+        return ap_planning::allocScrewSampler(space, context);
+      });
+  if (state_space_->isCompound()) {
+    state_space_->as<ob::CompoundStateSpace>()->lock();
+  }
+
+  // Set up... the SimpleSetup
+  return setSimpleSetup(state_space_, req);
+}
+
+void DSSPlanner::stopGoalSampling() {
+  if (goal_sampler_) {
+    goal_sampler_->stop();
+    goal_sampler_.reset();
+  }
+  if (screw_goal_) {
+    screw_goal_->stopSampling();
+  }
+}
+
 void DSSPlanner::cleanUp() {
+  stopGoalSampling();
+  screw_goal_.reset();
+
+  // Each thread that checked states has a workspace. A cached roadmap keeps
+  // its checkers, and the next plan runs on new threads, so release them
+  if (ss_) {
+    const ob::SpaceInformationPtr& si = ss_->getSpaceInformation();
+    if (const auto checker = std::dynamic_pointer_cast<ScrewValidityChecker>(
+            si->getStateValidityChecker())) {
+      checker->releaseWorkspaces();
+    }
+    if (const auto validator = std::dynamic_pointer_cast<ScrewMotionValidator>(
+            si->getMotionValidator())) {
+      validator->releaseWorkspaces();
+    }
+  }
+
+  // Samplers may outlive the plan, so release the scene snapshot they use
+  if (context_) {
+    context_->planning_scene.reset();
+    context_->constraints.reset();
+    context_->counters.reset();
+    context_.reset();
+  }
+  counters_.reset();
+  reachability_map_.reset();
+  pose_table_.reset();
   planning_scene_.reset();
-  ScrewSampler::planning_scene.reset();
-  ScrewValidSampler::planning_scene.reset();
-  ScrewValidityChecker::planning_scene.reset();
-  ScrewSampler::constraints.reset();
-  ScrewValidSampler::constraints.reset();
-  ScrewValidityChecker::constraints.reset();
 }
 
 bool DSSPlanner::setupStateSpace(const APPlanningRequest& req) {
   state_space_.reset();
 
-  // construct the state space we are planning in
+  // construct the state space we are planning in. The flat space keeps the
+  // screw dimensions first, followed by the joints
   auto screw_space = std::make_shared<ob::RealVectorStateSpace>();
-  auto joint_space = std::make_shared<ob::RealVectorStateSpace>();
+  std::shared_ptr<ob::RealVectorStateSpace> joint_space;
+  if (req.flat_state_space) {
+    screw_space = std::make_shared<DSSStateSpace>(
+        req.screw_path.size(), req.screw_distance_weight);
+    joint_space = screw_space;
+  } else {
+    joint_space = std::make_shared<ob::RealVectorStateSpace>();
+  }
 
   // Add screw dimensions
   for (const auto& segment : req.screw_path) {
@@ -171,17 +440,21 @@ bool DSSPlanner::setupStateSpace(const APPlanningRequest& req) {
   }
 
   // combine the state space
-  state_space_ = screw_space + joint_space;
+  if (req.flat_state_space) {
+    state_space_ = screw_space;
+  } else {
+    auto compound_space = std::make_shared<ob::CompoundStateSpace>();
+    compound_space->addSubspace(screw_space, req.screw_distance_weight);
+    compound_space->addSubspace(joint_space, 1.0);
+    state_space_ = compound_space;
+  }
   return true;
 }
 
 bool DSSPlanner::setSpaceParameters(const APPlanningRequest& req,
                                     ompl::base::StateSpacePtr& space) {
-  // Handle the starting transformation
-  getStartTF(req);
-
-  // Solve the goal pose
-  goal_pose_ = constraints_->getPose(constraints_->goalPhi());
+  // Solve the path and goal poses
+  setUpPoseTable();
 
   // Add EE frame name and move group parameters
   auto ee_name_param =
@@ -213,75 +486,274 @@ void DSSPlanner::getStartTF(const APPlanningRequest& req) {
   }
 }
 
+void DSSPlanner::setUpPoseTable() {
+  context_->pose_table = pose_table_;
+  goal_pose_ = context_->getPose(constraints_->goalPhi(), *constraints_);
+}
+
 bool DSSPlanner::setSimpleSetup(const ompl::base::StateSpacePtr& space,
                                 const APPlanningRequest& req) {
   // Create the SimpleSetup class
   ss_ = std::make_shared<og::SimpleSetup>(space);
 
   // Set state validity checking
-  ss_->setStateValidityChecker(
-      std::make_shared<ScrewValidityChecker>(ss_->getSpaceInformation()));
+  ss_->setStateValidityChecker(std::make_shared<ScrewValidityChecker>(
+      ss_->getSpaceInformation(), context_));
+
+  // Edges follow the screw instead of interpolating the joints
+  ss_->getSpaceInformation()->setMotionValidator(
+      std::make_shared<ScrewMotionValidator>(ss_->getSpaceInformation(),
+                                             context_));
 
   // Set valid state sampler
+  const DSSContextPtr context = context_;
   ss_->getSpaceInformation()->setValidStateSamplerAllocator(
-      ap_planning::allocScrewValidSampler);
-
-  // Set planner
-  if (req.planner == PlannerType::PRMstar) {
+      [context](const ob::SpaceInformation* si) {
+        return ap_planning::allocScrewValidSampler(si, context);
+      });
+
+  // Set planner. The roadmap planners are multithreaded, so they get the
+  // thread safe GNAT
+  if (req.planner == PlannerType::PRMstar && req.lazy_collision_checking) {
+    auto planner =
+        std::make_shared<og::LazyPRMstar>(ss_->getSpaceInformation());
+    setNearestNeighbors<ompl::NearestNeighborsGNAT>(*planner,
+                                                    req.nearest_neighbors);
+    ss_->setPlanner(planner);
+  } else if (req.planner == PlannerType::PRMstar) {
     auto planner = std::make_shared<og::PRMstar>(ss_->getSpaceInformation());
+    setNearestNeighbors<ompl::NearestNeighborsGNAT>(*planner,
+                                                    req.nearest_neighbors);
     ss_->setPlanner(planner);
   } else if (req.planner == PlannerType::RRT) {
     auto planner = std::make_shared<og::RRT>(ss_->getSpaceInformation());
+    setNearestNeighbors<ompl::NearestNeighborsGNATNoThreadSafety>(
+        *planner, req.nearest_neighbors);
     ss_->setPlanner(planner);
   } else if (req.planner == PlannerType::RRTconnect) {
     auto planner = std::make_shared<og::RRTConnect>(ss_->getSpaceInformation());
+    setNearestNeighbors<ompl::NearestNeighborsGNATNoThreadSafety>(
+        *planner, req.nearest_neighbors);
+    ss_->setPlanner(planner);
+  } else if (req.planner == PlannerType::PORTFOLIO) {
+    // The planners run at the same time on the same space information, so
+    // they share the validity checker and the context behind the samplers.
+    // Those are safe to share because the checker keeps a workspace per thread
+    // and each sampler copies the constraints. Each nearest neighbor structure
+    // belongs to one planner, so only the multithreaded roadmap planners need
+    // the thread safe GNAT
+    const ob::SpaceInformationPtr& si = ss_->getSpaceInformation();
+    auto portfolio =
+        std::make_shared<PortfolioPlanner>(si, req.hybridize_portfolio);
+    auto rrt_connect = std::make_shared<og::RRTConnect>(si);
+    setNearestNeighbors<ompl::NearestNeighborsGNATNoThreadSafety>(
+        *rrt_connect, req.nearest_neighbors);
+    portfolio->addPlanner(rrt_connect);
+    auto prm = std::make_shared<og::PRM>(si);
+    setNearestNeighbors<ompl::NearestNeighborsGNAT>(*prm,
+                                                    req.nearest_neighbors);
+    portfolio->addPlanner(prm);
+    auto lazy_prm = std::make_shared<og::LazyPRM>(si);
+    setNearestNeighbors<ompl::NearestNeighborsGNAT>(*lazy_prm,
+                                                    req.nearest_neighbors);
+    portfolio->addPlanner(lazy_prm);
+    ss_->setPlanner(portfolio);
+  } else if (req.lazy_collision_checking) {
+    auto planner = std::make_shared<og::LazyPRM>(ss_->getSpaceInformation());
+    setNearestNeighbors<ompl::NearestNeighborsGNAT>(*planner,
+                                                    req.nearest_neighbors);
     ss_->setPlanner(planner);
   } else {
     auto planner = std::make_shared<og::PRM>(ss_->getSpaceInformation());
+    setNearestNeighbors<ompl::NearestNeighborsGNAT>(*planner,
+                                                    req.nearest_neighbors);
     ss_->setPlanner(planner);
   }
 
   return true;
 }
 
-bool DSSPlanner::findStartGoalStates(
-    const APPlanningRequest& req, const size_t num_start, const size_t num_goal,
-    std::vector<std::vector<double>>& start_configs,
-    std::vector<std::vector<double>>& goal_configs) {
-  if (num_goal < 1 || num_start < 1) {
+std::string DSSPlanner::roadmapKey(const APPlanningRequest& req) const {
+  std::ostringstream key;
+  key << joint_model_group_->getName() << "\n"
+      << req.ee_frame_name << "\n"
+      << req.screw_path_type << " " << req.planner << " "
+      << req.flat_state_space << " " << req.nearest_neighbors << " "
+      << req.screw_distance_weight << "\n";
+
+  for (const auto& segment : req.screw_path) {
+    // The stamp does not change the task
+    auto screw_msg = segment.screw_msg;
+    screw_msg.header.seq = 0;
+    screw_msg.header.stamp = ros::Time();
+    key << screw_msg << segment.start_theta << " " << segment.end_theta << " "
+        << segment.lower_bound.value_or(segment.start_theta) << " "
+        << segment.upper_bound.value_or(segment.end_theta) << "\n";
+  }
+
+  // The reference frame comes from the start EE pose, from the start joint
+  // state or the start pose
+  if (req.start_joint_state.size() == joint_model_group_->getVariableCount()) {
+    // Outside of a plan, the joints not in the group are the current ones
+    moveit::core::RobotState start_state(
+        kinematic_state_ ? *kinematic_state_
+                         : *planning_context_->takeSnapshot()->robot_state);
+    start_state.setJointGroupPositions(joint_model_group_.get(),
+                                       req.start_joint_state);
+    start_state.update();
+    writeRoundedPose(start_state.getFrameTransform(req.ee_frame_name), key);
+  } else {
+    Eigen::Isometry3d start_pose;
+    tf2::fromMsg(req.start_pose.pose, start_pose);
+    key << req.start_pose.header.frame_id << "\n";
+    writeRoundedPose(start_pose, key);
+  }
+  return key.str();
+}
+
+bool DSSPlanner::useCachedRoadmap(const APPlanningRequest& req,
+                                  const std::string& key) {
+  auto entry = roadmap_cache_.find(key);
+  if (entry == roadmap_cache_.end()) {
     return false;
   }
+  RoadmapCacheEntry& cached = entry->second;
+  roadmap_usage_order_.splice(roadmap_usage_order_.end(),
+                              roadmap_usage_order_, cached.usage);
+
+  // The cached samplers and checker hold on to the cached context, so update
+  // it in place
+  context_ = cached.context;
+  context_->planning_scene = planning_scene_;
+  context_->constraints = constraints_;
+  context_->request = req;
+  context_->state_pool->setPrototype(*kinematic_state_);
+  context_->counters = counters_;
+  context_->ik_cache =
+      req.use_ik_cache ? planning_context_->getIKCache() : nullptr;
+  context_->scene_fingerprint = scene_fingerprint_;
+
+  ss_ = cached.ss;
+  state_space_ = ss_->getStateSpace();
+  setUpPoseTable();
+
+  // Forget the last query, but keep the roadmap
+  ss_->clearStartStates();
+  ss_->getProblemDefinition()->clearSolutionPaths();
+  ss_->getPlanner()->clearQuery();
+
+  // If the scene changed, the roadmap is no longer known to be valid. Check
+  // states with the current robot state, and let LazyPRM re-validate the
+  // cached edges as they are used
+  if (scene_fingerprint_ != cached.scene_fingerprint) {
+    ss_->setStateValidityChecker(std::make_shared<ScrewValidityChecker>(
+        ss_->getSpaceInformation(), context_));
+    ss_->getSpaceInformation()->setMotionValidator(
+        std::make_shared<ScrewMotionValidator>(ss_->getSpaceInformation(),
+                                               context_));
+
+    ob::PlannerData data(ss_->getSpaceInformation());
+    ss_->getPlanner()->getPlannerData(data);
+    data.decoupleFromPlanner();
+    ss_->setPlanner(std::make_shared<og::LazyPRM>(
+        data, req.planner == PlannerType::PRMstar));
+    cached.scene_fingerprint = scene_fingerprint_;
+  }
+  return true;
+}
 
-  start_configs.clear();
-  start_configs.reserve(num_start);
-  goal_configs.clear();
-  goal_configs.reserve(num_goal);
-
-  geometry_msgs::Pose goal_pose_msg = tf2::toMsg(goal_pose_);
-  geometry_msgs::Pose start_pose_msg = tf2::toMsg(start_pose_);
-
-  // Go through and make configurations
-  size_t i = 0;
-  while ((start_configs.size() < num_start || goal_configs.size() < num_goal) &&
-         i < 2 * (num_goal + num_start)) {
-    // Every time, we set to random states to get variety in solutions
-    kinematic_state_->setToRandomPositions(joint_model_group_.get());
-    i++;
-
-    // Try to add a start configuration
-    if (start_configs.size() < num_start) {
-      increaseStateList(joint_model_group_, kinematic_state_, *planning_scene_,
-                        ik_solver_, start_pose_msg, start_configs);
+void DSSPlanner::cacheRoadmap(const APPlanningRequest& req,
+                              const std::string& key) {
+  // Use a loaded roadmap if there is one. It was made in an unknown scene, so
+  // its edges are re-validated as they are used
+  auto file = roadmap_files_.find(key);
+  if (file != roadmap_files_.end()) {
+    ob::PlannerData data(ss_->getSpaceInformation());
+    ob::PlannerDataStorage storage;
+    storage.load(file->second.c_str(), data);
+    if (data.numVertices() > 0) {
+      ss_->setPlanner(std::make_shared<og::LazyPRM>(
+          data, req.planner == PlannerType::PRMstar));
+    } else {
+      ROS_WARN_STREAM("Could not load roadmap from: " << file->second);
     }
+    roadmap_files_.erase(file);
+  }
 
-    // Try to add a goal configuration
-    if (goal_configs.size() < num_goal) {
-      increaseStateList(joint_model_group_, kinematic_state_, *planning_scene_,
-                        ik_solver_, goal_pose_msg, goal_configs);
+  auto entry = roadmap_cache_.find(key);
+  if (entry == roadmap_cache_.end()) {
+    // Make room by dropping the least recently used roadmap
+    while (roadmap_cache_.size() >= MAX_CACHED_ROADMAPS &&
+           !roadmap_usage_order_.empty()) {
+      roadmap_cache_.erase(roadmap_usage_order_.front());
+      roadmap_usage_order_.pop_front();
     }
+    roadmap_usage_order_.push_back(key);
+    entry = roadmap_cache_.emplace(key, RoadmapCacheEntry()).first;
+    entry->second.usage = std::prev(roadmap_usage_order_.end());
+  } else {
+    roadmap_usage_order_.splice(roadmap_usage_order_.end(),
+                                roadmap_usage_order_, entry->second.usage);
   }
+  entry->second.ss = ss_;
+  entry->second.context = context_;
+  entry->second.scene_fingerprint = scene_fingerprint_;
+}
 
-  return start_configs.size() > 0 && goal_configs.size() > 0;
+bool DSSPlanner::saveRoadmap(const APPlanningRequest& req,
+                             const std::string& filename) {
+  auto entry = roadmap_cache_.find(roadmapKey(req));
+  if (entry == roadmap_cache_.end()) {
+    return false;
+  }
+
+  const auto& ss = entry->second.ss;
+  ob::PlannerData data(ss->getSpaceInformation());
+  ss->getPlanner()->getPlannerData(data);
+  ob::PlannerDataStorage storage;
+  storage.store(data, filename.c_str());
+  return true;
+}
+
+void DSSPlanner::loadRoadmap(const APPlanningRequest& req,
+                             const std::string& filename) {
+  // Drop any cached roadmap so the loaded one is used
+  const std::string key = roadmapKey(req);
+  auto entry = roadmap_cache_.find(key);
+  if (entry != roadmap_cache_.end()) {
+    roadmap_usage_order_.erase(entry->second.usage);
+    roadmap_cache_.erase(entry);
+  }
+  roadmap_files_[key] = filename;
+}
+
+void DSSPlanner::clearRoadmapCache() {
+  roadmap_cache_.clear();
+  roadmap_usage_order_.clear();
+  roadmap_files_.clear();
+}
+
+bool DSSPlanner::findStartGoalStates(
+    const APPlanningRequest& req, const size_t num_start, const size_t num_goal,
+    std::vector<std::vector<double>>& start_configs,
+    std::vector<std::vector<double>>& goal_configs) {
+  if (num_start < 1) {
+    return false;
+  }
+
+  // Solve the start and goal poses in parallel
+  std::vector<std::vector<std::vector<double>>> state_lists;
+  const planning_scene::PlanningSceneConstPtr& scene = planning_scene_;
+  increaseStateLists(joint_model_group_.get(), *kinematic_state_, *scene,
+                     ik_solvers_,
+                     {tf2::toMsg(start_pose_), tf2::toMsg(goal_pose_)},
+                     {num_start, num_goal}, 2 * (num_goal + num_start),
+                     state_lists, counters_.get(), reachability_map_.get(),
+                     context_->ik_cache.get(), context_->scene_fingerprint);
+  start_configs = std::move(state_lists.at(0));
+  goal_configs = std::move(state_lists.at(1));
+
+  return start_configs.size() > 0 && (num_goal < 1 || goal_configs.size() > 0);
 }
 
 bool DSSPlanner::findGoalStates(
@@ -290,7 +762,6 @@ bool DSSPlanner::findGoalStates(
     std::vector<std::vector<double>>& goal_configs) {
   start_configs.clear();
   goal_configs.clear();
-  goal_configs.reserve(num_goal);
 
   if (req.start_joint_state.size() != joint_model_group_->getVariableCount()) {
     return false;
@@ -299,21 +770,85 @@ bool DSSPlanner::findGoalStates(
   kinematic_state_->setJointGroupPositions(joint_model_group_.get(),
                                            req.start_joint_state);
 
-  geometry_msgs::Pose goal_pose_msg = tf2::toMsg(goal_pose_);
+  // Solve the goal pose in parallel, starting from the requested state
+  std::vector<std::vector<std::vector<double>>> state_lists;
+  const planning_scene::PlanningSceneConstPtr& scene = planning_scene_;
+  increaseStateLists(joint_model_group_.get(), *kinematic_state_, *scene,
+                     ik_solvers_, {tf2::toMsg(goal_pose_)}, {num_goal},
+                     2 * num_goal, state_lists, counters_.get(),
+                     reachability_map_.get(), context_->ik_cache.get(),
+                     context_->scene_fingerprint);
+  goal_configs = std::move(state_lists.front());
+
+  return num_goal < 1 || goal_configs.size() > 0;
+}
 
-  // Go through and make configurations
-  size_t i = 0;
-  while (goal_configs.size() < num_goal && i < 2 * num_goal) {
-    // Try to add a goal configuration
-    increaseStateList(joint_model_group_, kinematic_state_, *planning_scene_,
-                      ik_solver_, goal_pose_msg, goal_configs);
+bool DSSPlanner::useWarmStart(const APPlanningRequest& req,
+                              const trajectory_msgs::JointTrajectory& hint) {
+  // The hint must be a trajectory of this group
+  const size_t num_joints = joint_model_group_->getVariableCount();
+  if (hint.points.size() < 2 ||
+      (!hint.joint_names.empty() &&
+       hint.joint_names != joint_model_group_->getVariableNames())) {
+    return false;
+  }
+  for (const auto& point : hint.points) {
+    if (point.positions.size() != num_joints) {
+      return false;
+    }
+  }
 
-    // Every time, we set to random states to get variety in solutions
-    kinematic_state_->setToRandomPositions(joint_model_group_.get());
-    i++;
+  // Make a state for each point. The ends are at the ends of the screw path,
+  // and the rest are solved for, seeded by how far along the hint they are
+  const ob::SpaceInformationPtr si = ss_->getSpaceInformation();
+  const std::vector<double> start_phi = constraints_->startPhi();
+  const std::vector<double> goal_phi = constraints_->goalPhi();
+  const moveit::core::RobotStatePtr robot_state =
+      context_->state_pool->acquire();
+  affordance_primitives::ScrewConstraintSolution sol;
+  std::vector<double> phi(start_phi.size());
+  og::PathGeometric path(si);
+  for (size_t i = 0; i < hint.points.size(); ++i) {
+    const double fraction = double(i) / (hint.points.size() - 1);
+    for (size_t j = 0; j < phi.size(); ++j) {
+      phi[j] = start_phi[j] + fraction * (goal_phi[j] - start_phi[j]);
+    }
+    if (i > 0 && i + 1 < hint.points.size()) {
+      robot_state->setJointGroupPositions(joint_model_group_.get(),
+                                          hint.points[i].positions);
+      robot_state->update();
+      if (constraints_->constraintFn(
+              robot_state->getFrameTransform(req.ee_frame_name), phi, sol)) {
+        phi = sol.solved_phi;
+      }
+    }
+    path.append(
+        vectorToState(state_space_, phi, hint.points[i].positions).get());
   }
 
-  return goal_configs.size() > 0;
+  // A requested start replaces the hint's. Otherwise the hint's start is one
+  // more start state
+  ss_->setup();
+  const ob::ProblemDefinitionPtr& pdef = ss_->getProblemDefinition();
+  if (passed_start_config_) {
+    si->copyState(path.getState(0), pdef->getStartState(0));
+  } else if (si->isValid(path.getState(0))) {
+    pdef->addStartState(path.getState(0));
+  }
+
+  // The hint's end is one more goal state
+  ob::State* hint_goal = path.getState(path.getStateCount() - 1);
+  if (!si->isValid(hint_goal)) {
+    return false;
+  }
+  screw_goal_->addState(hint_goal);
+
+  // Use the whole path if it is still valid, in this scene and any new start
+  if (!path.check()) {
+    return false;
+  }
+  pdef->addSolutionPath(std::make_shared<og::PathGeometric>(path));
+  return true;
 }
 
 void DSSPlanner::populateResponse(ompl::geometric::PathGeometric& solution,
@@ -324,26 +859,75 @@ void DSSPlanner::populateResponse(ompl::geometric::PathGeometric& solution,
     return;
   }
 
-  // Interpolate the solution path
-  solution.interpolate();
+  // Densify the solution path. Edges are followed along the screw, so the
+  // waypoints must come from the motion validator instead of interpolation
+  ros::WallTime phase_start = ros::WallTime::now();
+  const auto motion_validator = std::dynamic_pointer_cast<ScrewMotionValidator>(
+      ss_->getSpaceInformation()->getMotionValidator());
+  if (motion_validator) {
+    og::PathGeometric dense_path(ss_->getSpaceInformation());
+    dense_path.append(solution.getState(0));
+    std::vector<ob::State*> motion;
+    for (size_t i = 1; i < solution.getStateCount(); ++i) {
+      motion.clear();
+      const bool edge_valid = motion_validator->computeMotion(
+          solution.getState(i - 1), solution.getState(i), motion);
+      for (ob::State* state : motion) {
+        dense_path.append(state);
+        ss_->getSpaceInformation()->freeState(state);
+      }
+
+      // Stop at a failed edge, so the goal check below catches it
+      if (!edge_valid) {
+        break;
+      }
+    }
+    solution = dense_path;
+  } else {
+    solution.interpolate();
+  }
+  res.statistics.interpolate_time =
+      (ros::WallTime::now() - phase_start).toSec();
+  phase_start = ros::WallTime::now();
 
   // We will populate the trajectory
   res.joint_trajectory.joint_names = joint_model_group_->getVariableNames();
   const size_t num_joints = res.joint_trajectory.joint_names.size();
   res.joint_trajectory.points.reserve(solution.getStateCount());
+  const DSSStateLayout layout(state_space_.get());
+  std::vector<double> screw_steps;
+  screw_steps.reserve(solution.getStateCount() - 1);
+
+  // Check every point at once, on as many threads as seed IK. Points after
+  // the first invalid one are not needed. The threads are kept between plans
+  const std::vector<ob::State*>& states = solution.getStates();
+  std::vector<char> valid;
+  const auto validity_checker =
+      std::dynamic_pointer_cast<ScrewValidityChecker>(
+          ss_->getSpaceInformation()->getStateValidityChecker());
+  if (validity_checker) {
+    validity_checker->areValid(states, valid, true,
+                               validate_pool_->numThreads(),
+                               validate_pool_.get());
+  } else {
+    for (const auto& state : states) {
+      valid.push_back(ss_->getSpaceInformation()->isValid(state));
+      if (!valid.back()) {
+        break;
+      }
+    }
+    valid.resize(states.size(), false);
+  }
 
-  // Go through each point and check it for validity
-  for (const auto& state : solution.getStates()) {
+  // Go through each point, stopping at the first invalid one
+  const double* last_screw_state = nullptr;
+  for (size_t k = 0; k < states.size(); ++k) {
     // Extract the state info
-    const ob::CompoundStateSpace::StateType& compound_state =
-        *state->as<ob::CompoundStateSpace::StateType>();
-    const ob::RealVectorStateSpace::StateType& screw_state =
-        *compound_state[0]->as<ob::RealVectorStateSpace::StateType>();
-    const ob::RealVectorStateSpace::StateType& robot_state =
-        *compound_state[1]->as<ob::RealVectorStateSpace::StateType>();
+    const double* screw_state = layout.screwValues(states[k]);
+    const double* robot_state = layout.jointValues(states[k]);
 
     // First check for validity
-    if (!ss_->getSpaceInformation()->isValid(state)) {
+    if (!valid[k]) {
       // If a state is invalid, we don't want to continue the trajectory
       res.trajectory_is_valid = false;
 
@@ -353,6 +937,8 @@ void DSSPlanner::populateResponse(ompl::geometric::PathGeometric& solution,
         phi[i] = screw_state[i];
       }
       res.percentage_complete = constraints_->percentComplete(phi);
+      res.statistics.validate_time =
+          (ros::WallTime::now() - phase_start).toSec();
       return;
     }
 
@@ -363,15 +949,22 @@ void DSSPlanner::populateResponse(ompl::geometric::PathGeometric& solution,
       output.positions.push_back(robot_state[i]);
     }
 
-    // TODO: figure out what to do about vel / time
     res.joint_trajectory.points.push_back(output);
+
+    // Keep the screw progress from the last point, for the timing
+    if (last_screw_state) {
+      double step = 0;
+      for (size_t i = 0; i < constraints_->size(); ++i) {
+        const double diff = screw_state[i] - last_screw_state[i];
+        step += diff * diff;
+      }
+      screw_steps.push_back(sqrt(step));
+    }
+    last_screw_state = screw_state;
   }
 
   // Finally, we check the last point to make sure it is at the goal
-  const ob::CompoundStateSpace::StateType& compound_state =
-      *solution.getStates().back()->as<ob::CompoundStateSpace::StateType>();
-  const ob::RealVectorStateSpace::StateType& screw_state =
-      *compound_state[0]->as<ob::RealVectorStateSpace::StateType>();
+  const double* screw_state = layout.screwValues(solution.getStates().back());
 
   std::vector<double> phi(constraints_->size());
   for (size_t i = 0; i < constraints_->size(); ++i) {
@@ -381,5 +974,10 @@ void DSSPlanner::populateResponse(ompl::geometric::PathGeometric& solution,
   res.percentage_complete = constraints_->percentComplete(phi);
   res.trajectory_is_valid = res.percentage_complete > 0.99;
   res.path_length = solution.length();
+  if (req.time_parameterize) {
+    timeParameterize(*joint_model_group_, screw_steps, req.max_screw_velocity,
+                     req.max_screw_acceleration, res.joint_trajectory);
+  }
+  res.statistics.validate_time = (ros::WallTime::now() - phase_start).toSec();
 }
 }  // namespace ap_planning
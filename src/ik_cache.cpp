@@ -0,0 +1,157 @@
+#include <boost/functional/hash.hpp>
+#include <ap_planning/ik_cache.hpp>
+
+#include <cmath>
+#include <iterator>
+
+namespace ap_planning {
+IKCache::IKCache(const size_t max_poses, const size_t max_solutions_per_pose,
+                 const double position_resolution,
+                 const double orientation_resolution,
+                 const double seed_resolution)
+    : max_poses_(max_poses),
+      max_solutions_per_pose_(max_solutions_per_pose),
+      position_resolution_(position_resolution),
+      orientation_resolution_(orientation_resolution),
+      seed_resolution_(seed_resolution) {}
+
+bool IKCache::find(const std::string &group_name,
+                   const geometry_msgs::Pose &pose,
+                   const std::vector<double> &seed,
+                   const std::size_t scene_fingerprint,
+                   std::vector<double> &solution, bool &collision_free) const {
+  const PoseKey key = poseKey(group_name, pose);
+  const std::vector<int64_t> bucket = seedBucket(seed);
+
+  std::lock_guard<std::mutex> lock(mutex_);
+  const Entry *entry = use(key);
+  if (!entry) {
+    return false;
+  }
+  for (const auto &cached : entry->solutions) {
+    if (cached.seed_bucket == bucket) {
+      solution = cached.joints;
+      collision_free = cached.scene_fingerprint == scene_fingerprint;
+      return true;
+    }
+  }
+  return false;
+}
+
+void IKCache::findAll(const std::string &group_name,
+                      const geometry_msgs::Pose &pose,
+                      const std::size_t scene_fingerprint,
+                      std::vector<std::vector<double>> &solutions,
+                      std::vector<bool> &collision_free) const {
+  solutions.clear();
+  collision_free.clear();
+  const PoseKey key = poseKey(group_name, pose);
+
+  std::lock_guard<std::mutex> lock(mutex_);
+  const Entry *entry = use(key);
+  if (!entry) {
+    return;
+  }
+  for (const auto &cached : entry->solutions) {
+    solutions.push_back(cached.joints);
+    collision_free.push_back(cached.scene_fingerprint == scene_fingerprint);
+  }
+}
+
+void IKCache::insert(const std::string &group_name,
+                     const geometry_msgs::Pose &pose,
+                     const std::vector<double> &seed,
+                     const std::vector<double> &solution,
+                     const std::size_t scene_fingerprint) {
+  if (max_poses_ < 1 || max_solutions_per_pose_ < 1) {
+    return;
+  }
+  PoseKey key = poseKey(group_name, pose);
+  Solution new_solution{seedBucket(seed), solution, scene_fingerprint};
+
+  std::lock_guard<std::mutex> lock(mutex_);
+  auto entry = entries_.find(key);
+  if (entry == entries_.end()) {
+    // Make room by dropping the least recently used pose
+    while (entries_.size() >= max_poses_ && !usage_order_.empty()) {
+      entries_.erase(usage_order_.front());
+      usage_order_.pop_front();
+    }
+    usage_order_.push_back(key);
+    Entry new_entry{{std::move(new_solution)}, std::prev(usage_order_.end())};
+    entries_.emplace(std::move(key), std::move(new_entry));
+    return;
+  }
+  usage_order_.splice(usage_order_.end(), usage_order_, entry->second.usage);
+
+  // Replace the solution for this seed bucket, or the oldest if full
+  std::vector<Solution> &cached = entry->second.solutions;
+  for (auto &old_solution : cached) {
+    if (old_solution.seed_bucket == new_solution.seed_bucket) {
+      old_solution = std::move(new_solution);
+      return;
+    }
+  }
+  if (cached.size() >= max_solutions_per_pose_) {
+    cached.erase(cached.begin());
+  }
+  cached.push_back(std::move(new_solution));
+}
+
+void IKCache::clear() {
+  std::lock_guard<std::mutex> lock(mutex_);
+  entries_.clear();
+  usage_order_.clear();
+}
+
+size_t IKCache::size() const {
+  std::lock_guard<std::mutex> lock(mutex_);
+  return entries_.size();
+}
+
+const IKCache::Entry *IKCache::use(const PoseKey &key) const {
+  const auto entry = entries_.find(key);
+  if (entry == entries_.end()) {
+    return nullptr;
+  }
+  usage_order_.splice(usage_order_.end(), usage_order_, entry->second.usage);
+  return &entry->second;
+}
+
+std::size_t IKCache::PoseKeyHash::operator()(const PoseKey &key) const {
+  std::size_t seed = std::hash<std::string>()(key.group_name);
+  boost::hash_range(seed, key.pose.begin(), key.pose.end());
+  return seed;
+}
+
+IKCache::PoseKey IKCache::poseKey(const std::string &group_name,
+                                  const geometry_msgs::Pose &pose) const {
+  // q and -q are the same rotation, so keep w positive
+  const double norm = sqrt(pose.orientation.x * pose.orientation.x +
+                           pose.orientation.y * pose.orientation.y +
+                           pose.orientation.z * pose.orientation.z +
+                           pose.orientation.w * pose.orientation.w);
+  const double sign = pose.orientation.w < 0 ? -1.0 : 1.0;
+  const double scale = norm > 0 ? sign / norm : 0;
+
+  PoseKey key;
+  key.group_name = group_name;
+  key.pose = {llround(pose.position.x / position_resolution_),
+              llround(pose.position.y / position_resolution_),
+              llround(pose.position.z / position_resolution_),
+              llround(scale * pose.orientation.x / orientation_resolution_),
+              llround(scale * pose.orientation.y / orientation_resolution_),
+              llround(scale * pose.orientation.z / orientation_resolution_),
+              llround(scale * pose.orientation.w / orientation_resolution_)};
+  return key;
+}
+
+std::vector<int64_t> IKCache::seedBucket(
+    const std::vector<double> &seed) const {
+  std::vector<int64_t> bucket(seed.size());
+  for (size_t i = 0; i < seed.size(); ++i) {
+    bucket[i] = int64_t(floor(seed[i] / seed_resolution_));
+  }
+  return bucket;
+}
+}  // namespace ap_planning
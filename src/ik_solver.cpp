@@ -3,10 +3,29 @@
 
 #include <pluginlib/class_list_macros.h>
 
+#include <algorithm>
+#include <cmath>
+#include <mutex>
+#include <thread>
+
 namespace ap_planning {
+namespace {
+// How far a hinted joint state's EE may be from its waypoint to be used
+// without solving IK
+const double HINT_POSITION_TOLERANCE = 1e-4;     // meters
+const double HINT_ORIENTATION_TOLERANCE = 1e-3;  // radians
+}  // namespace
+
 bool IKSolver::initialize(const ros::NodeHandle& nh,
                           const std::string& move_group_name,
                           const std::string& robot_description_name) {
+  return initialize(nh, PlanningContext::get(robot_description_name),
+                    move_group_name);
+}
+
+bool IKSolver::initialize(const ros::NodeHandle& nh,
+                          const PlanningContextPtr& planning_context,
+                          const std::string& move_group_name) {
   nh_ = nh;
   const std::string n_name = ros::this_node::getName();
 
@@ -17,16 +36,29 @@ bool IKSolver::initialize(const ros::NodeHandle& nh,
                     JOINT_TOLERANCE);
   nh_.param<double>(n_name + "/condition_num_limit", condition_num_limit_,
                     CONDITION_NUM_LIMIT);
-
-  robot_model_loader::RobotModelLoader robot_model_loader(
-      robot_description_name);
-  kinematic_model_ = robot_model_loader.getModel();
-  if (!kinematic_model_) {
+  std::string condition_num_method;
+  nh_.param<std::string>(n_name + "/condition_num_method",
+                         condition_num_method, "eigen");
+  condition_num_svd_ = condition_num_method == "svd";
+  if (!condition_num_svd_ && condition_num_method != "eigen") {
+    ROS_WARN_STREAM("Unknown condition_num_method: "
+                    << condition_num_method << ". Using 'eigen' default");
+  }
+  nh_.param<int>(n_name + "/num_threads", num_threads_,
+                 std::max(1, int(std::thread::hardware_concurrency())));
+  nh_.param<bool>(n_name + "/differential_ik", differential_ik_, false);
+  nh_.param<bool>(n_name + "/split_path", split_path_, false);
+  nh_.param<int>(n_name + "/max_piece_waypoints", max_piece_waypoints_, 0);
+  nh_.param<int>(n_name + "/coarse_waypoint_stride", coarse_waypoint_stride_,
+                 0);
+
+  planning_context_ = planning_context;
+  if (!planning_context_ || !planning_context_->isValid()) {
     ROS_ERROR("Could not load RobotModel");
     return false;
   }
-  joint_model_group_ = std::make_shared<moveit::core::JointModelGroup>(
-      *kinematic_model_->getJointModelGroup(move_group_name));
+  kinematic_model_ = planning_context_->getRobotModel();
+  joint_model_group_ = planning_context_->getJointModelGroup(move_group_name);
   if (!joint_model_group_) {
     ROS_ERROR_STREAM("Could not find joint model group: " << move_group_name);
     return false;
@@ -42,11 +74,16 @@ bool IKSolver::initialize(const ros::NodeHandle& nh,
     return false;
   }
 
-  // Set up planning scene monitor
-  psm_ = std::make_shared<planning_scene_monitor::PlanningSceneMonitor>(
-      robot_description_name);
-  psm_->startSceneMonitor();
-  psm_->startStateMonitor();
+  // Each multi-start thread needs its own solver instance
+  ik_solvers_ =
+      planning_context_->acquireIKSolvers(move_group_name, num_threads_);
+  if (ik_solvers_.size() < size_t(num_threads_)) {
+    ROS_WARN_STREAM("Could only allocate " << ik_solvers_.size()
+                                           << " IK solver(s)");
+  }
+
+  // Share the planning scene monitor
+  psm_ = planning_context_->getPlanningSceneMonitor();
 
   return true;
 }
@@ -63,18 +100,20 @@ void IKSolver::setUp(APPlanningResponse& res) {
 bool IKSolver::checkPointsAreClose(
     const trajectory_msgs::JointTrajectoryPoint& point_a,
     const trajectory_msgs::JointTrajectoryPoint& point_b) {
-  if (point_a.positions.size() != point_b.positions.size()) {
-    return ap_planning::INVALID_TRANSITION;
-  }
+  return checkPointsAreClose(
+      Eigen::Map<const Eigen::VectorXd>(point_a.positions.data(),
+                                        point_a.positions.size()),
+      Eigen::Map<const Eigen::VectorXd>(point_b.positions.data(),
+                                        point_b.positions.size()));
+}
 
+bool IKSolver::checkPointsAreClose(
+    const Eigen::Ref<const Eigen::VectorXd>& positions_a,
+    const Eigen::Ref<const Eigen::VectorXd>& positions_b) {
   // Check joint diffs for large deltas (joint reconfigurations)
-  for (size_t i = 0; i < point_a.positions.size(); i++) {
-    if (fabs(point_a.positions.at(i) - point_b.positions.at(i)) >
-        joint_tolerance_) {
-      return false;
-    }
-  }
-  return true;
+  return positions_a.size() == positions_b.size() &&
+         ((positions_a - positions_b).cwiseAbs().array() <= joint_tolerance_)
+             .all();
 }
 
 ap_planning::Result IKSolver::verifyTransition(
@@ -82,26 +121,41 @@ ap_planning::Result IKSolver::verifyTransition(
     const trajectory_msgs::JointTrajectoryPoint& point_b,
     const std::shared_ptr<moveit::core::JointModelGroup>& jmg,
     const moveit::core::RobotState& state_b) {
+  if (point_a.positions.size() != point_b.positions.size()) {
+    return ap_planning::INVALID_TRANSITION;
+  }
+  return verifyTransition(
+      Eigen::Map<const Eigen::VectorXd>(point_a.positions.data(),
+                                        point_a.positions.size()),
+      Eigen::Map<const Eigen::VectorXd>(point_b.positions.data(),
+                                        point_b.positions.size()),
+      (point_b.time_from_start - point_a.time_from_start).toSec(), jmg,
+      state_b.getJacobian(jmg.get()));
+}
+
+ap_planning::Result IKSolver::verifyTransition(
+    const Eigen::Ref<const Eigen::VectorXd>& positions_a,
+    const Eigen::Ref<const Eigen::VectorXd>& positions_b,
+    const double wp_duration,
+    const std::shared_ptr<moveit::core::JointModelGroup>& jmg,
+    const Eigen::MatrixXd& jacobian_b) {
   // Do broad face check to avoid joint reconfigurations
-  if (!checkPointsAreClose(point_a, point_b)) {
+  if (!checkPointsAreClose(positions_a, positions_b)) {
     return ap_planning::INVALID_TRANSITION;
   }
 
   // Check joint velocities
-  const double wp_duration =
-      (point_b.time_from_start - point_a.time_from_start).toSec();
   if (wp_duration <= 0) {
     ROS_WARN_STREAM_THROTTLE(5, "Time between waypoints must be positive");
     return ap_planning::INVALID_TRANSITION;
   }
 
   // Go through each joint
-  size_t i = 0;
+  Eigen::Index i = 0;
   for (const moveit::core::JointModel* joint : jmg->getActiveJointModels()) {
     const auto& bounds = joint->getVariableBounds(joint->getName());
     if (bounds.velocity_bounded_) {
-      const double vel =
-          (point_b.positions.at(i) - point_a.positions.at(i)) / wp_duration;
+      const double vel = (positions_b[i] - positions_a[i]) / wp_duration;
       if (vel > bounds.max_velocity_ || vel < bounds.min_velocity_) {
         ROS_WARN_STREAM_THROTTLE(5, "Velocity limit exceeded");
         return ap_planning::INVALID_TRANSITION;
@@ -111,10 +165,14 @@ ap_planning::Result IKSolver::verifyTransition(
   }
 
   // Check for a singular position
-  Eigen::JacobiSVD<Eigen::MatrixXd> svd(state_b.getJacobian(jmg.get()));
-  const double cond_number =
-      svd.singularValues()[0] /
-      svd.singularValues()[svd.singularValues().size() - 1];
+  double cond_number;
+  if (condition_num_svd_) {
+    Eigen::JacobiSVD<Eigen::MatrixXd> svd(jacobian_b);
+    cond_number = svd.singularValues()[0] /
+                  svd.singularValues()[svd.singularValues().size() - 1];
+  } else {
+    cond_number = conditionNumber(jacobian_b);
+  }
   if (cond_number > condition_num_limit_) {
     ROS_WARN_STREAM_THROTTLE(5, "Singularity: " << cond_number);
     return ap_planning::INVALID_TRANSITION;
@@ -128,30 +186,30 @@ bool IKSolver::solveIK(
     const geometry_msgs::Pose& target_pose, const std::string& ee_frame,
     moveit::core::RobotState& robot_state,
     trajectory_msgs::JointTrajectoryPoint& point) {
+  std::vector<double> ik_solution;
+  if (!solveIK(ik_solver_, jmg, target_pose, robot_state, ik_solution)) {
+    return false;
+  }
+
+  // Copy to the point
+  point.positions = std::move(ik_solution);
+  return true;
+}
+
+bool IKSolver::solveIK(
+    const kinematics::KinematicsBasePtr& ik_solver,
+    const std::shared_ptr<moveit::core::JointModelGroup>& jmg,
+    const geometry_msgs::Pose& target_pose,
+    moveit::core::RobotState& robot_state, std::vector<double>& ik_solution) {
   // Set up the validation callback to make sure we don't collide with the
   // environment
-  kinematics::KinematicsBase::IKCallbackFn ik_callback_fn =
-      [this, &jmg, &robot_state](const geometry_msgs::Pose& pose,
-                                 const std::vector<double>& joints,
-                                 moveit_msgs::MoveItErrorCodes& error_code) {
-        robot_state.setJointGroupPositions(jmg.get(), joints);
-        robot_state.update(true);
-        collision_detection::CollisionResult::ContactMap contacts;
-        (*planning_scene_)->getCollidingPairs(contacts, robot_state);
-
-        if (contacts.size() == 0) {
-          error_code.val = moveit_msgs::MoveItErrorCodes::SUCCESS;
-        } else {
-          error_code.val = moveit_msgs::MoveItErrorCodes::NO_IK_SOLUTION;
-        }
-      };
+  const planning_scene::PlanningSceneConstPtr& scene = planning_scene_;
+  IKCollisionChecker checker(jmg.get(), &robot_state, scene.get(),
+                             counters_.get());
+  checker.setCache(ik_cache_.get(), scene_fingerprint_, joint_tolerance_);
 
   // Solve the IK
-  std::vector<double> ik_solution, seed_state;
-  robot_state.copyJointGroupPositions(jmg.get(), seed_state);
-  moveit_msgs::MoveItErrorCodes err;
-  if (!ik_solver_->searchPositionIK(target_pose, seed_state, 0.05, ik_solution,
-                                    ik_callback_fn, err)) {
+  if (!checker.solve(*ik_solver, target_pose, ik_solution)) {
     ROS_WARN_STREAM_THROTTLE(5, "Could not solve IK");
     return false;
   }
@@ -159,89 +217,525 @@ bool IKSolver::solveIK(
   // Update the robot state
   robot_state.setJointGroupPositions(jmg.get(), ik_solution);
   robot_state.update();
+  return true;
+}
 
-  // Copy to the point
-  robot_state.copyJointGroupPositions(jmg.get(), point.positions);
+bool IKSolver::stepIK(const std::shared_ptr<moveit::core::JointModelGroup>& jmg,
+                      const Eigen::Isometry3d& target,
+                      const std::string& ee_frame,
+                      moveit::core::RobotState& robot_state,
+                      Eigen::MatrixXd& jacobian) {
+  if (!stepToPose(jmg.get(), ee_frame, target, robot_state, jacobian)) {
+    jacobian.resize(0, 0);
+    return false;
+  }
 
+  // Check the result like an IK solution
+  robot_state.update();
+  if (!isCollisionFree(robot_state)) {
+    jacobian.resize(0, 0);
+    return false;
+  }
   return true;
 }
 
+bool IKSolver::isCollisionFree(const moveit::core::RobotState& robot_state) {
+  PlanningCounters::increment(counters_.get(),
+                              &PlanningCounters::ik_collision_checks);
+  collision_detection::CollisionRequest collision_request;
+  collision_detection::CollisionResult collision_result;
+  collision_request.max_contacts = 1;
+  return !isStateColliding(*planning_scene_, robot_state, collision_request,
+                           collision_result);
+}
+
 ap_planning::Result IKSolver::plan(
     const affordance_primitive_msgs::AffordanceTrajectory& affordance_traj,
     const std::vector<double>& start_state, const std::string& ee_name,
     APPlanningResponse& res) {
+  setUp(res);
+
+  // Convert to the internal types once
+  SPSWaypoints waypoints;
+  waypoints.poses.reserve(affordance_traj.trajectory.size());
+  waypoints.times.reserve(affordance_traj.trajectory.size());
+  for (const auto& wp : affordance_traj.trajectory) {
+    Eigen::Isometry3d pose;
+    tf2::fromMsg(wp.pose, pose);
+    waypoints.poses.push_back(pose);
+    waypoints.times.push_back(wp.time_from_start.toSec());
+  }
+
+  moveit::core::RobotState robot_state =
+      *(psm_->getStateMonitor()->getCurrentState());
+  const std::atomic<bool> never_cancel(false);
+  SPSRollout rollout;
+  const ap_planning::Result result =
+      split_path_ ? planPieces(waypoints, start_state, ee_name, never_cancel,
+                               robot_state, rollout)
+                  : planRollout(waypoints, start_state, ee_name, ik_solver_,
+                                never_cancel, robot_state, rollout);
+  if (result != ap_planning::INVALID_GOAL) {
+    toResponse(waypoints, rollout, result == ap_planning::SUCCESS, res);
+  }
+  return result;
+}
+
+ap_planning::Result IKSolver::planRollout(
+    const SPSWaypoints& waypoints, const std::vector<double>& start_state,
+    const std::string& ee_name, const kinematics::KinematicsBasePtr& ik_solver,
+    const std::atomic<bool>& cancel, moveit::core::RobotState& robot_state,
+    SPSRollout& rollout) {
   // Only supported input is a starting joint state
-  if (start_state.size() != joint_model_group_->getVariableCount()) {
+  const size_t num_joints = joint_model_group_->getVariableCount();
+  if (start_state.size() != num_joints) {
     ROS_WARN_STREAM("Starting joint state was size: "
                     << start_state.size() << ", expected size: "
                     << joint_model_group_->getVariableCount());
     return ap_planning::INVALID_GOAL;
   }
 
-  setUp(res);
+  // This reuses the storage from the last rollout with this object
+  const size_t num_waypoints = waypoints.poses.size();
+  rollout.positions.resize(num_joints, num_waypoints);
+  rollout.num_points = 0;
+  rollout.percentage_complete = 0.0;
 
-  // Make a new robot state and copy the starting state
-  moveit::core::RobotState current_state =
-      *(psm_->getStateMonitor()->getCurrentState());
-  current_state.setJointGroupPositions(joint_model_group_.get(), start_state);
-  current_state.update(true);
+  // Copy the starting state
+  robot_state.setJointGroupPositions(joint_model_group_.get(), start_state);
+  robot_state.update(true);
 
   // We will check the first IK solution is close to the starting state
-  trajectory_msgs::JointTrajectoryPoint starting_point;
-  current_state.copyJointGroupPositions(joint_model_group_.get(),
-                                        starting_point.positions);
-
-  // Figure out how many waypoints there are
-  const size_t num_waypoints = affordance_traj.trajectory.size();
+  const Eigen::Map<const Eigen::VectorXd> starting_point(start_state.data(),
+                                                         num_joints);
   const double wp_percent = 1 / double(num_waypoints);
 
+  // Waypoints are close together, so in differential IK mode each one is
+  // stepped to from the last. The Jacobian is kept between waypoints so the
+  // step and the singularity check share it. Otherwise it is just a buffer
+  // for the singularity check
+  Eigen::MatrixXd jacobian;
+  const moveit::core::LinkModel* tip_link =
+      joint_model_group_->getLinkModels().back();
+  std::vector<double> ik_solution;
+
+  // In multi-resolution mode, every few waypoints are solved first, so an
+  // unreachable part of the path fails before the rest is solved. The
+  // solutions, interpolated between, seed the full resolution pass like a
+  // hint. A hint already gives better seeds, so it turns this off
+  const bool coarse = coarse_waypoint_stride_ > 1 && waypoints.hint.cols() == 0;
+  if (coarse) {
+    std::vector<size_t> coarse_waypoints;
+    for (size_t j = 0; j + 1 < num_waypoints;) {
+      j = std::min(j + coarse_waypoint_stride_, num_waypoints - 1);
+      coarse_waypoints.push_back(j);
+    }
+    const ap_planning::Result coarse_result =
+        solveCoarse(waypoints, coarse_waypoints, start_state, ik_solver,
+                    cancel, robot_state, rollout.seeds);
+    if (coarse_result != ap_planning::SUCCESS) {
+      return coarse_result;
+    }
+    robot_state.setJointGroupPositions(joint_model_group_.get(), start_state);
+    robot_state.update(true);
+  }
+  const Eigen::MatrixXd& seeds = coarse ? rollout.seeds : waypoints.hint;
+
   // Rip through trajectory and plan
   // Note: these waypoints are defined in the screw's (PLANNING) frame
-  for (auto& wp : affordance_traj.trajectory) {
-    trajectory_msgs::JointTrajectoryPoint point;
-    point.time_from_start = wp.time_from_start;
-    if (!solveIK(joint_model_group_, wp.pose, ee_name, current_state, point)) {
-      return ap_planning::NO_IK_SOLUTION;
+  for (size_t i = 0; i < num_waypoints; ++i) {
+    // Another rollout may have already succeeded
+    if (cancel) {
+      return ap_planning::PLANNING_FAIL;
     }
-    if (res.joint_trajectory.points.size() < 1) {
-      if (!checkPointsAreClose(starting_point, point)) {
+
+    // A hinted joint state that still reaches the waypoint, and is close to
+    // this rollout's last point, is used as is. Otherwise the hint is where
+    // the solvers start from
+    const bool has_hint = i < size_t(seeds.cols());
+    const bool hint_is_close =
+        has_hint &&
+        (i > 0 ? checkPointsAreClose(rollout.positions.col(i - 1), seeds.col(i))
+               : checkPointsAreClose(starting_point, seeds.col(i)));
+    bool hinted = false;
+    if (hint_is_close) {
+      robot_state.setJointGroupPositions(joint_model_group_.get(),
+                                         seeds.col(i).data());
+      robot_state.update();
+      hinted = posesAreClose(robot_state.getFrameTransform(ee_name),
+                             waypoints.poses[i], HINT_POSITION_TOLERANCE,
+                             HINT_ORIENTATION_TOLERANCE) &&
+               isCollisionFree(robot_state);
+      jacobian.resize(0, 0);
+      if (hinted) {
+        robot_state.getJacobian(joint_model_group_.get(), tip_link,
+                                Eigen::Vector3d::Zero(), jacobian);
+      }
+    }
+
+    const bool stepped =
+        !hinted && differential_ik_ &&
+        stepIK(joint_model_group_, waypoints.poses[i], ee_name, robot_state,
+               jacobian);
+    if (!hinted && !stepped) {
+      // Seed IK from the hint or the last point, not from a failed step
+      if (has_hint) {
+        robot_state.setJointGroupPositions(joint_model_group_.get(),
+                                           seeds.col(i).data());
+      } else if (differential_ik_) {
+        robot_state.setJointGroupPositions(
+            joint_model_group_.get(),
+            i > 0 ? rollout.positions.col(i - 1).data() : start_state.data());
+      }
+      if (!solveIK(ik_solver, joint_model_group_,
+                   tf2::toMsg(waypoints.poses[i]), robot_state, ik_solution)) {
+        return ap_planning::NO_IK_SOLUTION;
+      }
+      robot_state.getJacobian(joint_model_group_.get(), tip_link,
+                              Eigen::Vector3d::Zero(), jacobian);
+    }
+    robot_state.copyJointGroupPositions(joint_model_group_.get(),
+                                        rollout.positions.col(i).data());
+
+    if (i == 0) {
+      if (!checkPointsAreClose(starting_point, rollout.positions.col(0))) {
         ROS_ERROR_STREAM("Points are not close!\n"
-                         << starting_point << "\n\n"
-                         << point);
+                         << starting_point.transpose() << "\n\n"
+                         << rollout.positions.col(0).transpose());
         return ap_planning::INVALID_TRANSITION;
       }
     } else {
-      auto transition_result =
-          verifyTransition(res.joint_trajectory.points.back(), point,
-                           joint_model_group_, current_state);
+      auto transition_result = verifyTransition(
+          rollout.positions.col(i - 1), rollout.positions.col(i),
+          waypoints.times[i] - waypoints.times[i - 1], joint_model_group_,
+          jacobian);
       if (transition_result != ap_planning::SUCCESS) {
         return transition_result;
       }
     }
-    res.percentage_complete += wp_percent;
-    res.joint_trajectory.points.push_back(point);
+    rollout.percentage_complete += wp_percent;
+    rollout.num_points = i + 1;
   }
 
-  // Set up the output
-  res.joint_trajectory.header.frame_id = kinematic_model_->getModelFrame();
-  res.joint_trajectory.joint_names = joint_model_group_->getVariableNames();
-  res.trajectory_is_valid = true;
-  res.path_length = -1;  // Not implemented
+  return ap_planning::SUCCESS;
+}
 
+ap_planning::Result IKSolver::solveCoarse(
+    const SPSWaypoints& waypoints, const std::vector<size_t>& indices,
+    const std::vector<double>& start_state,
+    const kinematics::KinematicsBasePtr& ik_solver,
+    const std::atomic<bool>& cancel, moveit::core::RobotState& robot_state,
+    Eigen::MatrixXd& seeds) {
+  const size_t num_joints = joint_model_group_->getVariableCount();
+  const size_t num_waypoints = waypoints.poses.size();
+  seeds.resize(num_joints, num_waypoints);
+  seeds.col(0) =
+      Eigen::Map<const Eigen::VectorXd>(start_state.data(), num_joints);
+  std::vector<double> ik_solution;
+  size_t last = 0;
+  for (const size_t next : indices) {
+    if (cancel) {
+      return ap_planning::PLANNING_FAIL;
+    }
+    if (next <= last || next >= num_waypoints) {
+      continue;
+    }
+    robot_state.setJointGroupPositions(joint_model_group_.get(),
+                                       seeds.col(last).data());
+    if (!solveIK(ik_solver, joint_model_group_,
+                 tf2::toMsg(waypoints.poses[next]), robot_state,
+                 ik_solution)) {
+      return ap_planning::NO_IK_SOLUTION;
+    }
+    robot_state.copyJointGroupPositions(joint_model_group_.get(),
+                                        seeds.col(next).data());
+
+    // A bigger jump than the full resolution pass allows is a
+    // reconfiguration
+    const double max_step =
+        (seeds.col(next) - seeds.col(last)).cwiseAbs().maxCoeff();
+    if (max_step > (next - last) * joint_tolerance_) {
+      return ap_planning::INVALID_TRANSITION;
+    }
+    for (size_t j = last + 1; j < next; ++j) {
+      const double t = double(j - last) / (next - last);
+      seeds.col(j) = (1 - t) * seeds.col(last) + t * seeds.col(next);
+    }
+    last = next;
+  }
+
+  // Waypoints after the last one solved are seeded from it
+  for (size_t j = last + 1; j < num_waypoints; ++j) {
+    seeds.col(j) = seeds.col(last);
+  }
   return ap_planning::SUCCESS;
 }
 
+IKSolver::SPSWaypoints IKSolver::SPSWaypoints::slice(const size_t begin,
+                                                     const size_t end) const {
+  SPSWaypoints sliced;
+  sliced.poses.assign(poses.begin() + begin, poses.begin() + end);
+  sliced.times.assign(times.begin() + begin, times.begin() + end);
+  if (size_t(hint.cols()) >= end) {
+    sliced.hint = hint.middleCols(begin, end - begin);
+  }
+  return sliced;
+}
+
+ap_planning::Result IKSolver::planPieces(
+    const SPSWaypoints& waypoints, const std::vector<double>& start_state,
+    const std::string& ee_name, const std::atomic<bool>& cancel,
+    moveit::core::RobotState& robot_state, SPSRollout& rollout) {
+  const size_t num_joints = joint_model_group_->getVariableCount();
+  const size_t num_waypoints = waypoints.poses.size();
+  if (start_state.size() != num_joints) {
+    return planRollout(waypoints, start_state, ee_name, ik_solver_, cancel,
+                       robot_state, rollout);
+  }
+
+  // Find the first waypoint of each piece, then the end of the last
+  std::vector<size_t> piece_starts{0};
+  std::vector<size_t> boundaries = waypoints.segment_starts;
+  boundaries.push_back(num_waypoints);
+  for (const size_t boundary : boundaries) {
+    if (boundary <= piece_starts.back() || boundary > num_waypoints) {
+      continue;
+    }
+    while (max_piece_waypoints_ > 0 &&
+           boundary - piece_starts.back() > size_t(max_piece_waypoints_)) {
+      piece_starts.push_back(piece_starts.back() + max_piece_waypoints_);
+    }
+    if (boundary < num_waypoints) {
+      piece_starts.push_back(boundary);
+    }
+  }
+  const size_t num_pieces = piece_starts.size();
+  piece_starts.push_back(num_waypoints);
+  if (num_pieces < 2 || ik_solvers_.empty()) {
+    return planRollout(waypoints, start_state, ee_name, ik_solver_, cancel,
+                       robot_state, rollout);
+  }
+
+  // Without a hint, the first waypoint of each piece would be solved from the
+  // start state, far from where the arm will be there, and land on an
+  // arbitrary IK branch. So the piece starts, and every few waypoints in
+  // multi-resolution mode, are solved first in order, each seeded from the
+  // one before. The piece starts are then already solved, and the
+  // interpolated solutions seed the pieces like a hint
+  SPSWaypoints seeded_waypoints;
+  const bool chained = waypoints.hint.cols() == 0;
+  if (chained) {
+    std::vector<size_t> coarse_waypoints(piece_starts.begin() + 1,
+                                         piece_starts.begin() + num_pieces);
+    if (coarse_waypoint_stride_ > 1) {
+      for (size_t j = coarse_waypoint_stride_; j < num_waypoints;
+           j += coarse_waypoint_stride_) {
+        coarse_waypoints.push_back(j);
+      }
+    }
+    coarse_waypoints.push_back(num_waypoints - 1);
+    std::sort(coarse_waypoints.begin(), coarse_waypoints.end());
+
+    seeded_waypoints.poses = waypoints.poses;
+    seeded_waypoints.times = waypoints.times;
+    seeded_waypoints.segment_starts = waypoints.segment_starts;
+
+    // The piece starts can be far apart, so a broken chain does not mean the
+    // path fails. It is planned as one rollout instead
+    if (solveCoarse(waypoints, coarse_waypoints, start_state, ik_solver_,
+                    cancel, robot_state,
+                    seeded_waypoints.hint) != ap_planning::SUCCESS) {
+      return planRollout(waypoints, start_state, ee_name, ik_solver_, cancel,
+                         robot_state, rollout);
+    }
+  }
+  const SPSWaypoints& piece_waypoints = chained ? seeded_waypoints : waypoints;
+
+  // Plan the pieces in parallel. IK for the first waypoint of each piece is
+  // seeded from the hint, unless it was already solved above
+  std::vector<SPSRollout> pieces(num_pieces);
+  std::vector<ap_planning::Result> results(num_pieces,
+                                           ap_planning::PLANNING_FAIL);
+  std::atomic<size_t> next_piece(0);
+  const size_t num_threads = std::min(ik_solvers_.size(), num_pieces);
+  runInParallel(num_threads, [&](size_t thread_idx) {
+    const kinematics::KinematicsBasePtr& solver = ik_solvers_.at(thread_idx);
+    moveit::core::RobotState piece_state(robot_state);
+    std::vector<double> piece_start;
+    for (size_t k = next_piece++; k < num_pieces && !cancel;
+         k = next_piece++) {
+      piece_start = start_state;
+      if (k > 0) {
+        const auto seed = piece_waypoints.hint.col(piece_starts[k]);
+        piece_start.assign(seed.data(), seed.data() + num_joints);
+        piece_state.setJointGroupPositions(joint_model_group_.get(),
+                                           piece_start);
+        if (!chained &&
+            !solveIK(solver, joint_model_group_,
+                     tf2::toMsg(waypoints.poses[piece_starts[k]]),
+                     piece_state, piece_start)) {
+          results[k] = ap_planning::NO_IK_SOLUTION;
+          continue;
+        }
+      }
+      results[k] = planRollout(
+          piece_waypoints.slice(piece_starts[k], piece_starts[k + 1]),
+          piece_start, ee_name, solver, cancel, piece_state, pieces[k]);
+    }
+  });
+
+  // Join the pieces in order
+  rollout.positions.resize(num_joints, num_waypoints);
+  rollout.num_points = 0;
+  const moveit::core::LinkModel* tip_link =
+      joint_model_group_->getLinkModels().back();
+  Eigen::MatrixXd jacobian;
+  std::vector<double> last_point;
+  SPSRollout retry;
+  for (size_t k = 0; k < num_pieces; ++k) {
+    const size_t begin = piece_starts[k];
+    const size_t end = piece_starts[k + 1];
+    const SPSRollout& piece = pieces[k];
+    ap_planning::Result result = results[k];
+    if (k > 0) {
+      PlanningCounters::increment(counters_.get(),
+                                  &PlanningCounters::piece_joins);
+    }
+    if (k > 0 && result == ap_planning::SUCCESS) {
+      robot_state.setJointGroupPositions(joint_model_group_.get(),
+                                         piece.positions.col(0).data());
+      robot_state.update();
+      robot_state.getJacobian(joint_model_group_.get(), tip_link,
+                              Eigen::Vector3d::Zero(), jacobian);
+      result = verifyTransition(
+          rollout.positions.col(begin - 1), piece.positions.col(0),
+          waypoints.times[begin] - waypoints.times[begin - 1],
+          joint_model_group_, jacobian);
+    }
+
+    // The first piece has nothing to be re-planned from
+    if (k == 0 || result == ap_planning::SUCCESS) {
+      rollout.positions.middleCols(begin, piece.num_points) =
+          piece.positions.leftCols(piece.num_points);
+      rollout.num_points = begin + piece.num_points;
+      rollout.percentage_complete =
+          double(rollout.num_points) / num_waypoints;
+      if (result != ap_planning::SUCCESS) {
+        return result;
+      }
+      continue;
+    }
+
+    // Plan this piece again from the last joined waypoint, which the joined
+    // path already reaches, and drop that waypoint from the result
+    PlanningCounters::increment(counters_.get(),
+                                &PlanningCounters::failed_piece_joins);
+    const auto joined_end = rollout.positions.col(begin - 1);
+    last_point.assign(joined_end.data(), joined_end.data() + num_joints);
+    result = planRollout(piece_waypoints.slice(begin - 1, end), last_point,
+                         ee_name, ik_solver_, cancel, robot_state, retry);
+    const size_t num_new = retry.num_points > 0 ? retry.num_points - 1 : 0;
+    rollout.positions.middleCols(begin, num_new) =
+        retry.positions.middleCols(1, num_new);
+    rollout.num_points = begin + num_new;
+    rollout.percentage_complete = double(rollout.num_points) / num_waypoints;
+    if (result != ap_planning::SUCCESS) {
+      return result;
+    }
+  }
+  return ap_planning::SUCCESS;
+}
+
+void IKSolver::toResponse(const SPSWaypoints& waypoints,
+                          const SPSRollout& rollout, const bool success,
+                          APPlanningResponse& res) {
+  res.percentage_complete = rollout.percentage_complete;
+  res.joint_trajectory.points.resize(rollout.num_points);
+  for (size_t i = 0; i < rollout.num_points; ++i) {
+    trajectory_msgs::JointTrajectoryPoint& point =
+        res.joint_trajectory.points[i];
+    const auto column = rollout.positions.col(i);
+    point.positions.assign(column.data(), column.data() + column.size());
+    point.time_from_start = ros::Duration(waypoints.times[i]);
+  }
+
+  // Set up the output
+  if (success) {
+    res.joint_trajectory.header.frame_id = kinematic_model_->getModelFrame();
+    res.joint_trajectory.joint_names = joint_model_group_->getVariableNames();
+    res.trajectory_is_valid = true;
+  }
+
+  // The joint space length, so batches can compare SPS paths like DSS ones
+  res.path_length = 0;
+  for (size_t i = 1; i < rollout.num_points; ++i) {
+    res.path_length +=
+        (rollout.positions.col(i) - rollout.positions.col(i - 1)).norm();
+  }
+}
+
+ap_planning::Result IKSolver::plan(const APPlanningRequest& req,
+                                   APPlanningResponse& res) {
+  if (req.screw_path.size() < 1) {
+    ROS_WARN_STREAM("Screw path is empty");
+    return INVALID_GOAL;
+  }
+
+  // Get the planning scene
+  const ros::WallTime scene_start = ros::WallTime::now();
+  const SceneSnapshotPtr snapshot = planning_context_->takeSnapshot();
+  const double scene_time = (ros::WallTime::now() - scene_start).toSec();
+
+  const ap_planning::Result result = plan(req, snapshot, res);
+  res.statistics.scene_time = scene_time;
+  res.statistics.total_time += scene_time;
+  return result;
+}
+
 ap_planning::Result IKSolver::plan(const APPlanningRequest& req,
+                                   const SceneSnapshotPtr& snapshot,
+                                   APPlanningResponse& res) {
+  return plan(req, snapshot, nullptr, res);
+}
+
+ap_planning::Result IKSolver::plan(const APPlanningRequest& req,
+                                   const SceneSnapshotPtr& snapshot,
+                                   const APPlanningResponse& hint,
+                                   APPlanningResponse& res) {
+  // The hint is copied, since it may be the response being filled in
+  const trajectory_msgs::JointTrajectory hint_trajectory =
+      hint.joint_trajectory;
+  return plan(req, snapshot, &hint_trajectory, res);
+}
+
+ap_planning::Result IKSolver::plan(const APPlanningRequest& req,
+                                   const SceneSnapshotPtr& snapshot,
+                                   const trajectory_msgs::JointTrajectory* hint,
                                    APPlanningResponse& res) {
   if (req.screw_path.size() < 1) {
     ROS_WARN_STREAM("Screw path is empty");
     return INVALID_GOAL;
   }
 
-  planning_scene_.reset();
-  psm_->requestPlanningSceneState();
-  planning_scene_ =
-      std::make_shared<planning_scene_monitor::LockedPlanningSceneRO>(psm_);
+  // Rollouts overwrite the response, so the statistics are kept separately
+  APPlanningStatistics statistics;
+  const ros::WallTime plan_start = ros::WallTime::now();
+  ros::WallTime phase_start = plan_start;
+  counters_ = req.collect_statistics ? std::make_shared<PlanningCounters>()
+                                     : nullptr;
+  const auto finish_statistics = [&]() {
+    if (counters_) {
+      counters_->copyTo(statistics);
+      counters_.reset();
+    }
+    statistics.total_time = (ros::WallTime::now() - plan_start).toSec();
+    res.statistics = statistics;
+  };
+
+  planning_scene_ = snapshot->planning_scene;
+  scene_fingerprint_ = sceneFingerprint(
+      snapshot->scene_version, *snapshot->robot_state, *joint_model_group_);
+  ik_cache_ = req.use_ik_cache ? planning_context_->getIKCache() : nullptr;
 
   setUp(res);
 
@@ -254,12 +748,10 @@ ap_planning::Result IKSolver::plan(const APPlanningRequest& req,
 
   // Make a new robot state
   moveit::core::RobotStatePtr current_state =
-      std::make_shared<moveit::core::RobotState>(
-          *(psm_->getStateMonitor()->getCurrentState()));
-  std::vector<double> starting_joint_config = req.start_joint_state;
+      std::make_shared<moveit::core::RobotState>(*snapshot->robot_state);
   std::vector<std::vector<double>> starts;
 
-  geometry_msgs::Pose first_pose;
+  Eigen::Isometry3d first_pose;
   const bool passed_start_joint_state =
       req.start_joint_state.size() == joint_model_group_->getVariableCount();
   if (passed_start_joint_state) {
@@ -268,129 +760,212 @@ ap_planning::Result IKSolver::plan(const APPlanningRequest& req,
                                           req.start_joint_state);
     if (!current_state->knowsFrameTransform(req.ee_frame_name)) {
       ROS_WARN_STREAM("Unknown EE name");
+      finish_statistics();
       return INVALID_GOAL;
     }
     constraints.setReferenceFrame(
         current_state->getFrameTransform(req.ee_frame_name));
-    first_pose = tf2::toMsg(constraints.referenceFrame());
+    first_pose = constraints.referenceFrame();
   } else {
     // Calculate the starting pose
-    const auto tf_start_pose = constraints.getPose(constraints.startPhi());
-    first_pose = tf2::toMsg(tf_start_pose);
+    first_pose = constraints.getPose(constraints.startPhi());
+  }
 
+  // Create the waypoints
+  phase_start = ros::WallTime::now();
+  const ScrewPoseTable pose_table(constraints, req.screw_path, waypoint_dist_,
+                                  waypoint_ang_);
+  size_t num_waypoints = 1;
+  for (size_t i = 0; i < pose_table.numSegments(); ++i) {
+    num_waypoints += pose_table.numWaypoints(i) - 1;
+  }
+
+  SPSWaypoints waypoints;
+  waypoints.poses.reserve(num_waypoints);
+  waypoints.times.reserve(num_waypoints);
+  double time_now = 0;
+  waypoints.poses.push_back(first_pose);
+  waypoints.times.push_back(time_now);
+
+  // The screw progress between each pair of waypoints, for timing the result
+  std::vector<double> screw_steps;
+  screw_steps.reserve(num_waypoints - 1);
+
+  // Go through the screw segments. Each starts at the last one's end, so
+  // its first waypoint is skipped
+  // The waypoint times follow a nominal screw rate (per second), which the
+  // transition checks use. If time_parameterize is set, timeParameterize()
+  // replaces them with times from the joint and screw limits
+  const double theta_dot = 0.1;
+  for (size_t i = 0; i < pose_table.numSegments(); ++i) {
+    const double time_step = pose_table.getSpacing(i) / theta_dot;
+    if (i > 0) {
+      waypoints.segment_starts.push_back(waypoints.poses.size());
+    }
+    for (size_t j = 1; j < pose_table.numWaypoints(i); ++j) {
+      time_now += time_step;
+      waypoints.poses.push_back(pose_table.getWaypoint(i, j));
+      waypoints.times.push_back(time_now);
+      screw_steps.push_back(pose_table.getSpacing(i));
+    }
+  }
+
+  // Match the hint's points to the waypoints by how far along the path they
+  // are. Hints for another group or with too few points are not used
+  const size_t num_joints = joint_model_group_->getVariableCount();
+  const bool use_hint =
+      hint && hint->points.size() > 1 &&
+      (hint->joint_names.empty() ||
+       hint->joint_names == joint_model_group_->getVariableNames()) &&
+      std::all_of(hint->points.begin(), hint->points.end(),
+                  [num_joints](const trajectory_msgs::JointTrajectoryPoint& p) {
+                    return p.positions.size() == num_joints;
+                  });
+  if (use_hint) {
+    waypoints.hint.resize(num_joints, waypoints.poses.size());
+    const double scale = double(hint->points.size() - 1) /
+                         std::max<size_t>(waypoints.poses.size() - 1, 1);
+    for (size_t i = 0; i < waypoints.poses.size(); ++i) {
+      const auto& positions =
+          hint->points.at(std::lround(i * scale)).positions;
+      waypoints.hint.col(i) =
+          Eigen::Map<const Eigen::VectorXd>(positions.data(), num_joints);
+    }
+  }
+
+  statistics.interpolate_time = (ros::WallTime::now() - phase_start).toSec();
+
+  // Reject paths the arm can not reach before solving any IK
+  const ReachabilityMapConstPtr reachability =
+      req.check_reachability
+          ? planning_context_->getReachabilityMap(
+                joint_model_group_->getName(), req.ee_frame_name)
+          : nullptr;
+  current_state->update();
+  if (reachability &&
+      !reachability->isPathReachable(
+          pose_table, reachability->getBasePose(*current_state))) {
+    ROS_WARN_STREAM("Screw path is not reachable");
+    finish_statistics();
+    return ap_planning::NO_IK_SOLUTION;
+  }
+
+  if (!passed_start_joint_state) {
     // Calculate a bunch of starting joint configs
-    size_t i = 0;
-    constexpr size_t num_starts = 20;
-    while (starts.size() < num_starts && i < 2 * num_starts && ros::ok()) {
-      // Every time, we set to random states to get variety in solutions
-      current_state->setToRandomPositions(joint_model_group_.get());
-      current_state->update(true);
-
-      // Try to add a goal configuration
-      increaseStateList(joint_model_group_, current_state, *planning_scene_,
-                        ik_solver_, first_pose, starts);
-
-      i++;
+    phase_start = ros::WallTime::now();
+    current_state->setToRandomPositions(joint_model_group_.get());
+    const size_t num_starts = req.num_start_configs;
+    std::vector<std::vector<std::vector<double>>> state_lists;
+    const planning_scene::PlanningSceneConstPtr& scene = planning_scene_;
+    increaseStateLists(joint_model_group_.get(), *current_state, *scene,
+                       ik_solvers_, {tf2::toMsg(first_pose)}, {num_starts},
+                       2 * num_starts, state_lists, counters_.get(),
+                       reachability.get(), ik_cache_.get(), scene_fingerprint_);
+    starts = std::move(state_lists.front());
+
+    // The hint's start is tried first
+    if (use_hint) {
+      starts.push_back(hint->points.front().positions);
     }
+    statistics.seeding_time = (ros::WallTime::now() - phase_start).toSec();
     if (starts.size() == 0) {
       ROS_WARN_STREAM("No initial IK solution found");
+      finish_statistics();
       return ap_planning::NO_IK_SOLUTION;
     }
   }
 
-  // Create the trajectory
-  affordance_primitive_msgs::AffordanceTrajectory affordance_traj;
-  affordance_traj.header.frame_id =
-      req.screw_path.front().screw_msg.header.frame_id;
-  double time_now = 0;
-
-  affordance_primitive_msgs::AffordanceWaypoint first_wp;
-  first_wp.time_from_start = ros::Duration().fromSec(time_now);
-  first_wp.pose = first_pose;
-  affordance_traj.trajectory.push_back(first_wp);
-
-  // Go through the screw segments
-  const double theta_dot = 0.1;  // TODO do this better
-  double lambda = 0;
-  auto phi = constraints.lowerBounds();
-  for (size_t i = 0; i < constraints.size(); ++i) {
-    // Figure out lambda spacing on this axis
-    const double lambda_step = calculateSegmentSpacing(req.screw_path.at(i));
-    lambda += lambda_step;
-    time_now += lambda_step / theta_dot;
-
-    // Calculate when we should stop for this segment
-    phi.at(i) = constraints.upperBounds().at(i);
-    const double lambda_max = constraints.getLambda(phi);
-
-    // Go through and calculate all the poses for this point
-    while (lambda <= lambda_max && ros::ok()) {
-      const auto waypoint_now = constraints.getPose(lambda);
-      lambda += lambda_step;
-      time_now += lambda_step / theta_dot;
-
-      // Stuff into ROS type
-      affordance_primitive_msgs::AffordanceWaypoint this_wp;
-      this_wp.time_from_start = ros::Duration().fromSec(time_now);
-      this_wp.pose = tf2::toMsg(waypoint_now);
-      affordance_traj.trajectory.push_back(this_wp);
+  // If pass a joint state, just plan with that one
+  phase_start = ros::WallTime::now();
+  if (passed_start_joint_state) {
+    const std::atomic<bool> never_cancel(false);
+    SPSRollout rollout;
+    const ap_planning::Result result =
+        split_path_
+            ? planPieces(waypoints, req.start_joint_state, req.ee_frame_name,
+                         never_cancel, *current_state, rollout)
+            : planRollout(waypoints, req.start_joint_state, req.ee_frame_name,
+                          ik_solver_, never_cancel, *current_state, rollout);
+    toResponse(waypoints, rollout, result == ap_planning::SUCCESS, res);
+    statistics.solve_time = (ros::WallTime::now() - phase_start).toSec();
+    if (result == ap_planning::SUCCESS && req.time_parameterize) {
+      timeParameterize(*joint_model_group_, screw_steps,
+                       req.max_screw_velocity, req.max_screw_acceleration,
+                       res.joint_trajectory);
     }
+    finish_statistics();
+    return result;
   }
 
-  // If pass a joint state, just plan with that one
-  if (passed_start_joint_state) {
-    return plan(affordance_traj, starting_joint_config, req.ee_frame_name, res);
+  // Only the rollout from the hint's start follows the hint. The other starts
+  // are on other IK branches, so the hint would only pull them off theirs
+  SPSWaypoints unhinted_waypoints;
+  if (use_hint) {
+    unhinted_waypoints = waypoints;
+    unhinted_waypoints.hint.resize(0, 0);
   }
 
-  // Otherwise, plan from multiple
-  ap_planning::APPlanningResponse this_response;
-  while (ros::ok() && !starts.empty()) {
-    auto this_start = starts.back();
-    starts.pop_back();
+  // Otherwise, plan from multiple starts in parallel. Rollouts are swapped,
+  // not copied, so each thread reuses the storage of the rollouts it loses
+  ap_planning::Result result = ap_planning::PLANNING_FAIL;
+  SPSRollout best_rollout;
+  std::atomic<bool> found_solution(false);
+  std::atomic<size_t> next_start(0);
+  std::mutex res_mutex;
+  const size_t num_threads = std::min(ik_solvers_.size(), starts.size());
+  runInParallel(num_threads, [&](size_t thread_idx) {
+    const kinematics::KinematicsBasePtr& solver = ik_solvers_.at(thread_idx);
+    moveit::core::RobotState robot_state(*current_state);
+    SPSRollout this_rollout;
+    while (ros::ok() && !found_solution) {
+      // Like before, take the starts from the back of the list
+      const size_t start_idx = next_start++;
+      if (start_idx >= starts.size()) {
+        return;
+      }
+      const auto& this_start = starts.at(starts.size() - 1 - start_idx);
+      const bool from_hint = use_hint && start_idx == 0;
 
-    // Do the plan
-    auto result =
-        plan(affordance_traj, this_start, req.ee_frame_name, this_response);
+      // Do the plan
+      auto this_result = planRollout(
+          from_hint || !use_hint ? waypoints : unhinted_waypoints, this_start,
+          req.ee_frame_name, solver, found_solution, robot_state, this_rollout);
 
-    // If success, just get out ASAP
-    if (result == ap_planning::SUCCESS) {
-      res = this_response;
-      return result;
-    }
+      std::lock_guard<std::mutex> lock(res_mutex);
+      if (result == ap_planning::SUCCESS) {
+        return;
+      }
 
-    // If better than previous, update it
-    if (this_response.percentage_complete > res.percentage_complete) {
-      res = this_response;
+      // If success, cancel the others and get out ASAP
+      if (this_result == ap_planning::SUCCESS) {
+        found_solution = true;
+        result = this_result;
+        std::swap(best_rollout, this_rollout);
+        return;
+      }
+
+      // If better than previous, update it
+      if (this_rollout.percentage_complete >
+          best_rollout.percentage_complete) {
+        std::swap(best_rollout, this_rollout);
+      }
     }
+  });
+
+  // If we did not find a valid plan, the response is the best found
+  toResponse(waypoints, best_rollout, result == ap_planning::SUCCESS, res);
+  statistics.solve_time = (ros::WallTime::now() - phase_start).toSec();
+  if (result == ap_planning::SUCCESS && req.time_parameterize) {
+    timeParameterize(*joint_model_group_, screw_steps, req.max_screw_velocity,
+                     req.max_screw_acceleration, res.joint_trajectory);
   }
-
-  // If we are here, we did not find a valid plan, but res is the best found
-  return ap_planning::PLANNING_FAIL;
+  finish_statistics();
+  return result;
 }
 
 double IKSolver::calculateSegmentSpacing(const ScrewSegment& segment) {
-  const double theta = segment.end_theta - segment.start_theta;
-
-  // Pure translation case
-  if (segment.screw_msg.is_pure_translation) {
-    const double num_waypoints = ceil(theta / waypoint_dist_);
-    return theta / num_waypoints;
-  }
-
-  Eigen::Vector3d screw_dist, axis;
-  tf2::fromMsg(segment.screw_msg.origin, screw_dist);
-  tf2::fromMsg(segment.screw_msg.axis, axis);
-
-  // Project origin distance onto axis plane, to get distance to axis
-  screw_dist -= (screw_dist.dot(axis)) / (axis.squaredNorm()) * axis;
-
-  // Calculate the number of waypoints we need for angular and linear
-  const double wps_ang = ceil(theta / waypoint_ang_);
-  const double wps_lin = ceil(theta * screw_dist.norm() / waypoint_ang_);
-
-  // Use whichever needed more
-  const double num_waypoints = std::max(wps_ang, wps_lin);
-  return theta / num_waypoints;
+  return ap_planning::calculateSegmentSpacing(segment, waypoint_dist_,
+                                              waypoint_ang_);
 }
 }  // namespace ap_planning
 
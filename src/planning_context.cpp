@@ -0,0 +1,185 @@
+#include <moveit/collision_detection/occupancy_map.h>
+#include <ap_planning/ik_cache.hpp>
+#include <ap_planning/planning_context.hpp>
+#include <ap_planning/reachability_map.hpp>
+#include <ap_planning/state_utils.hpp>
+
+namespace ap_planning {
+PlanningContext::PlanningContext(const std::string& robot_description_name)
+    : robot_description_name_(robot_description_name),
+      scene_version_(std::make_shared<std::atomic<std::size_t>>(0)),
+      ik_cache_(std::make_shared<IKCache>()) {
+  // The monitor shares the loader's model instead of loading its own
+  robot_model_loader_ = std::make_shared<robot_model_loader::RobotModelLoader>(
+      robot_description_name_);
+  kinematic_model_ = robot_model_loader_->getModel();
+  if (!kinematic_model_) {
+    ROS_ERROR("Could not load RobotModel");
+    return;
+  }
+
+  psm_ = std::make_shared<planning_scene_monitor::PlanningSceneMonitor>(
+      robot_model_loader_);
+  psm_->startSceneMonitor();
+  psm_->startStateMonitor();
+
+  // Count the updates that can change collision checks. Joint states are
+  // left out, since plans fingerprint the joints they do not move
+  using SceneUpdateType =
+      planning_scene_monitor::PlanningSceneMonitor::SceneUpdateType;
+  const auto scene_version = scene_version_;
+  psm_->addUpdateCallback([scene_version](const SceneUpdateType type) {
+    if (type & (SceneUpdateType::UPDATE_GEOMETRY |
+                SceneUpdateType::UPDATE_TRANSFORMS)) {
+      ++*scene_version;
+    }
+  });
+}
+
+PlanningContextPtr PlanningContext::get(
+    const std::string& robot_description_name) {
+  // Contexts are only kept while some planner is using them
+  static std::mutex mutex;
+  static std::map<std::string, std::weak_ptr<PlanningContext>> contexts;
+
+  std::lock_guard<std::mutex> lock(mutex);
+  PlanningContextPtr context = contexts[robot_description_name].lock();
+  if (!context) {
+    context = std::make_shared<PlanningContext>(robot_description_name);
+    contexts[robot_description_name] = context;
+  }
+  return context;
+}
+
+SceneSnapshotPtr PlanningContext::takeSnapshot() const {
+  auto snapshot = std::make_shared<SceneSnapshot>();
+  snapshot->robot_state = std::make_shared<moveit::core::RobotState>(
+      *(psm_->getStateMonitor()->getCurrentState()));
+
+  // Only hold the lock long enough to copy the scene. The clone shares the
+  // unchanged geometry with the monitor's scene, so this is cheap
+  psm_->requestPlanningSceneState();
+  planning_scene::PlanningScenePtr scene;
+  {
+    planning_scene_monitor::LockedPlanningSceneRO locked(psm_);
+    scene = planning_scene::PlanningScene::clone(locked);
+  }
+
+  // The octomap monitor updates its tree in place, holding only the tree's
+  // lock, so the clone gets its own copy
+  const auto octomap =
+      scene->getWorld()->getObject(planning_scene::PlanningScene::OCTOMAP_NS);
+  if (octomap && octomap->shapes_.size() == 1 &&
+      octomap->shapes_[0]->type == shapes::OCTREE) {
+    using collision_detection::OccMapTree;
+    const auto& shared_tree =
+        static_cast<const shapes::OcTree*>(octomap->shapes_[0].get())->octree;
+    auto monitor_tree = std::const_pointer_cast<OccMapTree>(
+        std::dynamic_pointer_cast<const OccMapTree>(shared_tree));
+    if (monitor_tree) {
+      std::shared_ptr<const octomap::OcTree> tree;
+      {
+        OccMapTree::ReadLock lock = monitor_tree->reading();
+        tree = std::make_shared<octomap::OcTree>(*monitor_tree);
+      }
+      scene->processOctomapPtr(tree, octomap->shape_poses_[0]);
+    }
+  }
+  snapshot->planning_scene = scene;
+
+  // The version is read after the copy, so an update that lands during it is
+  // not tagged with the version before it
+  snapshot->scene_version = *scene_version_;
+  return snapshot;
+}
+
+moveit::core::JointModelGroupPtr PlanningContext::getJointModelGroup(
+    const std::string& group_name) const {
+  return shareJointModelGroup(kinematic_model_, group_name);
+}
+
+std::vector<kinematics::KinematicsBasePtr> PlanningContext::acquireIKSolvers(
+    const std::string& group_name, const size_t num_solvers) {
+  std::vector<kinematics::KinematicsBasePtr> solvers;
+  moveit::core::JointModelGroupPtr jmg = getJointModelGroup(group_name);
+  if (!jmg || num_solvers < 1) {
+    return solvers;
+  }
+
+  // Reuse solvers from the pool, then make new ones
+  std::vector<kinematics::KinematicsBasePtr> owned;
+  {
+    std::lock_guard<std::mutex> lock(ik_mutex_);
+    auto& free_solvers = free_ik_solvers_[group_name];
+    while (!free_solvers.empty() && owned.size() < num_solvers) {
+      owned.push_back(free_solvers.back());
+      free_solvers.pop_back();
+    }
+  }
+  const auto& allocator = jmg->getSolverAllocators().first;
+  while (allocator && owned.size() < num_solvers) {
+    kinematics::KinematicsBasePtr solver = allocator(jmg.get());
+    if (!solver) {
+      break;
+    }
+    owned.push_back(solver);
+  }
+
+  // If new solvers can not be made, fall back to the group's shared one
+  if (owned.empty()) {
+    kinematics::KinematicsBasePtr solver = jmg->getSolverInstance();
+    if (solver) {
+      solvers.push_back(solver);
+    }
+    return solvers;
+  }
+
+  // Hand out solvers that go back to the pool when released
+  const std::weak_ptr<PlanningContext> weak_context = shared_from_this();
+  for (const auto& solver : owned) {
+    solvers.emplace_back(
+        solver.get(), [weak_context, group_name,
+                       solver](kinematics::KinematicsBase* /*unused*/) {
+          if (auto context = weak_context.lock()) {
+            context->releaseIKSolver(group_name, solver);
+          }
+        });
+  }
+  return solvers;
+}
+
+void PlanningContext::releaseIKSolver(
+    const std::string& group_name,
+    const kinematics::KinematicsBasePtr& solver) {
+  std::lock_guard<std::mutex> lock(ik_mutex_);
+  free_ik_solvers_[group_name].push_back(solver);
+}
+
+bool PlanningContext::loadReachabilityMap(const std::string& filename) {
+  const ReachabilityMapConstPtr map = ReachabilityMap::load(filename);
+  if (!map || !kinematic_model_) {
+    return false;
+  }
+
+  // The map's seeds must fit the group
+  const std::string group_name = map->getGroupName();
+  const auto jmg = getJointModelGroup(group_name);
+  if (!jmg || jmg->getVariableCount() != map->getNumJoints()) {
+    ROS_WARN_STREAM("Reachability map " << filename
+                                        << " does not match group "
+                                        << group_name);
+    return false;
+  }
+
+  std::lock_guard<std::mutex> lock(reachability_mutex_);
+  reachability_maps_[{group_name, map->getEEFrameName()}] = map;
+  return true;
+}
+
+ReachabilityMapConstPtr PlanningContext::getReachabilityMap(
+    const std::string& group_name, const std::string& ee_frame_name) const {
+  std::lock_guard<std::mutex> lock(reachability_mutex_);
+  const auto map = reachability_maps_.find({group_name, ee_frame_name});
+  return map == reachability_maps_.end() ? nullptr : map->second;
+}
+}  // namespace ap_planning
@@ -0,0 +1,206 @@
+#include <ap_planning/planning_server.hpp>
+
+#include <algorithm>
+
+namespace ap_planning {
+
+PlanningServer::PlanningServer(const PlanningContextPtr& planning_context,
+                               const std::string& move_group_name,
+                               const size_t num_workers)
+    : planning_context_(planning_context) {
+  if (!planning_context_ || !planning_context_->isValid()) {
+    ROS_ERROR("Could not load RobotModel");
+    valid_ = false;
+    return;
+  }
+
+  // The pool is already parallel, so each DSS planner seeds IK on one thread.
+  // Plugins are loaded here, one worker at a time
+  const size_t pool_size =
+      num_workers > 0 ? num_workers
+                      : std::max(1u, std::thread::hardware_concurrency());
+  for (size_t i = 0; i < pool_size; ++i) {
+    std::unique_ptr<Worker> worker(new Worker);
+    worker->sps.reset(
+        new SequentialStepPlanner(planning_context_, move_group_name));
+    worker->dss.reset(new DSSPlanner(planning_context_, move_group_name, 1));
+    if (!worker->sps->initialize()) {
+      ROS_ERROR("Could not initialize SPS");
+      valid_ = false;
+    }
+    workers_.push_back(std::move(worker));
+  }
+
+  // Start the threads once every planner exists
+  for (auto& worker : workers_) {
+    Worker* this_worker = worker.get();
+    worker->thread = std::thread([this, this_worker]() { work(*this_worker); });
+  }
+}
+
+PlanningServer::~PlanningServer() {
+  std::vector<QueuedJobPtr> dropped;
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    stopping_ = true;
+    for (auto& id_job : jobs_) {
+      id_job.second->cancel = true;
+    }
+    for (const auto& queued_job : queue_) {
+      jobs_.erase(queued_job->id);
+    }
+    dropped.swap(queue_);
+  }
+  queue_cv_.notify_all();
+  for (auto& worker : workers_) {
+    if (worker->thread.joinable()) {
+      worker->thread.join();
+    }
+  }
+
+  // Every job gets its done callback, even the ones that never ran
+  APPlanningJobResult result;
+  result.cancelled = true;
+  for (const auto& queued_job : dropped) {
+    queued_job->done(result);
+  }
+}
+
+PlanningServer::JobId PlanningServer::submit(const APPlanningJob& job,
+                                             const DoneCallback& done,
+                                             const ProgressCallback& progress) {
+  const QueuedJobPtr queued_job = std::make_shared<QueuedJob>();
+  queued_job->job = job;
+  queued_job->done = done;
+  queued_job->progress = progress;
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    queued_job->id = next_id_++;
+    jobs_[queued_job->id] = queued_job;
+    queue_.push_back(queued_job);
+    std::push_heap(queue_.begin(), queue_.end(), runsAfter);
+  }
+  queue_cv_.notify_one();
+  return queued_job->id;
+}
+
+bool PlanningServer::cancel(const JobId id) {
+  QueuedJobPtr dropped;
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    const auto it = jobs_.find(id);
+    if (it == jobs_.end() || it->second->cancel) {
+      return false;
+    }
+    it->second->cancel = true;
+
+    // A queued job is taken out of the queue. A running one sees the flag
+    const auto queue_it = std::find(queue_.begin(), queue_.end(), it->second);
+    if (queue_it != queue_.end()) {
+      dropped = it->second;
+      queue_.erase(queue_it);
+      std::make_heap(queue_.begin(), queue_.end(), runsAfter);
+      jobs_.erase(it);
+    }
+  }
+
+  if (dropped) {
+    APPlanningJobResult result;
+    result.cancelled = true;
+    dropped->done(result);
+  }
+  return true;
+}
+
+size_t PlanningServer::numQueued() const {
+  std::lock_guard<std::mutex> lock(mutex_);
+  return queue_.size();
+}
+
+bool PlanningServer::runsAfter(const QueuedJobPtr& a, const QueuedJobPtr& b) {
+  if (a->job.priority != b->job.priority) {
+    return a->job.priority < b->job.priority;
+  }
+
+  // Jobs without a deadline go after the ones with one
+  const bool a_deadline = !a->job.deadline.isZero();
+  const bool b_deadline = !b->job.deadline.isZero();
+  if (a_deadline != b_deadline) {
+    return !a_deadline;
+  }
+  if (a_deadline && a->job.deadline != b->job.deadline) {
+    return a->job.deadline > b->job.deadline;
+  }
+  return a->id > b->id;
+}
+
+void PlanningServer::work(Worker& worker) {
+  while (true) {
+    QueuedJobPtr queued_job;
+    {
+      std::unique_lock<std::mutex> lock(mutex_);
+      queue_cv_.wait(lock, [this]() { return stopping_ || !queue_.empty(); });
+      if (stopping_) {
+        return;
+      }
+      std::pop_heap(queue_.begin(), queue_.end(), runsAfter);
+      queued_job = queue_.back();
+      queue_.pop_back();
+    }
+
+    runJob(worker, *queued_job);
+
+    std::lock_guard<std::mutex> lock(mutex_);
+    jobs_.erase(queued_job->id);
+  }
+}
+
+void PlanningServer::runJob(Worker& worker, QueuedJob& queued_job) {
+  const APPlanningJob& job = queued_job.job;
+  const bool has_deadline = !job.deadline.isZero();
+  APPlanningRequest req = job.request;
+  APPlanningJobResult result;
+  bool planned = false;
+  do {
+    if (queued_job.cancel) {
+      break;
+    }
+
+    // DSS stops in time for the deadline. SPS has no time limit
+    if (has_deadline) {
+      const double time_left = (job.deadline - ros::WallTime::now()).toSec();
+      if (time_left <= 0) {
+        result.expired = !planned;
+        break;
+      }
+      req.planning_time = std::min(job.request.planning_time, time_left);
+    }
+
+    APPlanningResponse res;
+    Result this_result;
+    if (job.use_sps) {
+      this_result = worker.sps->plan(req, res);
+    } else {
+      const SceneSnapshotPtr snapshot = planning_context_->takeSnapshot();
+      this_result =
+          worker.dss->plan(req, snapshot, &queued_job.cancel, nullptr, res);
+    }
+
+    // Keep the best response, and tell the caller when it improves
+    if (!planned || this_result == SUCCESS ||
+        res.percentage_complete > result.response.percentage_complete) {
+      result.result = this_result;
+      result.response = std::move(res);
+      if (queued_job.progress) {
+        queued_job.progress(result.response);
+      }
+    }
+    planned = true;
+  } while (job.retry_until_deadline && has_deadline &&
+           result.result != SUCCESS);
+
+  result.cancelled = queued_job.cancel;
+  queued_job.done(result);
+}
+
+}  // namespace ap_planning
@@ -0,0 +1,198 @@
+#include <actionlib/server/action_server.h>
+#include <ros/ros.h>
+#include <ap_planning/PlanScrewAction.h>
+#include <ap_planning/planning_server.hpp>
+
+#include <map>
+#include <memory>
+#include <mutex>
+#include <optional>
+
+namespace {
+using GoalHandle = actionlib::ServerGoalHandle<ap_planning::PlanScrewAction>;
+
+/** Converts an action goal to a job
+ *
+ * @param goal The goal
+ * @param default_planning_time Used if the goal does not set one
+ * @param job The job to fill out
+ * @return An empty string if the goal is valid, and why it is not otherwise
+ */
+std::string toJob(const ap_planning::PlanScrewGoal& goal,
+                  const double default_planning_time,
+                  ap_planning::APPlanningJob& job) {
+  if (goal.screws.empty() || goal.start_thetas.size() != goal.screws.size() ||
+      goal.end_thetas.size() != goal.screws.size()) {
+    return "Every screw needs a start and end theta";
+  }
+
+  const std::map<std::string, ap_planning::PlannerType> dss_types{
+      {"PRM", ap_planning::PRM},
+      {"PRMstar", ap_planning::PRMstar},
+      {"RRT", ap_planning::RRT},
+      {"RRTconnect", ap_planning::RRTconnect},
+      {"PORTFOLIO", ap_planning::PORTFOLIO}};
+  job.use_sps = goal.planner == "SPS";
+  if (!job.use_sps) {
+    const auto it = dss_types.find(goal.planner);
+    if (it == dss_types.end()) {
+      return "Unknown planner: " + goal.planner;
+    }
+    job.request.planner = it->second;
+  }
+
+  ap_planning::APPlanningRequest& req = job.request;
+  req.screw_path_type =
+      goal.unchained ? ap_planning::UNCHAINED : ap_planning::CHAINED;
+  for (size_t i = 0; i < goal.screws.size(); ++i) {
+    ap_planning::ScrewSegment segment;
+    segment.screw_msg = goal.screws[i];
+    segment.start_theta = goal.start_thetas[i];
+    segment.end_theta = goal.end_thetas[i];
+    req.screw_path.push_back(segment);
+  }
+  req.ee_frame_name = goal.ee_frame_name;
+  req.start_joint_state = goal.start_joint_state;
+  req.start_pose = goal.start_pose;
+  req.planning_time =
+      goal.planning_time > 0 ? goal.planning_time : default_planning_time;
+  if (goal.num_start_configs > 0) {
+    req.num_start_configs = goal.num_start_configs;
+  }
+  if (goal.num_goal_configs > 0) {
+    req.num_goal_configs = goal.num_goal_configs;
+  }
+
+  // The deadline is in ROS time, and the server uses wall time
+  job.priority = goal.priority;
+  if (!goal.deadline.isZero()) {
+    const double time_left = (goal.deadline - ros::Time::now()).toSec();
+    job.deadline = ros::WallTime::now() + ros::WallDuration(time_left);
+  }
+  job.retry_until_deadline = goal.retry_until_deadline;
+  return "";
+}
+}  // namespace
+
+int main(int argc, char** argv) {
+  ros::init(argc, argv, "ap_planning_server");
+  ros::NodeHandle nh("~");
+  ros::AsyncSpinner spinner(2);
+  spinner.start();
+
+  // Read the server parameters
+  std::string move_group_name, robot_description_name;
+  int num_workers;
+  double default_planning_time;
+  if (!nh.getParam("move_group_name", move_group_name)) {
+    ROS_ERROR("Parameter move_group_name is required");
+    return 1;
+  }
+  nh.param<std::string>("robot_description_name", robot_description_name,
+                        "robot_description");
+  nh.param<int>("num_workers", num_workers, 0);
+  nh.param<double>("planning_time", default_planning_time, 5.0);
+
+  const ap_planning::PlanningContextPtr context =
+      ap_planning::PlanningContext::get(robot_description_name);
+  if (!context->isValid()) {
+    return 1;
+  }
+  std::vector<std::string> reachability_maps;
+  nh.param<std::vector<std::string>>("reachability_maps", reachability_maps,
+                                     {});
+  for (const auto& map_file : reachability_maps) {
+    if (!context->loadReachabilityMap(map_file)) {
+      ROS_WARN_STREAM("Could not load reachability map " << map_file);
+    }
+  }
+
+  // The server is reset before the action server is destroyed, so the jobs
+  // it cancels can still finish their goals
+  std::unique_ptr<ap_planning::PlanningServer> server(
+      new ap_planning::PlanningServer(context, move_group_name,
+                                      std::max(num_workers, 0)));
+  if (!server->isValid()) {
+    return 1;
+  }
+
+  // The job of each goal, so cancel requests can find it
+  std::mutex jobs_mutex;
+  std::map<std::string, ap_planning::PlanningServer::JobId> jobs;
+
+  const auto goal_cb = [&](GoalHandle gh) {
+    ap_planning::APPlanningJob job;
+    const std::string error =
+        toJob(*gh.getGoal(), default_planning_time, job);
+    if (!error.empty()) {
+      ROS_WARN_STREAM("Rejected goal: " << error);
+      gh.setRejected(ap_planning::PlanScrewResult(), error);
+      return;
+    }
+    gh.setAccepted();
+
+    const std::string goal_id = gh.getGoalID().id;
+    const auto done = [&jobs_mutex, &jobs, gh,
+                       goal_id](const ap_planning::APPlanningJobResult& out) {
+      {
+        std::lock_guard<std::mutex> lock(jobs_mutex);
+        jobs.erase(goal_id);
+      }
+      ap_planning::PlanScrewResult result;
+      result.result = out.result;
+      result.result_name = ap_planning::toStr(out.result);
+      result.cancelled = out.cancelled;
+      result.expired = out.expired;
+      result.joint_trajectory = out.response.joint_trajectory;
+      result.percentage_complete = out.response.percentage_complete;
+      result.trajectory_is_valid = out.response.trajectory_is_valid;
+      result.path_length = out.response.path_length;
+      result.planning_time = out.response.statistics.total_time;
+
+      GoalHandle handle = gh;
+      if (out.cancelled) {
+        handle.setCanceled(result);
+      } else if (out.result == ap_planning::SUCCESS) {
+        handle.setSucceeded(result);
+      } else {
+        handle.setAborted(result, result.result_name);
+      }
+    };
+    const auto progress = [gh](const ap_planning::APPlanningResponse& res) {
+      ap_planning::PlanScrewFeedback feedback;
+      feedback.percentage_complete = res.percentage_complete;
+      feedback.trajectory_is_valid = res.trajectory_is_valid;
+      GoalHandle handle = gh;
+      handle.publishFeedback(feedback);
+    };
+
+    // The lock is held so a fast job can not finish before it is recorded
+    std::lock_guard<std::mutex> lock(jobs_mutex);
+    jobs[goal_id] = server->submit(job, done, progress);
+  };
+
+  const auto cancel_cb = [&](GoalHandle gh) {
+    // A queued job's done callback runs in cancel(), and takes the lock
+    std::optional<ap_planning::PlanningServer::JobId> id;
+    {
+      std::lock_guard<std::mutex> lock(jobs_mutex);
+      const auto it = jobs.find(gh.getGoalID().id);
+      if (it != jobs.end()) {
+        id = it->second;
+      }
+    }
+    if (id) {
+      server->cancel(*id);
+    }
+  };
+
+  actionlib::ActionServer<ap_planning::PlanScrewAction> action_server(
+      nh, "plan_screw", goal_cb, cancel_cb, false);
+  action_server.start();
+  ROS_INFO_STREAM("Planning for " << move_group_name << " on "
+                                  << server->numWorkers() << " worker(s)");
+
+  ros::waitForShutdown();
+  server.reset();
+  return 0;
+}
@@ -0,0 +1,73 @@
+#include <ompl/tools/multiplan/ParallelPlan.h>
+#include <ap_planning/portfolio_planner.hpp>
+
+#include <stdexcept>
+
+namespace ap_planning {
+PortfolioPlanner::PortfolioPlanner(const ob::SpaceInformationPtr &si,
+                                   const bool hybridize)
+    : ob::Planner(si, "Portfolio"), hybridize_(hybridize) {
+  specs_.approximateSolutions = true;
+  specs_.multithreaded = true;
+}
+
+void PortfolioPlanner::addPlanner(const ob::PlannerPtr &planner) {
+  if (!planner || planner->getSpaceInformation() != si_) {
+    throw std::invalid_argument(
+        "Portfolio planners must use the portfolio's space information");
+  }
+  if (pdef_) {
+    planner->setProblemDefinition(pdef_);
+  }
+  planners_.push_back(planner);
+}
+
+void PortfolioPlanner::setProblemDefinition(
+    const ob::ProblemDefinitionPtr &pdef) {
+  ob::Planner::setProblemDefinition(pdef);
+  for (const auto &planner : planners_) {
+    planner->setProblemDefinition(pdef);
+  }
+}
+
+ob::PlannerStatus PortfolioPlanner::solve(
+    const ob::PlannerTerminationCondition &ptc) {
+  checkValidity();
+  if (planners_.empty()) {
+    return ob::PlannerStatus::CRASH;
+  }
+
+  ompl::tools::ParallelPlan parallel_plan(pdef_);
+  for (const auto &planner : planners_) {
+    parallel_plan.addPlanner(planner);
+  }
+
+  // Stop at the first exact solution, unless every planner's path is wanted
+  // for hybridizing
+  const size_t max_solutions = hybridize_ ? planners_.size() : 1;
+  return parallel_plan.solve(ptc, 1, max_solutions, hybridize_);
+}
+
+void PortfolioPlanner::clear() {
+  ob::Planner::clear();
+  for (const auto &planner : planners_) {
+    planner->clear();
+  }
+}
+
+void PortfolioPlanner::setup() {
+  ob::Planner::setup();
+  for (const auto &planner : planners_) {
+    if (!planner->isSetup()) {
+      planner->setup();
+    }
+  }
+}
+
+void PortfolioPlanner::getPlannerData(ob::PlannerData &data) const {
+  ob::Planner::getPlannerData(data);
+  for (const auto &planner : planners_) {
+    planner->getPlannerData(data);
+  }
+}
+}  // namespace ap_planning
@@ -0,0 +1,322 @@
+#include <fcntl.h>
+#include <ros/console.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <ap_planning/reachability_map.hpp>
+
+#include <algorithm>
+#include <cmath>
+#include <cstring>
+#include <fstream>
+
+namespace ap_planning {
+namespace {
+const char MAP_MAGIC[8] = {'A', 'P', 'R', 'E', 'A', 'C', 'H', '2'};
+
+// The EE Z axis is binned by its polar and azimuth angles
+constexpr int NUM_POLAR_BINS = 8;
+constexpr int NUM_AZIMUTH_BINS = 8;
+
+void orientationBins(const Eigen::Isometry3d &pose, int &polar, int &azimuth) {
+  const Eigen::Vector3d z_axis = pose.linear().col(2);
+  const double polar_angle = acos(std::max(-1.0, std::min(1.0, z_axis.z())));
+  const double azimuth_angle = atan2(z_axis.y(), z_axis.x()) + M_PI;
+  polar = std::min(NUM_POLAR_BINS - 1,
+                   int(polar_angle / M_PI * NUM_POLAR_BINS));
+  azimuth = int(azimuth_angle / (2 * M_PI) * NUM_AZIMUTH_BINS) %
+            NUM_AZIMUTH_BINS;
+}
+
+uint64_t binBit(const int polar, const int azimuth) {
+  return uint64_t(1) << (polar * NUM_AZIMUTH_BINS + azimuth);
+}
+
+// Gets the bits of a bin and the bins around it. Every azimuth is close to
+// the poles
+uint64_t neighborBins(const int polar, const int azimuth) {
+  uint64_t bins = 0;
+  for (int p = std::max(0, polar - 1);
+       p <= std::min(NUM_POLAR_BINS - 1, polar + 1); ++p) {
+    const bool at_pole = p == 0 || p == NUM_POLAR_BINS - 1;
+    for (int a = 0; a < NUM_AZIMUTH_BINS; ++a) {
+      const int diff = std::abs(a - azimuth);
+      if (at_pole || std::min(diff, NUM_AZIMUTH_BINS - diff) <= 1) {
+        bins |= binBit(p, a);
+      }
+    }
+  }
+  return bins;
+}
+}  // namespace
+
+ReachabilityMap::~ReachabilityMap() {
+  if (mapping_) {
+    munmap(mapping_, mapping_size_);
+  }
+}
+
+ReachabilityMapPtr ReachabilityMap::build(
+    const moveit::core::RobotState &robot_state,
+    const moveit::core::JointModelGroup *jmg, const std::string &ee_frame_name,
+    const size_t num_samples, const double resolution,
+    const planning_scene::PlanningScene *scene) {
+  moveit::core::RobotState state(robot_state);
+  state.update();
+  if (!jmg || resolution <= 0 ||
+      ee_frame_name.size() >= sizeof(Header::ee_frame_name) ||
+      jmg->getName().size() >= sizeof(Header::group_name) ||
+      !state.knowsFrameTransform(ee_frame_name)) {
+    return nullptr;
+  }
+  const size_t num_joints = jmg->getVariableCount();
+
+  // Poses are kept relative to the link the group is mounted on. The group
+  // does not move it, so it is only looked up once
+  const moveit::core::LinkModel *base_link =
+      jmg->getCommonRoot()->getParentLinkModel();
+  const std::string base_frame_name =
+      base_link ? base_link->getName() : state.getRobotModel()->getModelFrame();
+  if (base_frame_name.size() >= sizeof(Header::base_frame_name)) {
+    return nullptr;
+  }
+  const Eigen::Isometry3d base_inverse =
+      state.getFrameTransform(base_frame_name).inverse();
+
+  // Sample first, since the grid is sized to fit the samples
+  std::vector<Eigen::Vector3d> positions;
+  std::vector<uint8_t> bins;
+  std::vector<float> joints;
+  std::vector<double> joint_values;
+  Eigen::AlignedBox3d box;
+  for (size_t i = 0; i < num_samples; ++i) {
+    state.setToRandomPositions(jmg);
+    state.update();
+    if (scene && scene->isStateColliding(state, jmg->getName())) {
+      continue;
+    }
+
+    const Eigen::Isometry3d pose =
+        base_inverse * state.getFrameTransform(ee_frame_name);
+    int polar, azimuth;
+    orientationBins(pose, polar, azimuth);
+    positions.push_back(pose.translation());
+    bins.push_back(uint8_t(polar * NUM_AZIMUTH_BINS + azimuth));
+    state.copyJointGroupPositions(jmg, joint_values);
+    joints.insert(joints.end(), joint_values.begin(), joint_values.end());
+    box.extend(pose.translation());
+  }
+  if (positions.empty()) {
+    return nullptr;
+  }
+
+  // Lay out the map. The grid has an empty voxel around the samples
+  ReachabilityMapPtr map(new ReachabilityMap());
+  Header header;
+  std::memset(&header, 0, sizeof(header));
+  std::memcpy(header.magic, MAP_MAGIC, sizeof(MAP_MAGIC));
+  header.num_joints = num_joints;
+  size_t num_voxels = 1;
+  for (size_t i = 0; i < 3; ++i) {
+    header.origin[i] = box.min()[i] - resolution;
+    header.size[i] =
+        uint32_t(ceil((box.max()[i] - box.min()[i]) / resolution)) + 2;
+    num_voxels *= header.size[i];
+  }
+  header.resolution = resolution;
+  std::strncpy(header.group_name, jmg->getName().c_str(),
+               sizeof(header.group_name) - 1);
+  std::strncpy(header.ee_frame_name, ee_frame_name.c_str(),
+               sizeof(header.ee_frame_name) - 1);
+  std::strncpy(header.base_frame_name, base_frame_name.c_str(),
+               sizeof(header.base_frame_name) - 1);
+
+  const size_t num_bytes =
+      sizeof(Header) + num_voxels * sizeof(uint64_t) +
+      num_voxels * num_joints * sizeof(float);
+  map->storage_.assign((num_bytes + sizeof(uint64_t) - 1) / sizeof(uint64_t),
+                       0);
+  std::memcpy(map->storage_.data(), &header, sizeof(header));
+  map->setData(reinterpret_cast<const char *>(map->storage_.data()),
+               num_bytes);
+
+  // Fill in the voxels. The last sample to reach a voxel is its seed
+  uint64_t *masks = map->storage_.data() + sizeof(Header) / sizeof(uint64_t);
+  float *seeds = reinterpret_cast<float *>(masks + num_voxels);
+  int64_t voxel[3];
+  for (size_t i = 0; i < positions.size(); ++i) {
+    map->toVoxel(positions[i], voxel);
+    const int64_t idx = map->voxelIndex(voxel);
+    if (idx < 0) {
+      continue;
+    }
+    masks[idx] |= uint64_t(1) << bins[i];
+    std::copy(joints.begin() + i * num_joints,
+              joints.begin() + (i + 1) * num_joints, seeds + idx * num_joints);
+  }
+  return map;
+}
+
+ReachabilityMapPtr ReachabilityMap::load(const std::string &filename) {
+  const int fd = open(filename.c_str(), O_RDONLY);
+  if (fd < 0) {
+    ROS_WARN_STREAM("Could not open reachability map: " << filename);
+    return nullptr;
+  }
+
+  // The mapping stays valid once the file is closed
+  struct stat file_stat;
+  void *mapping = MAP_FAILED;
+  if (fstat(fd, &file_stat) == 0 && file_stat.st_size > 0) {
+    mapping = mmap(nullptr, file_stat.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+  }
+  close(fd);
+  if (mapping == MAP_FAILED) {
+    ROS_WARN_STREAM("Could not map reachability map: " << filename);
+    return nullptr;
+  }
+
+  ReachabilityMapPtr map(new ReachabilityMap());
+  map->mapping_ = mapping;
+  map->mapping_size_ = file_stat.st_size;
+  if (!map->setData(static_cast<const char *>(mapping), file_stat.st_size)) {
+    ROS_WARN_STREAM("Invalid reachability map: " << filename);
+    return nullptr;
+  }
+  return map;
+}
+
+bool ReachabilityMap::save(const std::string &filename) const {
+  std::ofstream file(filename, std::ios::binary | std::ios::trunc);
+  if (!file) {
+    return false;
+  }
+  file.write(reinterpret_cast<const char *>(header_), data_size_);
+  return bool(file);
+}
+
+std::string ReachabilityMap::getGroupName() const {
+  return std::string(header_->group_name,
+                     strnlen(header_->group_name, sizeof(header_->group_name)));
+}
+
+std::string ReachabilityMap::getEEFrameName() const {
+  return std::string(
+      header_->ee_frame_name,
+      strnlen(header_->ee_frame_name, sizeof(header_->ee_frame_name)));
+}
+
+std::string ReachabilityMap::getBaseFrameName() const {
+  return std::string(
+      header_->base_frame_name,
+      strnlen(header_->base_frame_name, sizeof(header_->base_frame_name)));
+}
+
+Eigen::Isometry3d ReachabilityMap::getBasePose(
+    const moveit::core::RobotState &robot_state) const {
+  return robot_state.getFrameTransform(getBaseFrameName());
+}
+
+bool ReachabilityMap::isReachable(const Eigen::Isometry3d &pose,
+                                  const Eigen::Isometry3d &base_pose) const {
+  return isReachableFromBase(base_pose.inverse() * pose);
+}
+
+bool ReachabilityMap::isReachableFromBase(
+    const Eigen::Isometry3d &pose) const {
+  int polar, azimuth;
+  orientationBins(pose, polar, azimuth);
+  const uint64_t bins = neighborBins(polar, azimuth);
+
+  // Check the pose's voxel and the ones around it
+  int64_t center[3], voxel[3];
+  toVoxel(pose.translation(), center);
+  for (int64_t dx = -1; dx <= 1; ++dx) {
+    for (int64_t dy = -1; dy <= 1; ++dy) {
+      for (int64_t dz = -1; dz <= 1; ++dz) {
+        voxel[0] = center[0] + dx;
+        voxel[1] = center[1] + dy;
+        voxel[2] = center[2] + dz;
+        const int64_t idx = voxelIndex(voxel);
+        if (idx >= 0 && (masks_[idx] & bins)) {
+          return true;
+        }
+      }
+    }
+  }
+  return false;
+}
+
+bool ReachabilityMap::isPathReachable(
+    const ScrewPoseTable &pose_table,
+    const Eigen::Isometry3d &base_pose) const {
+  const Eigen::Isometry3d base_inverse = base_pose.inverse();
+  for (size_t i = 0; i < pose_table.numSegments(); ++i) {
+    for (size_t j = 0; j < pose_table.numWaypoints(i); ++j) {
+      if (!isReachableFromBase(base_inverse * pose_table.getWaypoint(i, j))) {
+        return false;
+      }
+    }
+  }
+  return true;
+}
+
+bool ReachabilityMap::getSeed(const Eigen::Isometry3d &pose,
+                              const Eigen::Isometry3d &base_pose,
+                              std::vector<double> &seed) const {
+  int64_t voxel[3];
+  toVoxel((base_pose.inverse() * pose).translation(), voxel);
+  const int64_t idx = voxelIndex(voxel);
+  if (idx < 0 || masks_[idx] == 0) {
+    return false;
+  }
+
+  const float *voxel_seed = seeds_ + idx * header_->num_joints;
+  seed.assign(voxel_seed, voxel_seed + header_->num_joints);
+  return true;
+}
+
+bool ReachabilityMap::setData(const char *data, const size_t size) {
+  if (size < sizeof(Header)) {
+    return false;
+  }
+  const Header *header = reinterpret_cast<const Header *>(data);
+  if (std::memcmp(header->magic, MAP_MAGIC, sizeof(MAP_MAGIC)) != 0 ||
+      header->resolution <= 0) {
+    return false;
+  }
+
+  const size_t num_voxels =
+      size_t(header->size[0]) * header->size[1] * header->size[2];
+  const size_t num_bytes =
+      sizeof(Header) + num_voxels * sizeof(uint64_t) +
+      num_voxels * header->num_joints * sizeof(float);
+  if (size < num_bytes) {
+    return false;
+  }
+
+  header_ = header;
+  masks_ = reinterpret_cast<const uint64_t *>(data + sizeof(Header));
+  seeds_ = reinterpret_cast<const float *>(masks_ + num_voxels);
+  data_size_ = num_bytes;
+  return true;
+}
+
+void ReachabilityMap::toVoxel(const Eigen::Vector3d &position,
+                              int64_t voxel[3]) const {
+  for (size_t i = 0; i < 3; ++i) {
+    voxel[i] = int64_t(
+        floor((position[i] - header_->origin[i]) / header_->resolution));
+  }
+}
+
+int64_t ReachabilityMap::voxelIndex(const int64_t voxel[3]) const {
+  for (size_t i = 0; i < 3; ++i) {
+    if (voxel[i] < 0 || voxel[i] >= int64_t(header_->size[i])) {
+      return -1;
+    }
+  }
+  return (voxel[0] * header_->size[1] + voxel[1]) * header_->size[2] +
+         voxel[2];
+}
+}  // namespace ap_planning
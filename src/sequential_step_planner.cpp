@@ -1,4 +1,5 @@
 #include <ap_planning/sequential_step_planner.hpp>
+#include <ap_planning/state_utils.hpp>
 
 namespace ap_planning {
 SequentialStepPlanner::SequentialStepPlanner(
@@ -9,9 +10,18 @@ SequentialStepPlanner::SequentialStepPlanner(
       robot_description_name_(robot_description_name),
       initialized_(false) {}
 
+SequentialStepPlanner::SequentialStepPlanner(
+    const PlanningContextPtr& planning_context,
+    const std::string& move_group_name)
+    : nh_(),
+      move_group_name_(move_group_name),
+      robot_description_name_(planning_context->getRobotDescriptionName()),
+      planning_context_(planning_context),
+      initialized_(false) {}
+
 bool SequentialStepPlanner::initialize() {
   // Read the solver name from the parameter server
-  std::string ik_solver_name;
+  std::string& ik_solver_name = ik_solver_name_;
   if (!nh_.getParam(ros::this_node::getName() + "/ik_solver_name",
                     ik_solver_name)) {
     ROS_WARN_STREAM(
@@ -25,15 +35,29 @@ bool SequentialStepPlanner::initialize() {
   solver_loader_ =
       std::make_shared<pluginlib::ClassLoader<ap_planning::IKSolverBase>>(
           "ap_planning", "ap_planning::IKSolverBase");
+  ik_solver_ = createSolver();
+  initialized_ = bool(ik_solver_);
+  return initialized_;
+}
+
+boost::shared_ptr<ap_planning::IKSolverBase>
+SequentialStepPlanner::createSolver() {
+  boost::shared_ptr<ap_planning::IKSolverBase> solver;
   try {
-    ik_solver_ = solver_loader_->createInstance(ik_solver_name);
+    solver = solver_loader_->createInstance(ik_solver_name_);
   } catch (pluginlib::PluginlibException& ex) {
     ROS_ERROR("Solver plugin failed to load, error was: %s", ex.what());
-    return false;
+    return nullptr;
   }
-  initialized_ =
-      ik_solver_->initialize(nh_, move_group_name_, robot_description_name_);
-  return initialized_;
+
+  bool success;
+  if (planning_context_) {
+    success = solver->initialize(nh_, planning_context_, move_group_name_);
+  } else {
+    success =
+        solver->initialize(nh_, move_group_name_, robot_description_name_);
+  }
+  return success ? solver : nullptr;
 }
 
 ap_planning::Result SequentialStepPlanner::plan(
@@ -64,4 +88,73 @@ ap_planning::Result SequentialStepPlanner::plan(const APPlanningRequest& req,
   return ik_solver_->plan(req, res);
 }
 
+ap_planning::Result SequentialStepPlanner::plan(const APPlanningRequest& req,
+                                                const APPlanningResponse& hint,
+                                                APPlanningResponse& res) {
+  // If we haven't already initialized, do so
+  if (!initialized_ && !initialize()) {
+    return ap_planning::INITIALIZATION_FAIL;
+  }
+
+  if (!ik_solver_) {
+    return ap_planning::INITIALIZATION_FAIL;
+  }
+
+  // Get the planning scene, like the solver does without a hint
+  const PlanningContextPtr planning_context =
+      planning_context_ ? planning_context_
+                        : PlanningContext::get(robot_description_name_);
+  const ros::WallTime scene_start = ros::WallTime::now();
+  const SceneSnapshotPtr snapshot = planning_context->takeSnapshot();
+  const double scene_time = (ros::WallTime::now() - scene_start).toSec();
+
+  const ap_planning::Result result =
+      ik_solver_->plan(req, snapshot, hint, res);
+  res.statistics.scene_time = scene_time;
+  res.statistics.total_time += scene_time;
+  return result;
+}
+
+void SequentialStepPlanner::planBatch(
+    const std::vector<APPlanningRequest>& reqs,
+    const APPlanningBatchOptions& options, APPlanningBatchResponse& batch_res) {
+  // If we haven't already initialized, do so
+  if ((!initialized_ && !initialize()) || !ik_solver_) {
+    batch_res.results.assign(reqs.size(), ap_planning::INITIALIZATION_FAIL);
+    batch_res.responses.assign(reqs.size(), APPlanningResponse());
+    batch_res.planned.assign(reqs.size(), false);
+    batch_res.best.reset();
+    return;
+  }
+
+  // Every request uses one scene, taken now. Solvers initialized from the
+  // robot description share the registered context
+  const PlanningContextPtr planning_context =
+      planning_context_ ? planning_context_
+                        : PlanningContext::get(robot_description_name_);
+  const SceneSnapshotPtr snapshot = planning_context->takeSnapshot();
+
+  // Each thread plans with its own solver. The first is the main one, and
+  // the rest are kept for later batches
+  size_t num_threads = batchThreadCount(options, reqs.size());
+  while (batch_solvers_.size() + 1 < num_threads) {
+    auto solver = createSolver();
+    if (!solver) {
+      break;
+    }
+    batch_solvers_.push_back(solver);
+  }
+  num_threads = std::min(num_threads, batch_solvers_.size() + 1);
+
+  runBatch(reqs, options, num_threads,
+           [&](size_t thread_idx, const APPlanningRequest& req,
+               const std::atomic<bool>&, APPlanningResponse& res) {
+             IKSolverBase& solver = thread_idx == 0
+                                        ? *ik_solver_
+                                        : *batch_solvers_.at(thread_idx - 1);
+             return solver.plan(req, snapshot, res);
+           },
+           batch_res);
+}
+
 }  // namespace ap_planning
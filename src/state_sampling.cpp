@@ -1,52 +1,137 @@
 #include <moveit/robot_model_loader/robot_model_loader.h>
+#include <ros/ros.h>
 #include <ap_planning/state_sampling.hpp>
 #include <ap_planning/state_utils.hpp>
 
+#include <mutex>
+
 namespace ap_planning {
+namespace {
+// How far a cached solution's tip may be from the IK pose. This is looser
+// than the cache resolution, since a hit may be for a nearby pose
+const double CACHE_POSITION_TOLERANCE = 1e-3;     // meters
+const double CACHE_ORIENTATION_TOLERANCE = 1e-2;  // radians
+}  // namespace
+
+IKCollisionChecker::IKCollisionChecker(
+    const moveit::core::JointModelGroup *jmg,
+    moveit::core::RobotState *robot_state,
+    const planning_scene::PlanningScene *scene, PlanningCounters *counters)
+    : jmg_(jmg),
+      robot_state_(robot_state),
+      scene_(scene),
+      counters_(counters) {
+  // We only need a yes / no answer, so stop at the first contact
+  collision_request_.contacts = false;
+  collision_request_.max_contacts = 1;
+}
 
-bool ikCallbackFnAdapter(const moveit::core::JointModelGroupPtr jmg,
-                         const moveit::core::RobotStatePtr robot_state,
-                         const planning_scene_monitor::LockedPlanningSceneRO ps,
-                         const std::vector<double> &joints,
-                         moveit_msgs::MoveItErrorCodes &error_code) {
+void IKCollisionChecker::operator()(const geometry_msgs::Pose & /*pose*/,
+                                    const std::vector<double> &joints,
+                                    moveit_msgs::MoveItErrorCodes &error_code) {
   // Copy the IK solution to the robot state
-  robot_state->setJointGroupPositions(jmg.get(), joints);
-  robot_state->update(true);
+  robot_state_->setJointGroupPositions(jmg_, joints);
+  robot_state_->update();
 
-  // Check for collisions
-  collision_detection::CollisionResult::ContactMap contacts;
-  ps->getCollidingPairs(contacts, *robot_state);
+  // Without a scene, collisions are left to the caller
+  if (!scene_) {
+    error_code.val = moveit_msgs::MoveItErrorCodes::SUCCESS;
+    return;
+  }
+  PlanningCounters::increment(counters_,
+                              &PlanningCounters::ik_collision_checks);
 
   // Set the error code
-  if (contacts.size() == 0) {
+  if (!isStateColliding(*scene_, *robot_state_, collision_request_,
+                        collision_result_)) {
     error_code.val = moveit_msgs::MoveItErrorCodes::SUCCESS;
   } else {
     error_code.val = moveit_msgs::MoveItErrorCodes::NO_IK_SOLUTION;
   }
+}
+
+bool IKCollisionChecker::solve(const kinematics::KinematicsBase &ik_solver,
+                               const geometry_msgs::Pose &pose,
+                               std::vector<double> &solution,
+                               const kinematics::KinematicsQueryOptions &opts) {
+  robot_state_->copyJointGroupPositions(jmg_, seed_state_);
+
+  // A cached solution from another scene must be checked again
+  if (cache_) {
+    bool collision_free = false;
+    bool found = cache_->find(jmg_->getName(), pose, seed_state_,
+                              scene_fingerprint_, solution, collision_free);
+    for (size_t i = 0; found && i < solution.size(); ++i) {
+      found = fabs(solution[i] - seed_state_[i]) <= max_joint_step_;
+    }
+    if (found) {
+      if (checkCached(ik_solver.getTipFrame(), pose, solution,
+                      collision_free)) {
+        PlanningCounters::increment(counters_,
+                                    &PlanningCounters::ik_cache_hits);
+        if (!collision_free && scene_) {
+          cache_->insert(jmg_->getName(), pose, seed_state_, solution,
+                         scene_fingerprint_);
+        }
+        return true;
+      }
+    }
+    PlanningCounters::increment(counters_, &PlanningCounters::ik_cache_misses);
+  }
+
+  PlanningCounters::increment(counters_, &PlanningCounters::ik_calls);
+
+  // Wrapping a reference keeps the callback from copying this checker
+  moveit_msgs::MoveItErrorCodes err;
+  if (!ik_solver.searchPositionIK(pose, seed_state_, 0.05, solution,
+                                  std::ref(*this), err, opts)) {
+    return false;
+  }
+  PlanningCounters::increment(counters_, &PlanningCounters::ik_successes);
+
+  // Solutions are only known to be collision free if there is a scene
+  if (cache_ && scene_) {
+    cache_->insert(jmg_->getName(), pose, seed_state_, solution,
+                   scene_fingerprint_);
+  }
   return true;
 }
 
-void increaseStateList(const moveit::core::JointModelGroupPtr jmg,
-                       const moveit::core::RobotStatePtr robot_state,
-                       const planning_scene_monitor::LockedPlanningSceneRO ps,
-                       const kinematics::KinematicsBasePtr ik_solver,
+bool IKCollisionChecker::checkCached(const std::string &tip_frame,
+                                     const geometry_msgs::Pose &pose,
+                                     const std::vector<double> &joints,
+                                     const bool collision_free) {
+  // Leave the robot state at the solution, like the IK callback does
+  robot_state_->setJointGroupPositions(jmg_, joints);
+  robot_state_->update();
+  if (collision_free) {
+    return true;
+  }
+
+  // The scene changes when joints outside the group move, which can move
+  // the group's base and so the tip
+  Eigen::Isometry3d target;
+  tf2::fromMsg(pose, target);
+  if (!posesAreClose(robot_state_->getFrameTransform(tip_frame), target,
+                     CACHE_POSITION_TOLERANCE, CACHE_ORIENTATION_TOLERANCE)) {
+    return false;
+  }
+  if (!scene_) {
+    return true;
+  }
+  PlanningCounters::increment(counters_,
+                              &PlanningCounters::ik_collision_checks);
+  return !isStateColliding(*scene_, *robot_state_, collision_request_,
+                           collision_result_);
+}
+
+void increaseStateList(IKCollisionChecker &checker,
+                       const kinematics::KinematicsBase &ik_solver,
                        const affordance_primitives::Pose &pose,
                        std::vector<std::vector<double>> &state_list) {
-  // Set up IK callback
-  kinematics::KinematicsBase::IKCallbackFn ik_callback_fn =
-      [&jmg, &robot_state, &ps](const geometry_msgs::Pose &pose,
-                                const std::vector<double> &joints,
-                                moveit_msgs::MoveItErrorCodes &error_code) {
-        ikCallbackFnAdapter(jmg, robot_state, ps, joints, error_code);
-      };
-
   // Try to solve the IK
-  std::vector<double> seed_state, ik_solution;
-  moveit_msgs::MoveItErrorCodes err;
-  kinematics::KinematicsQueryOptions opts;
-  robot_state->copyJointGroupPositions(jmg.get(), seed_state);
-  if (!ik_solver->searchPositionIK(pose, seed_state, 0.05, ik_solution,
-                                   ik_callback_fn, err, opts)) {
+  std::vector<double> ik_solution;
+  if (!checker.solve(ik_solver, pose, ik_solution)) {
     return;
   }
 
@@ -56,61 +141,233 @@ void increaseStateList(const moveit::core::JointModelGroupPtr jmg,
   }
 }
 
-ScrewValidSampler::ScrewValidSampler(const ob::SpaceInformation *si)
-    : ValidStateSampler(si) {
-  name_ = "screw_valid_sampler";
+void increaseStateLists(
+    const moveit::core::JointModelGroup *jmg,
+    const moveit::core::RobotState &robot_state,
+    const planning_scene::PlanningScene &scene,
+    const std::vector<kinematics::KinematicsBasePtr> &ik_solvers,
+    const std::vector<affordance_primitives::Pose> &poses,
+    const std::vector<size_t> &num_states, const size_t max_attempts,
+    std::vector<std::vector<std::vector<double>>> &state_lists,
+    PlanningCounters *counters, const ReachabilityMap *reachability,
+    IKCache *ik_cache, const std::size_t scene_fingerprint) {
+  state_lists.assign(poses.size(), {});
+  if (poses.size() != num_states.size() || ik_solvers.empty()) {
+    return;
+  }
+
+  // Start from the cached solutions. Ones from another scene are checked
+  // again first
+  if (ik_cache) {
+    moveit::core::RobotState cache_state(robot_state);
+    IKCollisionChecker cache_checker(jmg, &cache_state, &scene, counters);
+    const std::string &tip_frame = ik_solvers.front()->getTipFrame();
+    std::vector<std::vector<double>> cached;
+    std::vector<bool> collision_free;
+    for (size_t i = 0; i < poses.size(); ++i) {
+      ik_cache->findAll(jmg->getName(), poses[i], scene_fingerprint, cached,
+                        collision_free);
+      for (size_t j = 0;
+           j < cached.size() && state_lists[i].size() < num_states[i]; ++j) {
+        if (checkDuplicateState(state_lists[i], cached[j]) &&
+            cache_checker.checkCached(tip_frame, poses[i], cached[j],
+                                      collision_free[j])) {
+          PlanningCounters::increment(counters,
+                                      &PlanningCounters::ik_cache_hits);
+          state_lists[i].push_back(cached[j]);
+        }
+      }
+    }
+  }
+
+  // Look up the known good seeds once. The group does not move the map's
+  // base, so the seed state's joints do not matter
+  std::vector<std::vector<double>> map_seeds(poses.size());
+  if (reachability) {
+    moveit::core::RobotState base_state(robot_state);
+    base_state.update();
+    const Eigen::Isometry3d base_pose = reachability->getBasePose(base_state);
+    for (size_t i = 0; i < poses.size(); ++i) {
+      Eigen::Isometry3d pose;
+      tf2::fromMsg(poses[i], pose);
+      reachability->getSeed(pose, base_pose, map_seeds[i]);
+    }
+  }
+
+  size_t total_states = 0;
+  for (size_t i = 0; i < poses.size(); ++i) {
+    state_lists[i].reserve(num_states[i]);
+    total_states += num_states[i];
+  }
+
+  // The mutex guards the lists and attempt counts, but not the IK itself
+  std::mutex mutex;
+  std::vector<size_t> attempts(poses.size(), 0);
+  const size_t num_threads = std::min(ik_solvers.size(), total_states);
+  runInParallel(num_threads, [&](size_t thread_idx) {
+    moveit::core::RobotState thread_state(robot_state);
+    IKCollisionChecker checker(jmg, &thread_state, &scene, counters);
+    checker.setCache(ik_cache, scene_fingerprint);
+    const kinematics::KinematicsBase &ik_solver = *ik_solvers.at(thread_idx);
+
+    // The first attempt is seeded from the passed state, the rest randomly
+    bool use_random_seed = thread_idx > 0;
+    std::vector<std::vector<double>> found;
+    while (ros::ok()) {
+      // Work on whichever unfinished pose has had the fewest attempts
+      size_t pose_idx = poses.size();
+      size_t attempt = 0;
+      {
+        std::lock_guard<std::mutex> lock(mutex);
+        for (size_t i = 0; i < poses.size(); ++i) {
+          if (state_lists[i].size() < num_states[i] &&
+              attempts[i] < max_attempts &&
+              (pose_idx == poses.size() || attempts[i] < attempts[pose_idx])) {
+            pose_idx = i;
+          }
+        }
+        if (pose_idx == poses.size()) {
+          return;
+        }
+        attempt = attempts[pose_idx]++;
+      }
+
+      // Every time, we set to random states to get variety in solutions. The
+      // first attempt at a pose uses the map's seed, if it has one
+      if (attempt == 0 && !map_seeds[pose_idx].empty()) {
+        thread_state.setJointGroupPositions(jmg, map_seeds[pose_idx]);
+      } else if (use_random_seed) {
+        thread_state.setToRandomPositions(jmg);
+      }
+      use_random_seed = true;
+
+      found.clear();
+      increaseStateList(checker, ik_solver, poses[pose_idx], found);
+      if (found.empty()) {
+        continue;
+      }
+
+      // Only keep the solution if it is different from the others
+      std::lock_guard<std::mutex> lock(mutex);
+      auto &state_list = state_lists[pose_idx];
+      if (state_list.size() < num_states[pose_idx] &&
+          checkDuplicateState(state_list, found.front())) {
+        state_list.push_back(found.front());
+      }
+    }
+  });
+}
 
-  // Get move group parameters
-  std::string mg_string;
-  si->getStateSpace()->params().getParam("move_group", mg_string);
+kinematics::KinematicsBasePtr acquireSamplerIKSolver(
+    const DSSContext &context) {
+  // Samplers run on the planner's threads, so each needs its own solver
+  if (context.planning_context) {
+    auto solvers = context.planning_context->acquireIKSolvers(
+        context.joint_model_group->getName(), 1);
+    if (!solvers.empty()) {
+      return solvers.front();
+    }
+  }
+  return context.joint_model_group->getSolverInstance();
+}
+
+ScrewGoalSampler::ScrewGoalSampler(
+    const DSSContextPtr &context,
+    const kinematics::KinematicsBasePtr &ik_solver, const size_t max_goals,
+    const size_t max_attempts)
+    : context_(context),
+      ik_solver_(ik_solver),
+      max_goals_(max_goals),
+      max_attempts_(max_attempts),
+      attempts_(0),
+      stop_(false) {
+  kinematic_state_ = context_->state_pool->acquire();
+  joint_model_group_ = context_->joint_model_group;
+
+  // The planner is using the constraints, so work from a copy
+  const auto constraints = context_->copyConstraints();
+  goal_phi_ = constraints->goalPhi();
+  goal_pose_ = tf2::toMsg(context_->getPose(goal_phi_, *constraints));
+}
+
+bool ScrewGoalSampler::sample(const ob::GoalLazySamples *goal,
+                              ob::State *state) {
+  while (!stop_ && ros::ok() && attempts_ < max_attempts_ &&
+         goal->getStateCount() < max_goals_) {
+    // Every time, we set to random states to get variety in solutions
+    kinematic_state_->setToRandomPositions(joint_model_group_.get());
+    attempts_++;
+
+    const planning_scene::PlanningSceneConstPtr &scene =
+        context_->planning_scene;
+    IKCollisionChecker checker(joint_model_group_.get(),
+                               kinematic_state_.get(), scene.get(),
+                               context_->counters.get());
+    checker.setCache(context_->ik_cache.get(), context_->scene_fingerprint);
+    std::vector<std::vector<double>> found;
+    increaseStateList(checker, *ik_solver_, goal_pose_, found);
+    if (found.empty() || !checkDuplicateState(found_states_, found.front())) {
+      continue;
+    }
+    found_states_.push_back(found.front());
+
+    // Pass the new goal back to the goal
+    const auto &si = goal->getSpaceInformation();
+    si->copyState(state,
+                  vectorToState(si->getStateSpace(), goal_phi_, found.front())
+                      .get());
+    return true;
+  }
+  return false;
+}
 
-  // Load robot
-  kinematic_state_ = std::make_shared<moveit::core::RobotState>(
-      *(planning_scene->getPlanningSceneMonitor()
-            ->getStateMonitor()
-            ->getCurrentState()));
+ScrewValidSampler::ScrewValidSampler(const ob::SpaceInformation *si,
+                                     const DSSContextPtr &context)
+    : ValidStateSampler(si),
+      context_(context),
+      layout_(si->getStateSpace().get()) {
+  name_ = "screw_valid_sampler";
 
-  joint_model_group_ = std::make_shared<moveit::core::JointModelGroup>(
-      *kinematic_model->getJointModelGroup(mg_string));
+  // Share the robot model and a pooled state
+  kinematic_state_ = context_->state_pool->acquire();
+  joint_model_group_ = context_->joint_model_group;
 
-  ik_solver_ = joint_model_group_->getSolverInstance();
+  // Samplers may run on several planner threads, so each has its own
+  // constraints
+  constraints_ = context_->copyConstraints();
+  ik_solver_ = acquireSamplerIKSolver(*context_);
 }
 
 bool ScrewValidSampler::sample(ob::State *state) {
-  ob::CompoundStateSpace::StateType &compound_state =
-      *state->as<ob::CompoundStateSpace::StateType>();
-  ob::RealVectorStateSpace::StateType &screw_state =
-      *compound_state[0]->as<ob::RealVectorStateSpace::StateType>();
-  ob::RealVectorStateSpace::StateType &robot_state =
-      *compound_state[1]->as<ob::RealVectorStateSpace::StateType>();
+  double *screw_state = layout_.screwValues(state);
+  double *robot_state = layout_.jointValues(state);
 
   // Draw a random screw state within bounds
-  auto sampled_state = constraints->sampleUniformState();
+  auto sampled_state = constraints_->sampleUniformState();
   for (size_t i = 0; i < sampled_state.size(); ++i) {
     screw_state[i] = sampled_state[i];
   }
 
   // Get the pose of this theta
-  Eigen::Isometry3d current_pose = constraints->getPose(sampled_state);
+  Eigen::Isometry3d current_pose =
+      context_->getPose(sampled_state, *constraints_);
   geometry_msgs::Pose pose_msg = tf2::toMsg(current_pose);
 
-  // Set up IK callback
-  kinematics::KinematicsBase::IKCallbackFn ik_callback_fn =
-      [this](const geometry_msgs::Pose &pose, const std::vector<double> &joints,
-             moveit_msgs::MoveItErrorCodes &error_code) {
-        ikCallbackFnAdapter(joint_model_group_, kinematic_state_,
-                            *planning_scene, joints, error_code);
-      };
+  // Set up the collision checking for IK. Lazy planning leaves collisions to
+  // the planner's path checks
+  const planning_scene::PlanningScene *scene =
+      context_->request.lazy_collision_checking
+          ? nullptr
+          : context_->planning_scene.get();
+  IKCollisionChecker checker(joint_model_group_.get(), kinematic_state_.get(),
+                             scene, context_->counters.get());
+  checker.setCache(context_->ik_cache.get(), context_->scene_fingerprint);
 
   // Calculate IK for the pose
-  std::vector<double> ik_solution, seed_state;
-  kinematic_state_->copyJointGroupPositions(joint_model_group_.get(),
-                                            seed_state);
-  moveit_msgs::MoveItErrorCodes err;
+  std::vector<double> ik_solution;
   kinematics::KinematicsQueryOptions opts;
   // opts.return_approximate_solution = true;
-  bool found_ik = ik_solver_->searchPositionIK(
-      pose_msg, seed_state, 0.05, ik_solution, ik_callback_fn, err, opts);
+  bool found_ik = checker.solve(*ik_solver_, pose_msg, ik_solution, opts);
   if (!found_ik) {
     return false;
   }
@@ -126,36 +383,26 @@ bool ScrewValidSampler::sample(ob::State *state) {
   return true;
 }
 
-ob::ValidStateSamplerPtr allocScrewValidSampler(
-    const ob::SpaceInformation *si) {
-  return std::make_shared<ScrewValidSampler>(si);
+ob::ValidStateSamplerPtr allocScrewValidSampler(const ob::SpaceInformation *si,
+                                                const DSSContextPtr &context) {
+  return std::make_shared<ScrewValidSampler>(si, context);
 }
 
-ScrewSampler::ScrewSampler(const ob::StateSpace *state_space)
-    : StateSampler(state_space) {
-  // Get move group parameters
-  std::string mg_string;
-  state_space->params().getParam("move_group", mg_string);
+ScrewSampler::ScrewSampler(const ob::StateSpace *state_space,
+                           const DSSContextPtr &context)
+    : StateSampler(state_space), context_(context), layout_(state_space) {
+  kinematic_state_ = context_->state_pool->acquire();
+  joint_model_group_ = context_->joint_model_group;
 
-  kinematic_state_ = std::make_shared<moveit::core::RobotState>(
-      *(planning_scene->getPlanningSceneMonitor()
-            ->getStateMonitor()
-            ->getCurrentState()));
-
-  joint_model_group_ = std::make_shared<moveit::core::JointModelGroup>(
-      *kinematic_model->getJointModelGroup(mg_string));
-
-  ik_solver_ = joint_model_group_->getSolverInstance();
+  // Like ScrewValidSampler, this works from its own constraints
+  constraints_ = context_->copyConstraints();
+  ik_solver_ = acquireSamplerIKSolver(*context_);
 }
 
 void ScrewSampler::sample(ob::State *state,
                           const std::vector<double> screw_theta) {
-  ob::CompoundStateSpace::StateType &compound_state =
-      *state->as<ob::CompoundStateSpace::StateType>();
-  ob::RealVectorStateSpace::StateType &screw_state =
-      *compound_state[0]->as<ob::RealVectorStateSpace::StateType>();
-  ob::RealVectorStateSpace::StateType &robot_state =
-      *compound_state[1]->as<ob::RealVectorStateSpace::StateType>();
+  double *screw_state = layout_.screwValues(state);
+  double *robot_state = layout_.jointValues(state);
 
   // Set the screw state from input
   for (size_t i = 0; i < screw_theta.size(); ++i) {
@@ -163,26 +410,25 @@ void ScrewSampler::sample(ob::State *state,
   }
 
   // Get the pose of this theta
-  Eigen::Isometry3d current_pose = constraints->getPose(screw_theta);
+  Eigen::Isometry3d current_pose =
+      context_->getPose(screw_theta, *constraints_);
   geometry_msgs::Pose pose_msg = tf2::toMsg(current_pose);
 
-  // Set up IK callback
-  kinematics::KinematicsBase::IKCallbackFn ik_callback_fn =
-      [this](const geometry_msgs::Pose &pose, const std::vector<double> &joints,
-             moveit_msgs::MoveItErrorCodes &error_code) {
-        ikCallbackFnAdapter(joint_model_group_, kinematic_state_,
-                            *planning_scene, joints, error_code);
-      };
+  // Set up the collision checking for IK. Lazy planning leaves collisions to
+  // the planner's path checks
+  const planning_scene::PlanningScene *scene =
+      context_->request.lazy_collision_checking
+          ? nullptr
+          : context_->planning_scene.get();
+  IKCollisionChecker checker(joint_model_group_.get(), kinematic_state_.get(),
+                             scene, context_->counters.get());
+  checker.setCache(context_->ik_cache.get(), context_->scene_fingerprint);
 
   // Solve IK for the pose
-  std::vector<double> ik_solution, seed_state;
-  kinematic_state_->copyJointGroupPositions(joint_model_group_.get(),
-                                            seed_state);
-  moveit_msgs::MoveItErrorCodes err;
+  std::vector<double> ik_solution;
   kinematics::KinematicsQueryOptions opts;
   // opts.return_approximate_solution = true;
-  bool found_ik = ik_solver_->searchPositionIK(
-      pose_msg, seed_state, 0.05, ik_solution, ik_callback_fn, err, opts);
+  bool found_ik = checker.solve(*ik_solver_, pose_msg, ik_solution, opts);
   if (!found_ik) {
     return;
   }
@@ -198,43 +444,38 @@ void ScrewSampler::sample(ob::State *state,
 }
 
 void ScrewSampler::sampleUniform(ob::State *state) {
-  sample(state, constraints->sampleUniformState());
+  sample(state, constraints_->sampleUniformState());
 }
 
 void ScrewSampler::sampleUniformNear(ob::State *state, const ob::State *near,
                                      double distance) {
-  const ob::CompoundStateSpace::StateType &compound_state =
-      *near->as<ob::CompoundStateSpace::StateType>();
-  const ob::RealVectorStateSpace::StateType &screw_state =
-      *compound_state[0]->as<ob::RealVectorStateSpace::StateType>();
+  const double *screw_state = layout_.screwValues(near);
 
   // Extract the state
-  std::vector<double> screw_theta(constraints->size());
-  for (size_t i = 0; i < constraints->size(); ++i) {
+  std::vector<double> screw_theta(constraints_->size());
+  for (size_t i = 0; i < constraints_->size(); ++i) {
     screw_theta[i] = screw_state[i];
   }
 
-  sample(state, constraints->sampleUniformStateNear(screw_theta, distance));
+  sample(state, constraints_->sampleUniformStateNear(screw_theta, distance));
 }
 
 void ScrewSampler::sampleGaussian(ob::State *state, const ob::State *mean,
                                   double stdDev) {
-  const ob::CompoundStateSpace::StateType &compound_state =
-      *mean->as<ob::CompoundStateSpace::StateType>();
-  const ob::RealVectorStateSpace::StateType &screw_state =
-      *compound_state[0]->as<ob::RealVectorStateSpace::StateType>();
+  const double *screw_state = layout_.screwValues(mean);
 
   // Extract the state
-  std::vector<double> screw_theta(constraints->size());
-  for (size_t i = 0; i < constraints->size(); ++i) {
+  std::vector<double> screw_theta(constraints_->size());
+  for (size_t i = 0; i < constraints_->size(); ++i) {
     screw_theta[i] = screw_state[i];
   }
 
-  sample(state, constraints->sampleGaussianStateNear(screw_theta, stdDev));
+  sample(state, constraints_->sampleGaussianStateNear(screw_theta, stdDev));
 }
 
-ob::StateSamplerPtr allocScrewSampler(const ob::StateSpace *state_space) {
-  return std::make_shared<ScrewSampler>(state_space);
+ob::StateSamplerPtr allocScrewSampler(const ob::StateSpace *state_space,
+                                      const DSSContextPtr &context) {
+  return std::make_shared<ScrewSampler>(state_space, context);
 }
 
 }  // namespace ap_planning
@@ -1,7 +1,96 @@
+#include <boost/functional/hash.hpp>
 #include <moveit/robot_model_loader/robot_model_loader.h>
 #include <ap_planning/state_utils.hpp>
 
+#include <algorithm>
+#include <cmath>
+#include <limits>
+#include <stdexcept>
+#include <thread>
+
 namespace ap_planning {
+RobotStatePool::RobotStatePool(const moveit::core::RobotState &prototype)
+    : prototype_(prototype) {}
+
+void RobotStatePool::setPrototype(const moveit::core::RobotState &prototype) {
+  std::lock_guard<std::mutex> lock(mutex_);
+  prototype_ = prototype;
+}
+
+moveit::core::RobotStatePtr RobotStatePool::acquire() {
+  std::unique_ptr<moveit::core::RobotState> robot_state;
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    if (free_states_.empty()) {
+      robot_state.reset(new moveit::core::RobotState(prototype_));
+    } else {
+      // Copying into an existing state does not allocate
+      robot_state = std::move(free_states_.back());
+      free_states_.pop_back();
+      *robot_state = prototype_;
+    }
+  }
+
+  // Return the state to the pool when done, unless the pool is gone
+  const std::weak_ptr<RobotStatePool> weak_pool = shared_from_this();
+  return moveit::core::RobotStatePtr(
+      robot_state.release(), [weak_pool](moveit::core::RobotState *state) {
+        if (auto pool = weak_pool.lock()) {
+          pool->release(state);
+        } else {
+          delete state;
+        }
+      });
+}
+
+void RobotStatePool::release(moveit::core::RobotState *robot_state) {
+  std::lock_guard<std::mutex> lock(mutex_);
+  free_states_.emplace_back(robot_state);
+}
+
+void PlanningCounters::copyTo(APPlanningStatistics &statistics) const {
+  statistics.ik_calls = ik_calls;
+  statistics.ik_successes = ik_successes;
+  statistics.ik_collision_checks = ik_collision_checks;
+  statistics.is_valid_calls = is_valid_calls;
+  statistics.rejected_bounds = rejected_bounds;
+  statistics.rejected_screw_error = rejected_screw_error;
+  statistics.rejected_phi_mismatch = rejected_phi_mismatch;
+  statistics.rejected_collision = rejected_collision;
+  statistics.ik_cache_hits = ik_cache_hits;
+  statistics.ik_cache_misses = ik_cache_misses;
+  statistics.piece_joins = piece_joins;
+  statistics.failed_piece_joins = failed_piece_joins;
+}
+
+moveit::core::JointModelGroupPtr shareJointModelGroup(
+    const moveit::core::RobotModelPtr &model, const std::string &group_name) {
+  if (!model || !model->hasJointModelGroup(group_name)) {
+    return nullptr;
+  }
+
+  // Aliasing constructor: points at the group, but owns the model
+  return moveit::core::JointModelGroupPtr(
+      model, model->getJointModelGroup(group_name));
+}
+
+std::shared_ptr<affordance_primitives::ScrewConstraint>
+DSSContext::copyConstraints() const {
+  auto output = request.toConstraint();
+  output->setReferenceFrame(constraints->referenceFrame());
+  return output;
+}
+
+Eigen::Isometry3d DSSContext::getPose(
+    const std::vector<double> &phi,
+    affordance_primitives::ScrewConstraint &constraints) const {
+  Eigen::Isometry3d pose;
+  if (pose_table && pose_table->getPose(phi, pose)) {
+    return pose;
+  }
+  return constraints.getPose(phi);
+}
+
 bool checkDuplicateState(const std::vector<std::vector<double>> &states,
                          const std::vector<double> &new_state) {
   for (const auto &state : states) {
@@ -20,6 +109,537 @@ bool checkDuplicateState(const std::vector<std::vector<double>> &states,
   return true;
 }
 
+bool posesAreClose(const Eigen::Isometry3d &pose_a,
+                   const Eigen::Isometry3d &pose_b,
+                   const double position_tolerance,
+                   const double orientation_tolerance) {
+  const Eigen::AngleAxisd rotation(pose_a.linear().transpose() *
+                                   pose_b.linear());
+  return (pose_a.translation() - pose_b.translation()).norm() <
+             position_tolerance &&
+         fabs(rotation.angle()) < orientation_tolerance;
+}
+
+std::size_t sceneFingerprint(const std::size_t scene_version,
+                             const moveit::core::RobotState &robot_state,
+                             const moveit::core::JointModelGroup &jmg,
+                             const double joint_resolution) {
+  // The world can change without its objects or shapes changing (e.g. an
+  // octomap update), so it is only known by its version
+  std::size_t seed = 0;
+  boost::hash_combine(seed, scene_version);
+
+  // Hash the attached bodies
+  std::vector<const moveit::core::AttachedBody *> attached_bodies;
+  robot_state.getAttachedBodies(attached_bodies);
+  for (const auto &body : attached_bodies) {
+    boost::hash_combine(seed, body->getName());
+    boost::hash_combine(seed, body->getAttachedLinkName());
+  }
+
+  // Hash the joints outside the group, which are not planned for
+  const double *variables = robot_state.getVariablePositions();
+  std::vector<int64_t> positions(robot_state.getVariableCount());
+  for (size_t i = 0; i < positions.size(); ++i) {
+    positions[i] = llround(variables[i] / joint_resolution);
+  }
+  for (const int index : jmg.getVariableIndexList()) {
+    positions[index] = 0;
+  }
+  boost::hash_range(seed, positions.begin(), positions.end());
+
+  return seed;
+}
+
+double calculateSegmentSpacing(const ScrewSegment &segment,
+                               const double waypoint_dist,
+                               const double waypoint_ang) {
+  const double theta = segment.end_theta - segment.start_theta;
+
+  // Pure translation case
+  if (segment.screw_msg.is_pure_translation) {
+    const double num_waypoints = ceil(theta / waypoint_dist);
+    return theta / num_waypoints;
+  }
+
+  Eigen::Vector3d screw_dist, axis;
+  tf2::fromMsg(segment.screw_msg.origin, screw_dist);
+  tf2::fromMsg(segment.screw_msg.axis, axis);
+
+  // Project origin distance onto axis plane, to get distance to axis
+  screw_dist -= (screw_dist.dot(axis)) / (axis.squaredNorm()) * axis;
+
+  // Calculate the number of waypoints we need for angular and linear
+  const double wps_ang = ceil(theta / waypoint_ang);
+  const double wps_lin = ceil(theta * screw_dist.norm() / waypoint_ang);
+
+  // Use whichever needed more
+  const double num_waypoints = std::max(wps_ang, wps_lin);
+  return theta / num_waypoints;
+}
+
+ScrewPoseTable::ScrewPoseTable(
+    affordance_primitives::ScrewConstraint &constraints,
+    const std::vector<ScrewSegment> &segments, const double waypoint_dist,
+    const double waypoint_ang) {
+  const size_t num_segments = std::min(constraints.size(), segments.size());
+  const std::vector<double> lower = constraints.lowerBounds();
+  const std::vector<double> upper = constraints.upperBounds();
+
+  // Segments before the one being filled in are at their upper bounds, and
+  // the ones after are at their lower bounds
+  std::vector<double> phi = lower;
+  segments_.reserve(num_segments);
+  for (size_t i = 0; i < num_segments; ++i) {
+    Segment segment;
+    segment.start = lower.at(i);
+    segment.end = upper.at(i);
+    segment.offset = waypoints_.size();
+
+    const double range = segment.end - segment.start;
+    const double step = fabs(calculateSegmentSpacing(
+        segments.at(i), waypoint_dist, waypoint_ang));
+    const double num_steps =
+        step > 0 ? std::max(1.0, ceil(fabs(range) / step)) : 1.0;
+    segment.count = range != 0 ? size_t(num_steps) + 1 : 1;
+    segment.spacing = segment.count > 1 ? range / (segment.count - 1) : 0;
+
+    for (size_t j = 0; j < segment.count; ++j) {
+      phi.at(i) = j + 1 < segment.count ? segment.start + j * segment.spacing
+                                        : segment.end;
+      const Eigen::Isometry3d pose = constraints.getPose(phi);
+      waypoints_.push_back(
+          {Eigen::Quaterniond(pose.linear()), pose.translation()});
+    }
+    phi.at(i) = segment.end;
+    segments_.push_back(segment);
+  }
+}
+
+bool ScrewPoseTable::getPose(const std::vector<double> &phi,
+                             Eigen::Isometry3d &pose) const {
+  if (segments_.empty() || phi.size() != segments_.size()) {
+    return false;
+  }
+
+  // The active segment is the first one not at its end. The rest must still
+  // be at their starts
+  constexpr double tolerance = 1e-9;
+  size_t active = segments_.size() - 1;
+  for (size_t i = 0; i < segments_.size(); ++i) {
+    if (fabs(phi[i] - segments_[i].end) > tolerance) {
+      active = i;
+      break;
+    }
+  }
+  for (size_t i = active + 1; i < segments_.size(); ++i) {
+    if (fabs(phi[i] - segments_[i].start) > tolerance) {
+      return false;
+    }
+  }
+
+  // Find the waypoints on either side
+  const Segment &segment = segments_[active];
+  if (segment.count < 2) {
+    pose = getWaypoint(active, 0);
+    return true;
+  }
+  const double t = (phi[active] - segment.start) / segment.spacing;
+  const double max_t = double(segment.count - 1);
+  if (t < -tolerance / fabs(segment.spacing) ||
+      t > max_t + tolerance / fabs(segment.spacing)) {
+    return false;
+  }
+  const double clamped_t = std::min(std::max(t, 0.0), max_t);
+  const size_t index = std::min(size_t(clamped_t), segment.count - 2);
+  const double fraction = clamped_t - index;
+
+  // The waypoints are close together, so interpolating them is accurate
+  const Waypoint &a = waypoints_[segment.offset + index];
+  const Waypoint &b = waypoints_[segment.offset + index + 1];
+  pose.linear() = a.rotation.slerp(fraction, b.rotation).toRotationMatrix();
+  pose.translation() =
+      a.translation + fraction * (b.translation - a.translation);
+  pose.makeAffine();
+  return true;
+}
+
+Eigen::Isometry3d ScrewPoseTable::getWaypoint(const size_t segment,
+                                              const size_t index) const {
+  const Segment &this_segment = segments_.at(segment);
+  if (index >= this_segment.count) {
+    throw std::out_of_range("Waypoint index is past the end of the segment");
+  }
+  const Waypoint &waypoint = waypoints_[this_segment.offset + index];
+  Eigen::Isometry3d pose;
+  pose.linear() = waypoint.rotation.toRotationMatrix();
+  pose.translation() = waypoint.translation;
+  pose.makeAffine();
+  return pose;
+}
+
+bool projectToPose(const moveit::core::JointModelGroup *jmg,
+                   const std::string &ee_frame, const Eigen::Isometry3d &target,
+                   moveit::core::RobotState &robot_state,
+                   const size_t max_iterations, const double tolerance) {
+  const moveit::core::LinkModel *ee_link =
+      robot_state.getRigidlyConnectedParentLinkModel(ee_frame);
+  if (!ee_link) {
+    return false;
+  }
+
+  // Damping keeps the steps small near singularities
+  constexpr double damping = 1e-3;
+  Eigen::MatrixXd jacobian;
+  Eigen::VectorXd error(6), positions;
+  robot_state.copyJointGroupPositions(jmg, positions);
+  robot_state.updateLinkTransforms();
+  for (size_t i = 0; i <= max_iterations; ++i) {
+    // Calculate the pose error, in the model frame
+    const Eigen::Isometry3d &link_pose =
+        robot_state.getGlobalLinkTransform(ee_link);
+    const Eigen::Isometry3d ee_pose = robot_state.getFrameTransform(ee_frame);
+    const Eigen::AngleAxisd rotation_error(target.linear() *
+                                           ee_pose.linear().transpose());
+    error.head<3>() = target.translation() - ee_pose.translation();
+    error.tail<3>() = rotation_error.angle() * rotation_error.axis();
+    if (error.head<3>().norm() < tolerance &&
+        error.tail<3>().norm() < tolerance) {
+      return true;
+    }
+    if (i == max_iterations) {
+      break;
+    }
+
+    // Take a damped least squares step: dq = J^T (J J^T + d^2 I)^-1 e
+    const Eigen::Vector3d reference_point =
+        link_pose.inverse() * ee_pose.translation();
+    if (!robot_state.getJacobian(jmg, ee_link, reference_point, jacobian)) {
+      return false;
+    }
+    const Eigen::Matrix<double, 6, 6> jjt =
+        jacobian * jacobian.transpose() +
+        damping * damping * Eigen::Matrix<double, 6, 6>::Identity();
+    positions += jacobian.transpose() * jjt.ldlt().solve(error);
+
+    robot_state.setJointGroupPositions(jmg, positions);
+    robot_state.enforceBounds(jmg);
+    robot_state.copyJointGroupPositions(jmg, positions);
+    robot_state.updateLinkTransforms();
+  }
+  return false;
+}
+
+bool stepToPose(const moveit::core::JointModelGroup *jmg,
+                const std::string &ee_frame, const Eigen::Isometry3d &target,
+                moveit::core::RobotState &robot_state,
+                Eigen::MatrixXd &jacobian, const size_t max_iterations,
+                const double tolerance) {
+  // The group Jacobian is for the origin of the tip link
+  const moveit::core::LinkModel *tip_link = jmg->getLinkModels().back();
+  if (robot_state.getRigidlyConnectedParentLinkModel(ee_frame) != tip_link) {
+    return false;
+  }
+
+  // It is expressed in the frame of the link the group is attached to
+  const moveit::core::LinkModel *root_link =
+      jmg->getJointModels().front()->getParentLinkModel();
+
+  constexpr double damping = 1e-3;
+  Eigen::VectorXd error(6), tip_twist(6), positions;
+  robot_state.copyJointGroupPositions(jmg, positions);
+  robot_state.updateLinkTransforms();
+  bool jacobian_is_current = jacobian.size() > 0;
+  for (size_t i = 0; i <= max_iterations; ++i) {
+    // Calculate the pose error, in the model frame
+    const Eigen::Isometry3d ee_pose = robot_state.getFrameTransform(ee_frame);
+    const Eigen::AngleAxisd rotation_error(target.linear() *
+                                           ee_pose.linear().transpose());
+    error.head<3>() = target.translation() - ee_pose.translation();
+    error.tail<3>() = rotation_error.angle() * rotation_error.axis();
+    if (error.head<3>().norm() < tolerance &&
+        error.tail<3>().norm() < tolerance) {
+      return jacobian_is_current ||
+             robot_state.getJacobian(jmg, tip_link, Eigen::Vector3d::Zero(),
+                                     jacobian);
+    }
+    if (i == max_iterations) {
+      break;
+    }
+
+    // Move the error to the tip link origin and the Jacobian's frame
+    const Eigen::Isometry3d &tip_pose =
+        robot_state.getGlobalLinkTransform(tip_link);
+    const Eigen::Vector3d tip_to_ee =
+        ee_pose.translation() - tip_pose.translation();
+    const Eigen::Vector3d angular_error = error.tail<3>();
+    tip_twist.head<3>() = error.head<3>() - angular_error.cross(tip_to_ee);
+    tip_twist.tail<3>() = angular_error;
+    if (root_link) {
+      const Eigen::Matrix3d to_root =
+          robot_state.getGlobalLinkTransform(root_link).linear().transpose();
+      tip_twist.head<3>() = to_root * tip_twist.head<3>();
+      tip_twist.tail<3>() = to_root * tip_twist.tail<3>();
+    }
+
+    // Take a damped least squares step: dq = J^T (J J^T + d^2 I)^-1 e
+    if (!jacobian_is_current &&
+        !robot_state.getJacobian(jmg, tip_link, Eigen::Vector3d::Zero(),
+                                 jacobian)) {
+      return false;
+    }
+    const Eigen::Matrix<double, 6, 6> jjt =
+        jacobian * jacobian.transpose() +
+        damping * damping * Eigen::Matrix<double, 6, 6>::Identity();
+    positions += jacobian.transpose() * jjt.ldlt().solve(tip_twist);
+
+    robot_state.setJointGroupPositions(jmg, positions);
+    robot_state.enforceBounds(jmg);
+    robot_state.copyJointGroupPositions(jmg, positions);
+    robot_state.updateLinkTransforms();
+    jacobian_is_current = false;
+  }
+  return false;
+}
+
+double conditionNumber(const Eigen::MatrixXd &jacobian) {
+  // The Gram matrix is at most 6x6, so it can live on the stack
+  using GramMatrix =
+      Eigen::Matrix<double, Eigen::Dynamic, Eigen::Dynamic, 0, 6, 6>;
+  GramMatrix gram;
+  if (jacobian.cols() >= jacobian.rows()) {
+    gram.noalias() = jacobian * jacobian.transpose();
+  } else {
+    gram.noalias() = jacobian.transpose() * jacobian;
+  }
+
+  // The eigenvalues are the squared singular values, in increasing order
+  const Eigen::SelfAdjointEigenSolver<GramMatrix> solver(
+      gram, Eigen::EigenvaluesOnly);
+  const auto &eigenvalues = solver.eigenvalues();
+  if (eigenvalues.size() < 1 || eigenvalues[0] <= 0) {
+    return std::numeric_limits<double>::infinity();
+  }
+  return std::sqrt(eigenvalues[eigenvalues.size() - 1] / eigenvalues[0]);
+}
+
+bool isStateColliding(const planning_scene::PlanningScene &scene,
+                      const moveit::core::RobotState &robot_state,
+                      const collision_detection::CollisionRequest &request,
+                      collision_detection::CollisionResult &result) {
+  result.clear();
+  scene.checkCollision(request, result, robot_state);
+  return result.collision;
+}
+
+void runInParallel(const size_t num_threads,
+                   const std::function<void(size_t)> &fn) {
+  if (num_threads < 2) {
+    fn(0);
+    return;
+  }
+
+  std::vector<std::thread> threads;
+  threads.reserve(num_threads - 1);
+  for (size_t i = 1; i < num_threads; ++i) {
+    threads.emplace_back(fn, i);
+  }
+  fn(0);
+
+  for (auto &thread : threads) {
+    thread.join();
+  }
+}
+
+WorkerPool::WorkerPool(const size_t num_workers) {
+  workers_.reserve(num_workers);
+  for (size_t i = 0; i < num_workers; ++i) {
+    workers_.emplace_back([this, i]() { work(i); });
+  }
+}
+
+WorkerPool::~WorkerPool() {
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    stopping_ = true;
+  }
+  start_cv_.notify_all();
+  for (auto &worker : workers_) {
+    worker.join();
+  }
+}
+
+void WorkerPool::run(const size_t num_threads,
+                     const std::function<void(size_t)> &fn) {
+  std::lock_guard<std::mutex> run_lock(run_mutex_);
+  if (num_threads < 2 || workers_.empty()) {
+    fn(0);
+    return;
+  }
+  const size_t num_workers = std::min(num_threads, numThreads()) - 1;
+
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    fn_ = &fn;
+    num_active_ = num_workers;
+    num_running_ = num_workers;
+    ++generation_;
+  }
+  start_cv_.notify_all();
+  fn(0);
+
+  std::unique_lock<std::mutex> lock(mutex_);
+  done_cv_.wait(lock, [this]() { return num_running_ == 0; });
+  fn_ = nullptr;
+}
+
+void WorkerPool::work(const size_t worker_idx) {
+  size_t last_generation = 0;
+  std::unique_lock<std::mutex> lock(mutex_);
+  while (true) {
+    start_cv_.wait(lock, [this, last_generation]() {
+      return stopping_ || generation_ != last_generation;
+    });
+    if (stopping_) {
+      return;
+    }
+    last_generation = generation_;
+    if (worker_idx >= num_active_) {
+      continue;
+    }
+
+    // The calling thread is index 0
+    const std::function<void(size_t)> *fn = fn_;
+    lock.unlock();
+    (*fn)(worker_idx + 1);
+    lock.lock();
+    if (--num_running_ == 0) {
+      done_cv_.notify_all();
+    }
+  }
+}
+
+size_t batchThreadCount(const APPlanningBatchOptions &options,
+                        const size_t num_requests) {
+  const size_t num_threads =
+      options.num_threads > 0
+          ? options.num_threads
+          : std::max(1u, std::thread::hardware_concurrency());
+  return std::max(size_t(1), std::min(num_threads, num_requests));
+}
+
+void runBatch(const std::vector<APPlanningRequest> &reqs,
+              const APPlanningBatchOptions &options, const size_t num_threads,
+              const BatchPlanFn &plan_fn, APPlanningBatchResponse &batch_res) {
+  batch_res.results.assign(reqs.size(), PLANNING_FAIL);
+  batch_res.responses.assign(reqs.size(), APPlanningResponse());
+  batch_res.planned.assign(reqs.size(), false);
+  batch_res.best.reset();
+
+  std::atomic<bool> stop(false);
+  std::atomic<size_t> next_req(0);
+  std::mutex mutex;
+  size_t num_successes = 0;
+  runInParallel(num_threads, [&](size_t thread_idx) {
+    while (!stop) {
+      const size_t req_idx = next_req++;
+      if (req_idx >= reqs.size()) {
+        return;
+      }
+
+      APPlanningResponse &res = batch_res.responses[req_idx];
+      const Result result = plan_fn(thread_idx, reqs[req_idx], stop, res);
+
+      std::lock_guard<std::mutex> lock(mutex);
+      batch_res.results[req_idx] = result;
+      batch_res.planned[req_idx] = true;
+      if (result != SUCCESS || !res.trajectory_is_valid) {
+        continue;
+      }
+
+      // Keep track of the shortest successful path
+      ++num_successes;
+      if (!batch_res.best.has_value() ||
+          res.path_length <
+              batch_res.responses[batch_res.best.value()].path_length) {
+        batch_res.best = req_idx;
+      }
+
+      // Check if we can stop early
+      if ((options.num_successes > 0 &&
+           num_successes >= options.num_successes) ||
+          (options.good_path_length > 0 && res.path_length >= 0 &&
+           res.path_length <= options.good_path_length)) {
+        stop = true;
+      }
+    }
+  });
+}
+
+DSSStateSpace::DSSStateSpace(const size_t num_screw_dims,
+                             const double screw_weight,
+                             const double joint_weight)
+    : ob::RealVectorStateSpace(0),
+      num_screw_dims_(num_screw_dims),
+      screw_weight_(screw_weight),
+      joint_weight_(joint_weight) {
+  setName("DSS" + getName());
+}
+
+double DSSStateSpace::distance(const ob::State *state1,
+                               const ob::State *state2) const {
+  const double *values1 = state1->as<StateType>()->values;
+  const double *values2 = state2->as<StateType>()->values;
+  double screw_dist = 0, joint_dist = 0;
+  for (size_t i = 0; i < num_screw_dims_; ++i) {
+    const double diff = values1[i] - values2[i];
+    screw_dist += diff * diff;
+  }
+  for (size_t i = num_screw_dims_; i < dimension_; ++i) {
+    const double diff = values1[i] - values2[i];
+    joint_dist += diff * diff;
+  }
+  return screw_weight_ * sqrt(screw_dist) + joint_weight_ * sqrt(joint_dist);
+}
+
+double DSSStateSpace::getMaximumExtent() const {
+  double screw_extent = 0, joint_extent = 0;
+  for (size_t i = 0; i < dimension_; ++i) {
+    const double range = bounds_.high[i] - bounds_.low[i];
+    (i < num_screw_dims_ ? screw_extent : joint_extent) += range * range;
+  }
+  return screw_weight_ * sqrt(screw_extent) +
+         joint_weight_ * sqrt(joint_extent);
+}
+
+DSSStateLayout::DSSStateLayout(const ob::StateSpace *space)
+    : flat_(false), num_screw_dims_(0), screw_bounds_(0), joint_bounds_(0) {
+  if (const auto *flat_space = dynamic_cast<const DSSStateSpace *>(space)) {
+    flat_ = true;
+    num_screw_dims_ = flat_space->getNumScrewDimensions();
+
+    // Split the bounds into the screw and joint parts
+    const ob::RealVectorBounds &bounds = flat_space->getBounds();
+    for (size_t i = 0; i < bounds.low.size(); ++i) {
+      ob::RealVectorBounds &part =
+          i < num_screw_dims_ ? screw_bounds_ : joint_bounds_;
+      part.low.push_back(bounds.low[i]);
+      part.high.push_back(bounds.high[i]);
+    }
+    return;
+  }
+
+  const ob::CompoundStateSpace *compound_space =
+      space->as<ob::CompoundStateSpace>();
+  screw_bounds_ = compound_space->getSubspace(0)
+                      ->as<ob::RealVectorStateSpace>()
+                      ->getBounds();
+  joint_bounds_ = compound_space->getSubspace(1)
+                      ->as<ob::RealVectorStateSpace>()
+                      ->getBounds();
+  num_screw_dims_ = screw_bounds_.low.size();
+}
+
 ob::ScopedState<> vectorToState(ompl::base::StateSpacePtr space,
                                 const std::vector<double> &screw_state,
                                 const std::vector<double> &robot_state) {
@@ -37,20 +657,14 @@ ob::ScopedState<> vectorToState(ompl::base::StateSpacePtr space,
   return output;
 }
 
-ScrewGoal::ScrewGoal(const ob::SpaceInformationPtr si)
-    : GoalStates(si), screw_bounds_(1) {
-  ob::CompoundStateSpace *compound_space =
-      si_->getStateSpace()->as<ob::CompoundStateSpace>();
-  screw_bounds_ = compound_space->getSubspace(0)
-                      ->as<ob::RealVectorStateSpace>()
-                      ->getBounds();
-}
+ScrewGoal::ScrewGoal(const ob::SpaceInformationPtr si,
+                     const ob::GoalSamplingFn &sampler)
+    : GoalLazySamples(si, sampler, false),
+      layout_(si->getStateSpace().get()),
+      screw_bounds_(layout_.getScrewBounds()) {}
 
 double ScrewGoal::distanceGoal(const ob::State *state) const {
-  const ob::CompoundStateSpace::StateType &compound_state =
-      *state->as<ob::CompoundStateSpace::StateType>();
-  const ob::RealVectorStateSpace::StateType &screw_state =
-      *compound_state[0]->as<ob::RealVectorStateSpace::StateType>();
+  const double *screw_state = layout_.screwValues(state);
 
   Eigen::VectorXd error(screw_bounds_.high.size());
   for (size_t i = 0; i < screw_bounds_.high.size(); ++i) {
@@ -59,70 +673,189 @@ double ScrewGoal::distanceGoal(const ob::State *state) const {
   return error.norm();
 }
 
-ScrewValidityChecker::ScrewValidityChecker(const ob::SpaceInformationPtr &si)
-    : ob::StateValidityChecker(si), robot_bounds_(1) {
-  // Get move group parameter
-  std::string mg_string;
-  si->getStateSpace()->params().getParam("move_group", mg_string);
-  si->getStateSpace()->params().getParam("ee_frame_name", ee_frame_name_);
+ScrewValidityChecker::ScrewValidityChecker(const ob::SpaceInformationPtr &si,
+                                           const DSSContextPtr &context)
+    : ob::StateValidityChecker(si),
+      context_(context),
+      layout_(si->getStateSpace().get()),
+      robot_bounds_(layout_.getJointBounds()),
+      ee_link_(nullptr),
+      ee_offset_(Eigen::Isometry3d::Identity()),
+      workspaces_([this]() { return makeWorkspace(); }) {
+  ee_frame_name_ = context_->ee_frame_name;
 
-  kinematic_state_ = std::make_shared<moveit::core::RobotState>(
-      *(planning_scene->getPlanningSceneMonitor()
-            ->getStateMonitor()
-            ->getCurrentState()));
+  joint_model_group_ = context_->joint_model_group;
 
-  joint_model_group_ = std::make_shared<moveit::core::JointModelGroup>(
-      *kinematic_model->getJointModelGroup(mg_string));
+  // The state is only needed to find the EE link, so it goes back to the pool
+  const moveit::core::RobotStatePtr kinematic_state =
+      context_->state_pool->acquire();
+  kinematic_state->update();
+  ee_link_ =
+      kinematic_state->getRigidlyConnectedParentLinkModel(ee_frame_name_);
+  if (ee_link_) {
+    ee_offset_ = kinematic_state->getGlobalLinkTransform(ee_link_).inverse() *
+                 kinematic_state->getFrameTransform(ee_frame_name_);
+  }
+}
 
-  ob::CompoundStateSpace *compound_space =
-      si_->getStateSpace()->as<ob::CompoundStateSpace>();
-  robot_bounds_ = compound_space->getSubspace(1)
-                      ->as<ob::RealVectorStateSpace>()
-                      ->getBounds();
+std::unique_ptr<ScrewValidityChecker::Workspace>
+ScrewValidityChecker::makeWorkspace() const {
+  auto workspace = std::make_unique<Workspace>();
+  workspace->kinematic_state = context_->state_pool->acquire();
+  workspace->constraints = context_->copyConstraints();
+  workspace->screw_state.resize(workspace->constraints->size());
+  workspace->solution.solved_phi.reserve(workspace->constraints->size());
+
+  // We only need a yes / no answer, so stop at the first contact
+  workspace->collision_request.contacts = false;
+  workspace->collision_request.max_contacts = 1;
+  return workspace;
 }
 
 bool ScrewValidityChecker::isValid(const ob::State *state) const {
-  const ob::CompoundStateSpace::StateType &compound_state =
-      *state->as<ob::CompoundStateSpace::StateType>();
-  const ob::RealVectorStateSpace::StateType &screw_state =
-      *compound_state[0]->as<ob::RealVectorStateSpace::StateType>();
-  const ob::RealVectorStateSpace::StateType &robot_state =
-      *compound_state[1]->as<ob::RealVectorStateSpace::StateType>();
+  // Get this thread's copies of the robot state, constraints, and buffers
+  Workspace &workspace = workspaces_.get();
+  return checkScrew(state, workspace) && checkCollision(workspace);
+}
+
+void ScrewValidityChecker::releaseWorkspaces() {
+  workspaces_.clear();
+  std::lock_guard<std::mutex> lock(batch_mutex_);
+  batch_workspaces_.clear();
+}
+
+size_t ScrewValidityChecker::areValid(const std::vector<ob::State *> &states,
+                                      std::vector<char> &valid,
+                                      const bool stop_at_invalid,
+                                      size_t num_threads,
+                                      WorkerPool *pool) const {
+  valid.assign(states.size(), false);
+  if (states.empty()) {
+    return 0;
+  }
+
+  // Blocks are taken in order, so once a state is invalid the blocks after it
+  // can be skipped
+  const size_t block_size = 32;
+  const size_t num_blocks = (states.size() + block_size - 1) / block_size;
+  if (num_threads == 0) {
+    num_threads = std::max(1u, std::thread::hardware_concurrency());
+  }
+  num_threads = std::min(num_threads, num_blocks);
+  if (pool) {
+    num_threads = std::min(num_threads, pool->numThreads());
+  }
+
+  std::lock_guard<std::mutex> lock(batch_mutex_);
+  while (batch_workspaces_.size() < num_threads) {
+    batch_workspaces_.push_back(makeWorkspace());
+  }
+
+  std::atomic<size_t> first_invalid(states.size());
+  std::atomic<size_t> next_block(0);
+  std::atomic<size_t> num_valid(0);
+  const auto check_blocks = [&](size_t thread_idx) {
+    Workspace &workspace = *batch_workspaces_.at(thread_idx);
+    for (size_t block = next_block++; block < num_blocks;
+         block = next_block++) {
+      const size_t begin = block * block_size;
+      const size_t end = std::min(begin + block_size, states.size());
+      if (stop_at_invalid && begin > first_invalid) {
+        return;
+      }
+
+      // checkScrew() leaves the robot state updated, so collision is checked
+      // right after it, without redoing FK
+      size_t block_end = end;
+      for (size_t i = begin; i < block_end; ++i) {
+        valid[i] =
+            checkScrew(states[i], workspace) && checkCollision(workspace);
+        if (!valid[i] && stop_at_invalid) {
+          block_end = i + 1;
+        }
+      }
+
+      // Count the valid states, and keep the first invalid one
+      size_t block_valid = 0;
+      bool found_invalid = false;
+      for (size_t i = begin; i < block_end; ++i) {
+        if (valid[i]) {
+          ++block_valid;
+        } else if (!found_invalid) {
+          found_invalid = true;
+          size_t current = first_invalid;
+          while (i < current &&
+                 !first_invalid.compare_exchange_weak(current, i)) {
+          }
+        }
+      }
+      num_valid += block_valid;
+    }
+  };
+  if (pool) {
+    pool->run(num_threads, check_blocks);
+  } else {
+    runInParallel(num_threads, check_blocks);
+  }
+
+  // Blocks checked past the first invalid state do not count
+  if (stop_at_invalid && first_invalid < states.size()) {
+    std::fill(valid.begin() + first_invalid, valid.end(), false);
+    return first_invalid;
+  }
+  return num_valid;
+}
+
+bool ScrewValidityChecker::checkScrew(const ob::State *state,
+                                      Workspace &workspace) const {
+  const double *screw_state = layout_.screwValues(state);
+  const double *robot_state = layout_.jointValues(state);
+  const auto &constraints = workspace.constraints;
+  const auto &kinematic_state = workspace.kinematic_state;
+  PlanningCounters *counters = context_->counters.get();
+  PlanningCounters::increment(counters, &PlanningCounters::is_valid_calls);
 
   // Check screw bounds
-  std::vector<double> screw_space_state(constraints->size());
   for (size_t i = 0; i < constraints->size(); ++i) {
-    screw_space_state[i] = screw_state[i];
+    workspace.screw_state[i] = screw_state[i];
     if (screw_state[i] > constraints->upperBounds()[i] ||
         screw_state[i] < constraints->lowerBounds()[i]) {
+      PlanningCounters::increment(counters, &PlanningCounters::rejected_bounds);
       return false;
     }
   }
 
   // Check robot bounds
-  std::vector<double> joint_state(robot_bounds_.low.size());
   for (size_t i = 0; i < robot_bounds_.low.size(); ++i) {
     if (robot_state[i] > robot_bounds_.high[i] ||
         robot_state[i] < robot_bounds_.low[i]) {
+      PlanningCounters::increment(counters, &PlanningCounters::rejected_bounds);
       return false;
     }
-    joint_state[i] = robot_state[i];
   }
 
-  // Calculate the EE pose for this robot state
-  kinematic_state_->setJointGroupPositions(joint_model_group_.get(),
-                                           joint_state);
-  kinematic_state_->update(true);
-  auto this_state_pose = kinematic_state_->getFrameTransform(ee_frame_name_);
+  // Calculate the EE pose for this robot state. Only the links below the
+  // group's joints are dirty, so only those are recomputed
+  kinematic_state->setJointGroupPositions(joint_model_group_.get(),
+                                          robot_state);
+  kinematic_state->update();
+  const Eigen::Isometry3d this_state_pose =
+      ee_link_ ? kinematic_state->getGlobalLinkTransform(ee_link_) * ee_offset_
+               : kinematic_state->getFrameTransform(ee_frame_name_);
 
   // Call constraintFn
-  affordance_primitives::ScrewConstraintSolution sol;
-  if (!constraints->constraintFn(this_state_pose, screw_space_state, sol)) {
+  affordance_primitives::ScrewConstraintSolution &sol = workspace.solution;
+  if (!constraints->constraintFn(this_state_pose, workspace.screw_state,
+                                 sol)) {
+    PlanningCounters::increment(counters,
+                                &PlanningCounters::rejected_screw_error);
     return false;
   }
 
   // Check the error
   if (sol.error > constraints->tolerance()) {
+    PlanningCounters::increment(counters,
+                                &PlanningCounters::rejected_screw_error);
     return false;
   }
 
@@ -130,18 +863,162 @@ bool ScrewValidityChecker::isValid(const ob::State *state) const {
   for (size_t i = 0; i < constraints->size(); ++i) {
     const double dist = fabs(sol.solved_phi[i] - screw_state[i]);
     if (dist > 0.005) {
+      PlanningCounters::increment(counters,
+                                  &PlanningCounters::rejected_phi_mismatch);
       return false;
     }
   }
 
-  // Check for collisions
-  collision_detection::CollisionResult::ContactMap contacts;
-  const planning_scene::PlanningSceneConstPtr ps(*planning_scene);
-  ps->getCollidingPairs(contacts, *kinematic_state_);
-  if (contacts.size() > 0) {
+  return true;
+}
+
+bool ScrewValidityChecker::checkCollision(Workspace &workspace) const {
+  // Collision is checked last, as it is the most expensive. Binding the scene
+  // to a reference avoids copying the shared pointer
+  const planning_scene::PlanningSceneConstPtr &scene = context_->planning_scene;
+  if (isStateColliding(*scene, *workspace.kinematic_state,
+                       workspace.collision_request,
+                       workspace.collision_result)) {
+    PlanningCounters::increment(context_->counters.get(),
+                                &PlanningCounters::rejected_collision);
     return false;
   }
+  return true;
+}
 
+ScrewMotionValidator::ScrewMotionValidator(const ob::SpaceInformationPtr &si,
+                                           const DSSContextPtr &context,
+                                           const double waypoint_dist,
+                                           const double waypoint_ang,
+                                           const double max_joint_step)
+    : ob::MotionValidator(si),
+      context_(context),
+      layout_(si->getStateSpace().get()),
+      max_joint_step_(max_joint_step),
+      workspaces_([this]() {
+        auto workspace = std::unique_ptr<Workspace>(new Workspace{
+            context_->state_pool->acquire(), context_->copyConstraints(),
+            ob::ScopedState<>(si_->getStateSpace()),
+            ob::ScopedState<>(si_->getStateSpace())});
+        return workspace;
+      }) {
+  joint_model_group_ = context_->joint_model_group;
+
+  // Each screw axis is stepped like SPS would discretize it
+  for (const auto &segment : context_->request.screw_path) {
+    screw_steps_.push_back(
+        calculateSegmentSpacing(segment, waypoint_dist, waypoint_ang));
+  }
+}
+
+bool ScrewMotionValidator::checkMotion(const ob::State *s1,
+                                       const ob::State *s2) const {
+  return followMotion(s1, s2, nullptr, nullptr);
+}
+
+bool ScrewMotionValidator::checkMotion(
+    const ob::State *s1, const ob::State *s2,
+    std::pair<ob::State *, double> &last_valid) const {
+  return followMotion(s1, s2, nullptr, &last_valid);
+}
+
+bool ScrewMotionValidator::computeMotion(
+    const ob::State *s1, const ob::State *s2,
+    std::vector<ob::State *> &states) const {
+  return followMotion(s1, s2, &states, nullptr);
+}
+
+bool ScrewMotionValidator::followMotion(
+    const ob::State *s1, const ob::State *s2, std::vector<ob::State *> *states,
+    std::pair<ob::State *, double> *last_valid) const {
+  Workspace &ws = workspaces_.get();
+  const size_t n_screw = screw_steps_.size();
+  const size_t n_joints = joint_model_group_->getVariableCount();
+
+  // Extract the end states
+  const double *screw_a = layout_.screwValues(s1);
+  const double *screw_b = layout_.screwValues(s2);
+  const double *robot_a = layout_.jointValues(s1);
+  const double *robot_b = layout_.jointValues(s2);
+  ws.phi_a.assign(screw_a, screw_a + n_screw);
+  ws.phi_b.assign(screw_b, screw_b + n_screw);
+  ws.q_a.assign(robot_a, robot_a + n_joints);
+  ws.q_b.assign(robot_b, robot_b + n_joints);
+
+  // Use enough steps for both the screw and the joint motion
+  size_t num_steps = 1;
+  for (size_t i = 0; i < n_screw; ++i) {
+    const double steps =
+        ceil(fabs(ws.phi_b[i] - ws.phi_a[i]) / screw_steps_[i]);
+    num_steps = std::max(num_steps, size_t(steps));
+  }
+  for (size_t i = 0; i < n_joints; ++i) {
+    const double steps = ceil(fabs(ws.q_b[i] - ws.q_a[i]) / max_joint_step_);
+    num_steps = std::max(num_steps, size_t(steps));
+  }
+
+  ws.q_prev = ws.q_a;
+  for (size_t step = 1; step <= num_steps; ++step) {
+    const double t = double(step) / double(num_steps);
+    ws.phi.resize(n_screw);
+    for (size_t i = 0; i < n_screw; ++i) {
+      ws.phi[i] = ws.phi_a[i] + t * (ws.phi_b[i] - ws.phi_a[i]);
+    }
+
+    bool step_valid = true;
+    if (step == num_steps) {
+      // The last step must land on the end state
+      ws.q = ws.q_b;
+    } else {
+      // Head toward the end state, then project back onto the screw
+      ws.q.resize(n_joints);
+      const double remaining = double(num_steps - step + 1);
+      for (size_t i = 0; i < n_joints; ++i) {
+        ws.q[i] = ws.q_prev[i] + (ws.q_b[i] - ws.q_prev[i]) / remaining;
+      }
+      ws.kinematic_state->setJointGroupPositions(joint_model_group_.get(),
+                                                 ws.q);
+      step_valid = projectToPose(joint_model_group_.get(),
+                                 context_->ee_frame_name,
+                                 context_->getPose(ws.phi, *ws.constraints),
+                                 *ws.kinematic_state);
+      ws.kinematic_state->copyJointGroupPositions(joint_model_group_.get(),
+                                                  ws.q);
+    }
+
+    // Make sure the joints did not jump
+    for (size_t i = 0; step_valid && i < n_joints; ++i) {
+      step_valid = fabs(ws.q[i] - ws.q_prev[i]) <= max_joint_step_;
+    }
+
+    // Check the state itself, stopping at the first failure
+    if (step_valid) {
+      std::copy(ws.phi.begin(), ws.phi.end(),
+                layout_.screwValues(ws.step_state.get()));
+      std::copy(ws.q.begin(), ws.q.end(),
+                layout_.jointValues(ws.step_state.get()));
+      step_valid = si_->isValid(ws.step_state.get());
+    }
+
+    if (!step_valid) {
+      if (last_valid) {
+        if (last_valid->first) {
+          si_->copyState(last_valid->first,
+                         step == 1 ? s1 : ws.last_state.get());
+        }
+        last_valid->second = double(step - 1) / double(num_steps);
+      }
+      return false;
+    }
+
+    if (states) {
+      states->push_back(si_->cloneState(ws.step_state.get()));
+    }
+    if (last_valid) {
+      si_->copyState(ws.last_state.get(), ws.step_state.get());
+    }
+    ws.q_prev = ws.q;
+  }
   return true;
 }
 
@@ -0,0 +1,138 @@
+#include <ap_planning/time_parameterization.hpp>
+
+#include <algorithm>
+#include <cmath>
+#include <limits>
+
+namespace ap_planning {
+namespace {
+// The least time between points, so repeated points still move forward
+const double MIN_SEGMENT_TIME = 1e-3;  // seconds
+}  // namespace
+
+bool timeParameterize(const moveit::core::JointModelGroup& jmg,
+                      const std::vector<double>& screw_steps,
+                      const double max_screw_velocity,
+                      const double max_screw_acceleration,
+                      trajectory_msgs::JointTrajectory& trajectory) {
+  std::vector<trajectory_msgs::JointTrajectoryPoint>& points =
+      trajectory.points;
+  const size_t num_points = points.size();
+  const size_t num_joints = jmg.getVariableCount();
+  if (num_points < 2 ||
+      (!screw_steps.empty() && screw_steps.size() != num_points - 1)) {
+    return false;
+  }
+  for (const auto& point : points) {
+    if (point.positions.size() != num_joints) {
+      return false;
+    }
+  }
+
+  // Get the joint limits, like verifyTransition checks them
+  const double inf = std::numeric_limits<double>::infinity();
+  std::vector<double> max_velocity(num_joints, inf);
+  std::vector<double> max_acceleration(num_joints, inf);
+  size_t j = 0;
+  for (const moveit::core::JointModel* joint : jmg.getActiveJointModels()) {
+    if (j >= num_joints) {
+      break;
+    }
+    const auto& bounds = joint->getVariableBounds(joint->getName());
+    if (bounds.velocity_bounded_) {
+      max_velocity[j] =
+          std::min(bounds.max_velocity_, std::fabs(bounds.min_velocity_));
+    }
+    if (bounds.acceleration_bounded_) {
+      max_acceleration[j] = std::min(bounds.max_acceleration_,
+                                     std::fabs(bounds.min_acceleration_));
+    }
+    ++j;
+  }
+
+  // The path is parameterized by s, which goes up by 1 from each point to the
+  // next. Each segment limits the speed and acceleration of s
+  const size_t num_segments = num_points - 1;
+  std::vector<double> max_speed(num_segments), max_accel(num_segments);
+  for (size_t i = 0; i < num_segments; ++i) {
+    double speed = inf;
+    double accel = inf;
+    for (j = 0; j < num_joints; ++j) {
+      const double step =
+          std::fabs(points[i + 1].positions[j] - points[i].positions[j]);
+      if (step > 0) {
+        speed = std::min(speed, max_velocity[j] / step);
+        accel = std::min(accel, max_acceleration[j] / step);
+      }
+    }
+    if (!screw_steps.empty() && std::fabs(screw_steps[i]) > 0) {
+      const double step = std::fabs(screw_steps[i]);
+      if (max_screw_velocity > 0) {
+        speed = std::min(speed, max_screw_velocity / step);
+      }
+      if (max_screw_acceleration > 0) {
+        accel = std::min(accel, max_screw_acceleration / step);
+      }
+    }
+    max_speed[i] = std::min(speed, 1 / MIN_SEGMENT_TIME);
+    max_accel[i] = accel;
+  }
+
+  // Find the fastest speed at each point. It starts and ends at rest, is no
+  // faster than the segments on either side allow, and can only change as
+  // fast as the segments' accelerations allow
+  std::vector<double> speed(num_points, 0);
+  for (size_t k = 1; k + 1 < num_points; ++k) {
+    speed[k] = std::min(max_speed[k - 1], max_speed[k]);
+  }
+  for (size_t i = 0; i < num_segments; ++i) {
+    speed[i + 1] = std::min(
+        speed[i + 1], std::sqrt(speed[i] * speed[i] + 2 * max_accel[i]));
+  }
+  for (size_t i = num_segments; i-- > 0;) {
+    speed[i] = std::min(
+        speed[i], std::sqrt(speed[i + 1] * speed[i + 1] + 2 * max_accel[i]));
+  }
+
+  // The speed changes evenly across each segment. A segment that starts and
+  // ends at rest speeds up and slows down within it
+  std::vector<double> times(num_points, 0);
+  for (size_t i = 0; i < num_segments; ++i) {
+    const double speed_sum = speed[i] + speed[i + 1];
+    const double duration =
+        speed_sum > 0 ? 2 / speed_sum
+                      : std::max(2 / std::sqrt(max_accel[i]), 1 / max_speed[i]);
+    times[i + 1] = times[i] + std::max(duration, MIN_SEGMENT_TIME);
+  }
+
+  // Set the times, and the joint velocities along the path. At each point the
+  // path direction is the average of the segments on either side
+  for (size_t k = 0; k < num_points; ++k) {
+    trajectory_msgs::JointTrajectoryPoint& point = points[k];
+    point.time_from_start = ros::Duration(times[k]);
+    point.velocities.assign(num_joints, 0);
+    if (k == 0 || k + 1 == num_points) {
+      continue;
+    }
+    for (j = 0; j < num_joints; ++j) {
+      const double direction =
+          0.5 * (points[k + 1].positions[j] - points[k - 1].positions[j]);
+      point.velocities[j] = speed[k] * direction;
+    }
+  }
+
+  // The accelerations are differences of the velocities
+  for (size_t k = 0; k < num_points; ++k) {
+    const size_t before = k > 0 ? k - 1 : k;
+    const size_t after = k + 1 < num_points ? k + 1 : k;
+    const double dt = times[after] - times[before];
+    points[k].accelerations.assign(num_joints, 0);
+    for (j = 0; j < num_joints; ++j) {
+      points[k].accelerations[j] =
+          (points[after].velocities[j] - points[before].velocities[j]) / dt;
+    }
+  }
+  return true;
+}
+
+}  // namespace ap_planning